@@ -0,0 +1,57 @@
+-------------------------------------
+--  lxi-tools                      --
+--    https://lxi-tools.github.io  --
+-------------------------------------
+
+-- Asynchronous SCPI request test
+--
+-- Run using: lxi run --test async-test.lua
+--        or: lxi run --test --targets <address>,... async-test.lua
+
+psu = connect(target or "192.168.0.107", 5025, nil, 2000, "RAW")
+
+
+
+-- tc "await inside coroutine.wrap() blocks instead of yielding"
+
+local ids = coroutine.wrap(function()
+   for i = 1, 2 do
+      coroutine.yield(await(scpi_async(psu, "*IDN?")))
+   end
+end)
+
+local id1, id2 = ids(), ids()
+if type(id1) ~= "string" or id1 ~= id2 then
+   fail("generator did not yield responses")
+end
+
+
+
+-- tc "await_all inside coroutine blocks instead of yielding"
+
+local co = coroutine.create(function()
+   return await_all({scpi_async(psu, "*IDN?"), scpi_async(psu, "*IDN?")})
+end)
+
+local ok, responses = coroutine.resume(co)
+if not ok or type(responses) ~= "table" or coroutine.status(co) ~= "dead" then
+   fail("coroutine yielded before responses were available")
+end
+
+
+
+-- tc "async_run() runs tasks while others await"
+
+local id, n = async_run(
+   function() return await(scpi_async(psu, "*IDN?")) end,
+   function() coroutine.yield(); return 42 end)
+
+if type(id) ~= "string" or n ~= 42 then
+   fail("unexpected task results")
+end
+
+
+
+-- tc end
+
+disconnect(psu)
@@ -0,0 +1,27 @@
+-------------------------------------
+--  lxi-tools                      --
+--    https://lxi-tools.github.io  --
+-------------------------------------
+
+-- Test: Script error stops spawned state waiting for channel
+--
+-- A spawned state blocked in channel_receive() can not run its stop hook, so
+-- lxi used to hang waiting for it when the script failed. Now the waiting
+-- channel function raises an error and the script ends. Run using:
+--
+--   lxi run channel-stop-test.lua
+--
+-- Expected output is the error of the script followed by the error of the
+-- stopped worker, after which lxi exits.
+
+local channel = channel_new()
+
+spawn(function(channel)
+   channel_receive(channel)
+   print("Worker received value")
+end, channel)
+
+-- Give worker time to block in channel_receive()
+msleep(100)
+
+error("Script failed while worker waits for channel")
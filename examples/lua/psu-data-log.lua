@@ -24,25 +24,21 @@ chart0 = chart_new("line",                   -- chart type
                    "Time [ s ]",             -- x-axis label
                    "Current [ I ]",          -- y-axis label
                    25, 1, 800)               -- x max, y max, window width
-clock0 = clock_new()
 
--- Capture and plot samples at 10 Hz for 25 seconds
-clock = 0
-while (clock < 25)
-do
+-- Capture and plot samples at 10 Hz for 25 seconds (every() keeps ticks on a
+-- fixed 100 ms grid so query latency does not add up as drift)
+stats = every(100, function(tick, time)
    current = scpi(psu, "measure:current? (@1)")
    current = tonumber(current)
-   clock = clock_read(clock0)
-   chart_plot(chart0, clock, current)
-   msleep(100)
-end
+   chart_plot(chart0, time, current)
+end, 250)
+print(string.format("Missed samples: %d, max jitter: %.3f ms", stats.missed, stats.jitter_max * 1000))
 
 -- Save data
 chart_save_csv(chart0, "chart0.csv")
 chart_save_png(chart0, "chart0.png")
 
 -- Cleanup
-clock_free(clock0)
 chart_close(chart0)
 
 -- Turn off power supply
@@ -0,0 +1,41 @@
+-------------------------------------
+--  lxi-tools                      --
+--    https://lxi-tools.github.io  --
+-------------------------------------
+
+-- Example: Benchmark cost of a per-line stop hook on a tight numeric loop
+--
+-- Scripts run in lxi-gui used to have a C line hook installed all the time to
+-- check whether the Stop button was pressed. Now a hook is only installed
+-- when stop is requested, so scripts run at full speed. The old hook can be
+-- installed with the --line-hook option, so compare the time of:
+--
+--   lxi run stop-hook-benchmark.lua
+--   lxi run --line-hook stop-hook-benchmark.lua
+
+iterations = 20000000
+
+function loop()
+   local sum = 0
+   for i = 1, iterations do
+      sum = sum + i % 7 * 0.5
+   end
+   return sum
+end
+
+function measure(name)
+   local clock = clock_new()
+   clock_read(clock)
+   loop()
+   local time = clock_read(clock)
+   clock_free(clock)
+   print(string.format("%-24s %8.3f s", name, time))
+   return time
+end
+
+local _, mask = debug.gethook()
+if mask and mask:find("l") then
+   measure("Line hook")
+else
+   measure("No hook")
+end
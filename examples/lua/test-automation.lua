@@ -4,6 +4,8 @@
 -------------------------------------
 
 -- Automation test
+--
+-- Run using: lxi run --test test-automation.lua
 
 
 
@@ -35,4 +37,6 @@ print("This is test case 4")
 
 
 
--- tc save test-results.log
+-- tc end
+
+tc_save("test-results.xml")
@@ -0,0 +1,749 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "array.h"
+
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+
+enum array_op
+{
+    ARRAY_ADD,
+    ARRAY_SUB,
+    ARRAY_MUL,
+    ARRAY_DIV,
+};
+
+static const char *array_type_names[] = { "float64", "float32", "int16", NULL };
+
+size_t array_element_size(enum array_type type)
+{
+    switch (type)
+    {
+        case ARRAY_FLOAT64:
+            return sizeof(double);
+        case ARRAY_FLOAT32:
+            return sizeof(float);
+        case ARRAY_INT16:
+            return sizeof(int16_t);
+    }
+
+    return 0;
+}
+
+static inline double array_get(const struct array *array, size_t i)
+{
+    return array_element_get(array->type, array->data, i);
+}
+
+static inline void array_set(struct array *array, size_t i, double value)
+{
+    array_element_set(array->type, array->data, i, value);
+}
+
+struct array *array_push(lua_State *L, enum array_type type, size_t length)
+{
+    size_t element_size = array_element_size(type);
+    struct array *array;
+
+    if (length > (SIZE_MAX - sizeof(struct array)) / element_size)
+        luaL_error(L, "array: out of memory (%lu elements)", (unsigned long) length);
+
+    // Data follows header in same userdata so garbage collector accounts for
+    // its size
+    array = lua_newuserdata(L, sizeof(struct array) + length * element_size);
+    array->type = type;
+    array->length = length;
+    array->data = array + 1;
+    memset(array->data, 0, length * element_size);
+    luaL_getmetatable(L, ARRAY_METATABLE);
+    lua_setmetatable(L, -2);
+
+    return array;
+}
+
+struct array *array_check(lua_State *L, int index)
+{
+    return luaL_checkudata(L, index, ARRAY_METATABLE);
+}
+
+// Returns array at index or NULL if value is not an array
+static struct array *array_test(lua_State *L, int index)
+{
+    struct array *array = lua_touserdata(L, index);
+
+    if ((array == NULL) || !lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, ARRAY_METATABLE);
+    if (!lua_rawequal(L, -1, -2))
+        array = NULL;
+    lua_pop(L, 2);
+
+    return array;
+}
+
+enum array_type array_check_type(lua_State *L, int index)
+{
+    return luaL_checkoption(L, index, "float64", array_type_names);
+}
+
+// Convert 1-based Lua index (negative counts from end) to 0-based offset
+static long array_offset(const struct array *array, lua_Number index)
+{
+    long offset = (long) index;
+
+    if (offset < 0)
+        offset += array->length;
+    else
+        offset--;
+
+    return offset;
+}
+
+// lua: array = array_new(type, length | table)
+static int array_new(lua_State *L)
+{
+    enum array_type type = array_check_type(L, 1);
+    struct array *array;
+    size_t length, i;
+
+    if (lua_istable(L, 2))
+    {
+        length = lua_rawlen(L, 2);
+        array = array_push(L, type, length);
+        for (i=0; i<length; i++)
+        {
+            lua_rawgeti(L, 2, i + 1);
+            array_set(array, i, lua_tonumber(L, -1));
+            lua_pop(L, 1);
+        }
+        return 1;
+    }
+
+    luaL_argcheck(L, luaL_optnumber(L, 2, 0) >= 0, 2, "negative length");
+    array_push(L, type, (size_t) luaL_optnumber(L, 2, 0));
+    return 1;
+}
+
+// Separator between values of comma, semicolon or whitespace separated text
+static inline bool is_separator(char c)
+{
+    return (c == ',') || (c == ';') || (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+struct array *array_push_values(lua_State *L, enum array_type type, const char *text, size_t length)
+{
+    size_t capacity = 1, count = 0, i;
+    struct array *array;
+    const char *cursor;
+    char *end;
+    double value;
+
+    // Number of values is bounded by number of separators
+    for (i=0; i<length; i++)
+        if (is_separator(text[i]))
+            capacity++;
+
+    array = array_push(L, type, capacity);
+
+    cursor = text;
+    while (true)
+    {
+        while (is_separator(*cursor))
+            cursor++;
+        if (*cursor == 0)
+            break;
+
+        value = strtod(cursor, &end);
+        if ((end == cursor) || (count >= capacity))
+        {
+            lua_pop(L, 1);
+            return NULL;
+        }
+        array_set(array, count++, value);
+        cursor = end;
+    }
+    array->length = count;
+
+    return array;
+}
+
+// lua: array = array_from_csv(text, type)
+static int array_from_csv(lua_State *L)
+{
+    size_t length;
+    const char *text = luaL_checklstring(L, 1, &length);
+    enum array_type type = array_check_type(L, 2);
+
+    if (array_push_values(L, type, text, length) == NULL)
+        return luaL_error(L, "array_from_csv: invalid value");
+
+    return 1;
+}
+
+static bool host_is_big_endian(void)
+{
+    const uint16_t word = 1;
+
+    return *((const uint8_t *) &word) == 0;
+}
+
+static void swap_bytes(uint8_t *data, size_t length, size_t element_size)
+{
+    uint8_t byte;
+    size_t i, j;
+
+    for (i=0; i<length; i++, data += element_size)
+    {
+        for (j=0; j<element_size/2; j++)
+        {
+            byte = data[j];
+            data[j] = data[element_size - 1 - j];
+            data[element_size - 1 - j] = byte;
+        }
+    }
+}
+
+struct array *array_push_binary(lua_State *L, enum array_type type, const void *data, size_t size, bool big_endian)
+{
+    size_t element_size = array_element_size(type);
+    struct array *array;
+
+    if ((size % element_size) != 0)
+        return NULL;
+
+    array = array_push(L, type, size / element_size);
+    memcpy(array->data, data, size);
+    if (big_endian != host_is_big_endian())
+        swap_bytes(array->data, array->length, element_size);
+
+    return array;
+}
+
+bool array_check_big_endian(lua_State *L, int index)
+{
+    static const char *byte_orders[] = { "little", "big", NULL };
+
+    return luaL_checkoption(L, index, "little", byte_orders) == 1;
+}
+
+// lua: array = array_from_binary(data, type, byte_order)
+static int array_from_binary(lua_State *L)
+{
+    size_t size;
+    const char *data = luaL_checklstring(L, 1, &size);
+    enum array_type type = array_check_type(L, 2);
+    bool big_endian = array_check_big_endian(L, 3);
+
+    if (array_push_binary(L, type, data, size, big_endian) == NULL)
+        return luaL_error(L, "array_from_binary: data size (%d) is not a multiple of %d",
+                (int) size, (int) array_element_size(type));
+
+    return 1;
+}
+
+static int array_index(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    long offset;
+
+    // Element access
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        offset = array_offset(array, lua_tonumber(L, 2));
+        if ((offset < 0) || ((size_t) offset >= array->length))
+            lua_pushnil(L);
+        else if (array->type == ARRAY_INT16)
+            lua_pushinteger(L, ((int16_t *) array->data)[offset]);
+        else
+            lua_pushnumber(L, array_get(array, offset));
+        return 1;
+    }
+
+    // Method lookup
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+static int array_newindex(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    long offset;
+
+    offset = array_offset(array, luaL_checknumber(L, 2));
+    if ((offset < 0) || ((size_t) offset >= array->length))
+        return luaL_error(L, "array index out of range");
+    array_set(array, offset, luaL_checknumber(L, 3));
+
+    return 0;
+}
+
+static int array_len(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+
+    lua_pushinteger(L, array->length);
+    return 1;
+}
+
+static int array_tostring(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+
+    lua_pushfstring(L, "array(%s, %d)", array_type_names[array->type], (int) array->length);
+    return 1;
+}
+
+// lua: type = array:type()
+static int array_type_(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+
+    lua_pushstring(L, array_type_names[array->type]);
+    return 1;
+}
+
+// lua: value, index = array:min()
+static int array_min(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    double value, min;
+    size_t i, index = 0;
+
+    if (array->length == 0)
+        return 0;
+
+    min = array_get(array, 0);
+    for (i=1; i<array->length; i++)
+    {
+        value = array_get(array, i);
+        if (value < min)
+        {
+            min = value;
+            index = i;
+        }
+    }
+
+    lua_pushnumber(L, min);
+    lua_pushinteger(L, index + 1);
+    return 2;
+}
+
+// lua: value, index = array:max()
+static int array_max(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    double value, max;
+    size_t i, index = 0;
+
+    if (array->length == 0)
+        return 0;
+
+    max = array_get(array, 0);
+    for (i=1; i<array->length; i++)
+    {
+        value = array_get(array, i);
+        if (value > max)
+        {
+            max = value;
+            index = i;
+        }
+    }
+
+    lua_pushnumber(L, max);
+    lua_pushinteger(L, index + 1);
+    return 2;
+}
+
+static double array_sum_(const struct array *array)
+{
+    double sum = 0;
+    size_t i;
+
+    for (i=0; i<array->length; i++)
+        sum += array_get(array, i);
+
+    return sum;
+}
+
+// lua: sum = array:sum()
+static int array_sum(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+
+    lua_pushnumber(L, array_sum_(array));
+    return 1;
+}
+
+// lua: mean = array:mean()
+static int array_mean(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+
+    if (array->length == 0)
+        return 0;
+
+    lua_pushnumber(L, array_sum_(array) / array->length);
+    return 1;
+}
+
+// lua: rms = array:rms()
+static int array_rms(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    double value, sum = 0;
+    size_t i;
+
+    if (array->length == 0)
+        return 0;
+
+    for (i=0; i<array->length; i++)
+    {
+        value = array_get(array, i);
+        sum += value * value;
+    }
+
+    lua_pushnumber(L, sqrt(sum / array->length));
+    return 1;
+}
+
+// lua: std = array:std()
+static int array_std(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    double mean, value, sum = 0;
+    size_t i;
+
+    if (array->length == 0)
+        return 0;
+
+    // Two passes to stay accurate for signals with large offset
+    mean = array_sum_(array) / array->length;
+    for (i=0; i<array->length; i++)
+    {
+        value = array_get(array, i) - mean;
+        sum += value * value;
+    }
+
+    lua_pushnumber(L, sqrt(sum / array->length));
+    return 1;
+}
+
+// lua: array = array:slice(first, last)
+static int array_slice(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    long first = array_offset(array, luaL_optnumber(L, 2, 1));
+    long last = array_offset(array, luaL_optnumber(L, 3, -1));
+    size_t element_size = array_element_size(array->type);
+    struct array *slice;
+
+    // Clamp to array bounds like string.sub()
+    if (first < 0)
+        first = 0;
+    if (last >= (long) array->length)
+        last = array->length - 1;
+    if (last < first)
+        last = first - 1;
+
+    slice = array_push(L, array->type, last - first + 1);
+    memcpy(slice->data, (char *) array->data + first * element_size, slice->length * element_size);
+
+    return 1;
+}
+
+// lua: array = array:convert(type)
+static int array_convert(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    enum array_type type = array_check_type(L, 2);
+    struct array *result;
+    size_t i;
+
+    result = array_push(L, type, array->length);
+    for (i=0; i<array->length; i++)
+        array_set(result, i, array_get(array, i));
+
+    return 1;
+}
+
+// lua: table = array:totable()
+static int array_totable(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    size_t i;
+
+    lua_createtable(L, array->length, 0);
+    for (i=0; i<array->length; i++)
+    {
+        lua_pushnumber(L, array_get(array, i));
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+static int array_arith(lua_State *L, enum array_op op)
+{
+    struct array *a = array_test(L, 1);
+    struct array *b = array_test(L, 2);
+    struct array *result;
+    enum array_type type;
+    double x = 0, y = 0;
+    size_t length, i;
+
+    if ((a == NULL) && (b == NULL))
+        return luaL_error(L, "array arithmetic requires an array operand");
+    if ((a != NULL) && (b != NULL) && (a->length != b->length))
+        return luaL_error(L, "array length mismatch (%d vs %d)", (int) a->length, (int) b->length);
+    if (a == NULL)
+        x = luaL_checknumber(L, 1);
+    if (b == NULL)
+        y = luaL_checknumber(L, 2);
+
+    // Result stays float32 only if all array operands are float32
+    if (((a == NULL) || (a->type == ARRAY_FLOAT32)) && ((b == NULL) || (b->type == ARRAY_FLOAT32)))
+        type = ARRAY_FLOAT32;
+    else
+        type = ARRAY_FLOAT64;
+
+    length = (a != NULL) ? a->length : b->length;
+    result = array_push(L, type, length);
+
+    for (i=0; i<length; i++)
+    {
+        if (a != NULL)
+            x = array_get(a, i);
+        if (b != NULL)
+            y = array_get(b, i);
+
+        switch (op)
+        {
+            case ARRAY_ADD:
+                array_set(result, i, x + y);
+                break;
+            case ARRAY_SUB:
+                array_set(result, i, x - y);
+                break;
+            case ARRAY_MUL:
+                array_set(result, i, x * y);
+                break;
+            case ARRAY_DIV:
+                array_set(result, i, x / y);
+                break;
+        }
+    }
+
+    return 1;
+}
+
+static int array_add(lua_State *L)
+{
+    return array_arith(L, ARRAY_ADD);
+}
+
+static int array_sub(lua_State *L)
+{
+    return array_arith(L, ARRAY_SUB);
+}
+
+static int array_mul(lua_State *L)
+{
+    return array_arith(L, ARRAY_MUL);
+}
+
+static int array_div(lua_State *L)
+{
+    return array_arith(L, ARRAY_DIV);
+}
+
+static int array_unm(lua_State *L)
+{
+    lua_settop(L, 1);
+    lua_pushnumber(L, -1);
+    return array_arith(L, ARRAY_MUL);
+}
+
+// lua: status, message = array:save_csv(filename)
+static int array_save_csv(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    const char *filename = luaL_checkstring(L, 2);
+    FILE *file;
+    size_t i;
+
+    file = fopen(filename, "w");
+    if (file == NULL)
+        goto error;
+
+    // One value per line with enough precision to restore value exactly
+    for (i=0; i<array->length; i++)
+    {
+        switch (array->type)
+        {
+            case ARRAY_FLOAT64:
+                fprintf(file, "%.17g\n", ((double *) array->data)[i]);
+                break;
+            case ARRAY_FLOAT32:
+                fprintf(file, "%.9g\n", ((float *) array->data)[i]);
+                break;
+            case ARRAY_INT16:
+                fprintf(file, "%d\n", ((int16_t *) array->data)[i]);
+                break;
+        }
+    }
+
+    if (fclose(file) != 0)
+        goto error;
+
+    lua_pushboolean(L, true);
+    return 1;
+
+error:
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    return 2;
+}
+
+// lua: status, message = array:save_binary(filename)
+static int array_save_binary(lua_State *L)
+{
+    struct array *array = array_check(L, 1);
+    const char *filename = luaL_checkstring(L, 2);
+    size_t element_size = array_element_size(array->type);
+    size_t written;
+    void *data = array->data;
+    FILE *file;
+
+    // Always little endian
+    if (host_is_big_endian())
+    {
+        data = malloc(array->length * element_size + 1);
+        if (data == NULL)
+            return luaL_error(L, "array: out of memory");
+        memcpy(data, array->data, array->length * element_size);
+        swap_bytes(data, array->length, element_size);
+    }
+
+    file = fopen(filename, "wb");
+    if (file == NULL)
+        goto error;
+    written = fwrite(data, element_size, array->length, file);
+    if ((fclose(file) != 0) || (written != array->length))
+        goto error;
+
+    if (data != array->data)
+        free(data);
+    lua_pushboolean(L, true);
+    return 1;
+
+error:
+    if (data != array->data)
+        free(data);
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    return 2;
+}
+
+static const luaL_Reg array_methods[] =
+{
+    {"length", array_len},
+    {"type", array_type_},
+    {"min", array_min},
+    {"max", array_max},
+    {"sum", array_sum},
+    {"mean", array_mean},
+    {"rms", array_rms},
+    {"std", array_std},
+    {"slice", array_slice},
+    {"convert", array_convert},
+    {"totable", array_totable},
+    {"add", array_add},
+    {"sub", array_sub},
+    {"mul", array_mul},
+    {"div", array_div},
+    {"save_csv", array_save_csv},
+    {"save_binary", array_save_binary},
+    {NULL, NULL}
+};
+
+static const luaL_Reg array_metamethods[] =
+{
+    {"__newindex", array_newindex},
+    {"__len", array_len},
+    {"__tostring", array_tostring},
+    {"__add", array_add},
+    {"__sub", array_sub},
+    {"__mul", array_mul},
+    {"__div", array_div},
+    {"__unm", array_unm},
+    {NULL, NULL}
+};
+
+// Works with all Lua versions (luaL_register vs. luaL_setfuncs)
+static void set_functions(lua_State *L, const luaL_Reg *functions)
+{
+    for (; functions->name != NULL; functions++)
+    {
+        lua_pushcfunction(L, functions->func);
+        lua_setfield(L, -2, functions->name);
+    }
+}
+
+int lua_register_array(lua_State *L)
+{
+    luaL_newmetatable(L, ARRAY_METATABLE);
+    set_functions(L, array_metamethods);
+
+    // Index numbers as elements, anything else as methods
+    lua_newtable(L);
+    set_functions(L, array_methods);
+    lua_pushcclosure(L, array_index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pop(L, 1);
+
+    lua_register(L, "array_new", array_new);
+    lua_register(L, "array_from_csv", array_from_csv);
+    lua_register(L, "array_from_binary", array_from_binary);
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <lua.h>
+
+#define ARRAY_METATABLE "lxi.array"
+
+enum array_type
+{
+    ARRAY_FLOAT64,
+    ARRAY_FLOAT32,
+    ARRAY_INT16,
+};
+
+// Typed numeric array (Lua userdata with data following header)
+struct array
+{
+    enum array_type type;
+    size_t length;
+    void *data;
+};
+
+// Element i of data of given type
+static inline double array_element_get(enum array_type type, const void *data, size_t i)
+{
+    switch (type)
+    {
+        case ARRAY_FLOAT64:
+            return ((const double *) data)[i];
+        case ARRAY_FLOAT32:
+            return ((const float *) data)[i];
+        case ARRAY_INT16:
+            return ((const int16_t *) data)[i];
+    }
+
+    return 0;
+}
+
+// Set element i of data of given type (integers are rounded and saturated)
+static inline void array_element_set(enum array_type type, void *data, size_t i, double value)
+{
+    switch (type)
+    {
+        case ARRAY_FLOAT64:
+            ((double *) data)[i] = value;
+            break;
+        case ARRAY_FLOAT32:
+            ((float *) data)[i] = value;
+            break;
+        case ARRAY_INT16:
+            if (value <= INT16_MIN)
+                ((int16_t *) data)[i] = INT16_MIN;
+            else if (value >= INT16_MAX)
+                ((int16_t *) data)[i] = INT16_MAX;
+            else
+                ((int16_t *) data)[i] = (int16_t) floor(value + 0.5);
+            break;
+    }
+}
+
+// Push new zero filled array on Lua stack (raises Lua error if out of memory)
+struct array *array_push(lua_State *L, enum array_type type, size_t length);
+
+// Push array parsed from comma, semicolon or whitespace separated values
+// (text must be zero terminated). Returns NULL and pushes nothing if text
+// contains invalid values.
+struct array *array_push_values(lua_State *L, enum array_type type, const char *text, size_t length);
+
+// Push array copied from binary data of given byte order. Returns NULL and
+// pushes nothing if size is not a multiple of element size.
+struct array *array_push_binary(lua_State *L, enum array_type type, const void *data, size_t size, bool big_endian);
+
+// Check that argument at index is an array
+struct array *array_check(lua_State *L, int index);
+
+// Check argument at index is element type name (default "float64")
+enum array_type array_check_type(lua_State *L, int index);
+
+// Check argument at index is byte order "little" (default) or "big"
+bool array_check_big_endian(lua_State *L, int index);
+
+// Size of one element of given type in bytes
+size_t array_element_size(enum array_type type);
+
+int lua_register_array(lua_State *L);
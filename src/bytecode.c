@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "error.h"
+#include "misc.h"
+#include "bytecode.h"
+#include "config.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#if HAVE_LUAJIT
+#include <luajit.h>
+#endif
+
+#define BYTECODE_CACHE_MAX 256 // Maximum number of cached chunks
+#define PATH_LENGTH_MAX 1000
+
+static bool bytecode_cache_enabled = true;
+
+struct dump_buffer
+{
+    char *data;
+    size_t size;
+    size_t allocated;
+};
+
+void bytecode_cache_enable(bool enable)
+{
+    bytecode_cache_enabled = enable;
+}
+
+// Bytecode depends on Lua implementation and size of its numbers
+static uint64_t bytecode_format_hash(void)
+{
+    char format[128];
+
+    snprintf(format, sizeof(format), "%s %s %d %d", LUA_RELEASE,
+#if HAVE_LUAJIT
+             LUAJIT_VERSION,
+#else
+             "",
+#endif
+             (int) sizeof(lua_Number), (int) sizeof(lua_Integer));
+
+    return hash_fnv1a(format, strlen(format));
+}
+
+static int dump_writer(lua_State *L, const void *p, size_t size, void *data)
+{
+    struct dump_buffer *buffer = data;
+    char *new_data;
+
+    (void) L;
+
+    if (buffer->size + size > buffer->allocated)
+    {
+        buffer->allocated = (buffer->size + size) * 2;
+        new_data = realloc(buffer->data, buffer->allocated);
+        if (new_data == NULL)
+            return 1;
+        buffer->data = new_data;
+    }
+    memcpy(buffer->data + buffer->size, p, size);
+    buffer->size += size;
+
+    return 0;
+}
+
+static char *file_read(const char *filename, size_t *size)
+{
+    struct stat file_stat;
+    char *data;
+    FILE *file;
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+    if ((fstat(fileno(file), &file_stat) != 0) || (file_stat.st_size <= 0))
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    *size = file_stat.st_size;
+    data = malloc(*size + 1);
+    if ((data != NULL) && (fread(data, 1, *size, file) != *size))
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+
+    if (data != NULL)
+        data[*size] = 0;
+
+    return data;
+}
+
+// Remove least recently used chunks if cache is full
+static void cache_trim(const char *directory)
+{
+    char path[PATH_LENGTH_MAX], oldest_path[PATH_LENGTH_MAX];
+    time_t oldest_time = 0;
+    struct stat file_stat;
+    struct dirent *entry;
+    size_t length;
+    int count;
+    DIR *dir;
+
+    do
+    {
+        dir = opendir(directory);
+        if (dir == NULL)
+            return;
+
+        count = 0;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            length = strlen(entry->d_name);
+            if ((length < 5) || (strcmp(entry->d_name + length - 5, ".luac") != 0))
+                continue;
+            if ((snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name) >= (int) sizeof(path)) ||
+                (stat(path, &file_stat) != 0))
+                continue;
+            if ((count == 0) || (file_stat.st_mtime < oldest_time))
+            {
+                oldest_time = file_stat.st_mtime;
+                strcpy(oldest_path, path);
+            }
+            count++;
+        }
+        closedir(dir);
+
+        if (count > BYTECODE_CACHE_MAX)
+            unlink(oldest_path);
+    } while (count > BYTECODE_CACHE_MAX);
+}
+
+static void cache_store(lua_State *L, const char *path)
+{
+    char directory[PATH_LENGTH_MAX];
+    struct dump_buffer buffer = { NULL, 0, 0 };
+    char temp_path[PATH_LENGTH_MAX + 8];
+    FILE *file;
+    int status, fd;
+
+    // Keep debug information so error messages still refer to source lines
+#if LUA_VERSION_NUM >= 503
+    status = lua_dump(L, dump_writer, &buffer, 0);
+#else
+    status = lua_dump(L, dump_writer, &buffer);
+#endif
+    if ((status != 0) || (buffer.size == 0))
+        goto error;
+
+    if (cache_directory(directory, sizeof(directory), true) != 0)
+        goto error;
+
+    // Write via temporary file so concurrent runs never see partial chunks
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    fd = mkstemp(temp_path);
+    if (fd < 0)
+        goto error;
+    file = fdopen(fd, "wb");
+    if (file == NULL)
+    {
+        close(fd);
+        unlink(temp_path);
+        goto error;
+    }
+    status = fwrite(buffer.data, 1, buffer.size, file) != buffer.size;
+    status |= fclose(file);
+    if ((status != 0) || (rename(temp_path, path) != 0))
+    {
+        unlink(temp_path);
+        goto error;
+    }
+
+    cache_trim(directory);
+
+error:
+    free(buffer.data);
+}
+
+int bytecode_load(lua_State *L, const char *buffer, size_t size, const char *chunkname)
+{
+    char path[PATH_LENGTH_MAX], directory[PATH_LENGTH_MAX];
+    char *bytecode;
+    size_t bytecode_size;
+    uint64_t source_hash, name_hash;
+    int status;
+
+    if (!bytecode_cache_enabled)
+        return luaL_loadbuffer(L, buffer, size, chunkname);
+
+    if (cache_directory(directory, sizeof(directory), false) != 0)
+        return luaL_loadbuffer(L, buffer, size, chunkname);
+
+    // Chunk name is part of key as it is embedded in debug information
+    source_hash = hash_fnv1a(buffer, size);
+    name_hash = hash_fnv1a(chunkname, strlen(chunkname)) ^ bytecode_format_hash();
+    if (snprintf(path, sizeof(path), "%s/%016llx%016llx.luac", directory,
+                 (unsigned long long) name_hash, (unsigned long long) source_hash) >= (int) sizeof(path))
+        return luaL_loadbuffer(L, buffer, size, chunkname);
+
+    bytecode = file_read(path, &bytecode_size);
+    if (bytecode != NULL)
+    {
+        status = luaL_loadbuffer(L, bytecode, bytecode_size, chunkname);
+        free(bytecode);
+        if (status == 0)
+        {
+            // Mark as recently used
+            utime(path, NULL);
+            return 0;
+        }
+
+        // Stale or corrupt chunk is replaced below
+        lua_pop(L, 1);
+    }
+
+    status = luaL_loadbuffer(L, buffer, size, chunkname);
+    if (status == 0)
+        cache_store(L, path);
+
+    return status;
+}
+
+int bytecode_loadfile(lua_State *L, const char *filename)
+{
+    char *source, *chunkname;
+    const char *text;
+    size_t size;
+    int status;
+
+    source = file_read(filename, &size);
+    if (source == NULL)
+        return luaL_loadfile(L, filename);
+
+    chunkname = malloc(strlen(filename) + 2);
+    if (chunkname == NULL)
+    {
+        free(source);
+        return luaL_loadfile(L, filename);
+    }
+    sprintf(chunkname, "@%s", filename);
+
+    // Skip shebang line as luaL_loadfile() does
+    text = source;
+    if (text[0] == '#')
+    {
+        while ((size > 0) && (*text != '\n'))
+        {
+            text++;
+            size--;
+        }
+    }
+
+    status = bytecode_load(L, text, size, chunkname);
+
+    free(chunkname);
+    free(source);
+
+    return status;
+}
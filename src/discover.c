@@ -35,33 +35,372 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/param.h>
 #include "error.h"
 #include "misc.h"
+#include "scan.h"
+#include "inventory.h"
 #include <lxi.h>
 
+#define ADDRESS_LENGTH_MAX 256
+#define ID_LENGTH_MAX 1024
+#define SERVICE_LENGTH_MAX 256
+#define INTERFACE_LENGTH_MAX 64
+#define WATCH_INTERVAL_MIN 2        // Seconds between cycles right after a change
+#define WATCH_DISCOVER_CYCLES 10    // Full discovery every n cycles
+
+enum output_t
+{
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_CSV,
+};
+
+struct discovered_device
+{
+    char address[ADDRESS_LENGTH_MAX];
+    char id[ID_LENGTH_MAX];
+    char interface[INTERFACE_LENGTH_MAX];
+    double latency;
+};
+
+struct discovered_service
+{
+    char address[ADDRESS_LENGTH_MAX];
+    char service[SERVICE_LENGTH_MAX];
+    int port;
+};
+
+struct watched_device
+{
+    char address[ADDRESS_LENGTH_MAX];
+    char id[ID_LENGTH_MAX];
+    double latency;
+    bool present;
+    bool seen;
+};
+
+static struct discovered_device *devices = NULL;
+static struct discovered_service *services = NULL;
 static int device_count = 0;
 static int service_count = 0;
+static int expect_count = 0;
+static int discover_running = 0;
+static bool discover_done = false;
+static pthread_mutex_t discover_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t discover_cond = PTHREAD_COND_INITIALIZER;
+static enum output_t output = OUTPUT_TEXT;
+static bool scanning = false;
+static struct timespec discover_start;
+static struct watched_device *watched = NULL;
+static int watched_count = 0;
+
+// Interface and time of last discovery event of each discovery thread
+static __thread char event_interface[INTERFACE_LENGTH_MAX];
+static __thread struct timespec event_time;
+
+static void report_printf(const char *format, ...)
+{
+    va_list args;
+
+    // Human readable output is streamed, machine readable output comes last
+    if (output != OUTPUT_TEXT)
+        return;
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+// Response latency of device reported by discovery thread
+static double event_latency(void)
+{
+    struct timespec now;
+    double latency;
+
+    if (scanning)
+        return scan_latency();
+
+    // liblxi probes devices one by one after broadcast, so latency is the
+    // time since broadcast or previous device reported by the same thread
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latency = elapsed_ms((event_time.tv_sec != 0) ? &event_time : &discover_start, &now);
+    event_time = now;
+
+    return latency;
+}
+
+static bool device_known(const char *address, const char *id)
+{
+    int i;
+
+    // Same device may answer on several addresses (interfaces)
+    for (i=0; i<device_count; i++)
+    {
+        if (strcmp(devices[i].address, address) == 0)
+            return true;
+        if ((id != NULL) && (strlen(id) > 0) && (strcmp(devices[i].id, id) == 0))
+            return true;
+    }
+
+    return false;
+}
+
+static void device_add(const char *address, const char *id, double latency)
+{
+    struct discovered_device *device;
+
+    device = realloc(devices, (device_count + 1) * sizeof(struct discovered_device));
+    if (device == NULL)
+        return;
+    devices = device;
+
+    device = &devices[device_count++];
+    strncpy(device->address, address, ADDRESS_LENGTH_MAX - 1);
+    device->address[ADDRESS_LENGTH_MAX - 1] = 0;
+    strncpy(device->id, id, ID_LENGTH_MAX - 1);
+    device->id[ID_LENGTH_MAX - 1] = 0;
+    strcpy(device->interface, event_interface);
+    device->latency = latency;
+
+    // Wake up waiter in case expected number of devices has been found
+    if ((expect_count > 0) && (device_count >= expect_count))
+        pthread_cond_signal(&discover_cond);
+}
+
+static bool service_known(const char *address, const char *service, int port)
+{
+    int i;
+
+    for (i=0; i<service_count; i++)
+    {
+        if ((strcmp(services[i].address, address) == 0) &&
+            (strcmp(services[i].service, service) == 0) &&
+            (services[i].port == port))
+            return true;
+    }
+
+    return false;
+}
+
+static void service_add(const char *address, const char *service, int port)
+{
+    struct discovered_service *entry;
+
+    entry = realloc(services, (service_count + 1) * sizeof(struct discovered_service));
+    if (entry == NULL)
+        return;
+    services = entry;
+
+    entry = &services[service_count++];
+    strncpy(entry->address, address, ADDRESS_LENGTH_MAX - 1);
+    entry->address[ADDRESS_LENGTH_MAX - 1] = 0;
+    strncpy(entry->service, service, SERVICE_LENGTH_MAX - 1);
+    entry->service[SERVICE_LENGTH_MAX - 1] = 0;
+    entry->port = port;
+}
 
 static void broadcast(const char *address, const char *interface)
 {
     UNUSED(address);
-    printf("Broadcasting on interface %s\n", interface);
+
+    strncpy(event_interface, interface, INTERFACE_LENGTH_MAX - 1);
+    clock_gettime(CLOCK_MONOTONIC, &event_time);
+
+    pthread_mutex_lock(&discover_mutex);
+    if (!discover_done)
+        report_printf("Broadcasting on interface %s\n", interface);
+    pthread_mutex_unlock(&discover_mutex);
+}
+
+static void device_found(const char *address, const char *id, double latency)
+{
+    pthread_mutex_lock(&discover_mutex);
+    if (!discover_done && !device_known(address, id))
+    {
+        // Stream device as soon as it is found
+        report_printf("  Found \"%s\" on address %s\n", id, address);
+        device_add(address, id, latency);
+    }
+    pthread_mutex_unlock(&discover_mutex);
 }
 
 static void device(const char *address, const char *id)
 {
-    printf("  Found \"%s\" on address %s\n", id, address);
-    device_count++;
+    double latency = event_latency();
+    int port = scanning ? scan_vxi11_port() : 0;
+
+    // Late results after early exit are not recorded in inventory either as
+    // inventory is being saved
+    pthread_mutex_lock(&discover_mutex);
+    if (!discover_done)
+    {
+        inventory_device(address, id, "VXI11", 0, latency);
+        if (port > 0)
+            inventory_service(address, id, "vxi-11", port, latency);
+    }
+    pthread_mutex_unlock(&discover_mutex);
+
+    device_found(address, id, latency);
+
+    // Scan knows port of VXI-11 service
+    if (port > 0)
+    {
+        pthread_mutex_lock(&discover_mutex);
+        if (!discover_done && !service_known(address, "vxi-11", port))
+            service_add(address, "vxi-11", port);
+        pthread_mutex_unlock(&discover_mutex);
+    }
+}
+
+static void device_inventory(const char *address, const char *id)
+{
+    struct inventory_entry entry;
+    double latency = -1;
+
+    char *token, *port, *saveptr;
+
+    if (!inventory_find(address, &entry))
+    {
+        device_found(address, id, latency);
+        return;
+    }
+
+    // Latency of inventory check
+    device_found(address, id, entry.latency);
+
+    // Services recorded by previous searches
+    pthread_mutex_lock(&discover_mutex);
+    for (token = strtok_r(entry.services, " ", &saveptr); token != NULL; token = strtok_r(NULL, " ", &saveptr))
+    {
+        port = strrchr(token, ':');
+        if (port == NULL)
+            continue;
+        *port++ = 0;
+        if (!service_known(address, token, atoi(port)))
+            service_add(address, token, atoi(port));
+    }
+    pthread_mutex_unlock(&discover_mutex);
 }
 
 static void service(const char *address, const char *id, const char *service, int port)
 {
-    printf("  Found \"%s\" on address %s\n    %s service on port %u\n", id, address, service, port);
-    service_count++;
+    double latency = event_latency();
+
+    pthread_mutex_lock(&discover_mutex);
+    if (!discover_done)
+        inventory_service(address, id, service, port, latency);
+    if (!discover_done && !service_known(address, service, port))
+    {
+        report_printf("  Found \"%s\" on address %s\n    %s service on port %u\n", id, address, service, port);
+        service_add(address, service, port);
+
+        // Services of same device only count once as device
+        if (!device_known(address, NULL))
+            device_add(address, id, latency);
+    }
+    pthread_mutex_unlock(&discover_mutex);
+}
+
+static void output_print(void)
+{
+    struct discovered_device *device;
+    bool first;
+    int i, j;
+
+    if (output == OUTPUT_JSON)
+    {
+        printf("{\n  \"devices\": [");
+        for (i=0; i<device_count; i++)
+        {
+            device = &devices[i];
+            printf("%s\n    {\n      \"address\": ", i > 0 ? "," : "");
+            json_print_string(stdout, device->address);
+            printf(",\n      \"id\": ");
+            json_print_string(stdout, device->id);
+            printf(",\n      \"interface\": ");
+            json_print_string(stdout, device->interface);
+            if (device->latency >= 0)
+                printf(",\n      \"latency_ms\": %.3f", device->latency);
+            else
+                printf(",\n      \"latency_ms\": null");
+            printf(",\n      \"services\": [");
+            first = true;
+            for (j=0; j<service_count; j++)
+            {
+                if (strcmp(services[j].address, device->address) != 0)
+                    continue;
+                printf("%s\n        { \"service\": ", first ? "" : ",");
+                json_print_string(stdout, services[j].service);
+                printf(", \"port\": %d }", services[j].port);
+                first = false;
+            }
+            printf("%s]\n    }", first ? "" : "\n      ");
+        }
+        printf("%s]\n}\n", device_count > 0 ? "\n  " : "");
+    }
+    else if (output == OUTPUT_CSV)
+    {
+        printf("address,id,interface,latency_ms,services\n");
+        for (i=0; i<device_count; i++)
+        {
+            device = &devices[i];
+            csv_print_string(stdout, device->address);
+            putchar(',');
+            csv_print_string(stdout, device->id);
+            putchar(',');
+            csv_print_string(stdout, device->interface);
+            putchar(',');
+            if (device->latency >= 0)
+                printf("%.3f", device->latency);
+            putchar(',');
+
+            // Services as space separated <service>:<port> list
+            putchar('"');
+            first = true;
+            for (j=0; j<service_count; j++)
+            {
+                if (strcmp(services[j].address, device->address) != 0)
+                    continue;
+                printf("%s%s:%d", first ? "" : " ", services[j].service, services[j].port);
+                first = false;
+            }
+            printf("\"\n");
+        }
+    }
+    fflush(stdout);
+}
+
+int discover_set_output(const char *format)
+{
+    if (strcmp(format, "text") == 0)
+        output = OUTPUT_TEXT;
+    else if (strcmp(format, "json") == 0)
+        output = OUTPUT_JSON;
+    else if (strcmp(format, "csv") == 0)
+        output = OUTPUT_CSV;
+    else
+    {
+        error_printf("Unknown output format (%s)\n", format);
+        return 1;
+    }
+
+    return 0;
 }
 
-int discover(bool mdns, int timeout)
+struct discover_job
+{
+    lxi_discover_t type;
+    int timeout;
+};
+
+static void *discover_worker_thread(void *data)
 {
+    struct discover_job *job = data;
     lxi_info_t info;
 
     // Set up info callbacks
@@ -69,28 +408,361 @@ int discover(bool mdns, int timeout)
     info.device = &device;
     info.service = &service;
 
-    printf("Searching for LXI devices - please wait...\n\n");
+    lxi_discover(&info, job->timeout, job->type);
+
+    // Wake up waiter when last discovery mechanism is done
+    pthread_mutex_lock(&discover_mutex);
+    discover_running--;
+    pthread_cond_signal(&discover_cond);
+    pthread_mutex_unlock(&discover_mutex);
 
-    // Search for LXI devices / services
+    return NULL;
+}
+
+int discover(bool vxi11, bool mdns, int timeout, int expect)
+{
+    static struct discover_job jobs[2];
+    pthread_t thread;
+    int job_count = 0;
+    int i;
+
+    report_printf("Searching for LXI devices - please wait...\n\n");
+
+    inventory_load();
+    clock_gettime(CLOCK_MONOTONIC, &discover_start);
+
+    if (vxi11)
+        jobs[job_count++] = (struct discover_job) { DISCOVER_VXI11, timeout };
     if (mdns)
+        jobs[job_count++] = (struct discover_job) { DISCOVER_MDNS, timeout };
+
+    expect_count = expect;
+
+    // Run discovery mechanisms concurrently
+    pthread_mutex_lock(&discover_mutex);
+    for (i=0; i<job_count; i++)
     {
-        lxi_discover(&info, timeout, DISCOVER_MDNS);
-        if (service_count == 0)
-            printf("No services found\n");
-        else
-            printf("\nFound %d service%c\n", service_count, service_count > 1 ? 's' : ' ');
+        if (pthread_create(&thread, NULL, discover_worker_thread, &jobs[i]) != 0)
+        {
+            error_printf("Failed to start discovery (%s)\n", strerror(errno));
+            continue;
+        }
+        pthread_detach(thread);
+        discover_running++;
     }
+
+    // Wait until done or expected number of devices found (early exit leaves
+    // discovery threads behind, their late results are ignored)
+    while ((discover_running > 0) && ((expect_count == 0) || (device_count < expect_count)))
+        pthread_cond_wait(&discover_cond, &discover_mutex);
+    discover_done = true;
+
+    report_printf("\n");
+    if (device_count == 0)
+        report_printf("No devices found\n");
+    else
+        report_printf("Found %d device%s", device_count, device_count > 1 ? "s" : "");
+    if ((device_count > 0) && (service_count > 0))
+        report_printf(" (%d service%s)", service_count, service_count > 1 ? "s" : "");
+    if (device_count > 0)
+        report_printf("\n");
+    report_printf("\n");
+    output_print();
+    pthread_mutex_unlock(&discover_mutex);
+
+    inventory_save();
+
+    return 0;
+}
+
+int discover_scan(const char *network, int concurrency, int timeout)
+{
+    struct timespec start, end;
+    lxi_info_t info;
+    int status;
+
+    // Set up info callbacks
+    info.broadcast = &broadcast;
+    info.device = &device;
+    info.service = &service;
+
+    report_printf("Scanning %s for LXI devices - please wait...\n\n", network);
+
+    inventory_load();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    scanning = true;
+    status = scan(network, concurrency, timeout, &info);
+    if (status != 0)
+        return status;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    inventory_save();
+
+    report_printf("\n");
+    if (device_count == 0)
+        report_printf("No devices found");
+    else
+        report_printf("Found %d device%s", device_count, device_count > 1 ? "s" : "");
+    report_printf(" (scan took %.1f seconds)\n\n", elapsed_ms(&start, &end) / 1000);
+    output_print();
+
+    return 0;
+}
+
+int discover_inventory(int timeout)
+{
+    lxi_info_t info;
+    int count;
+
+    // Report only, inventory is updated by refresh itself
+    info.broadcast = NULL;
+    info.device = &device_inventory;
+    info.service = NULL;
+
+    inventory_load();
+    count = inventory_count();
+    if (count == 0)
+    {
+        report_printf("No known devices in inventory\n\n");
+        output_print();
+        return 0;
+    }
+
+    report_printf("Checking %d known device%s - please wait...\n\n", count, count > 1 ? "s" : "");
+
+    inventory_refresh(timeout, &info);
+
+    report_printf("\n");
+    if (device_count == 0)
+        report_printf("No devices found\n\n");
     else
+        report_printf("Found %d of %d known device%s\n\n", device_count, count, count > 1 ? "s" : "");
+    output_print();
+
+    inventory_save();
+
+    return 0;
+}
+
+static void watch_event(const char *event, struct watched_device *device, const char *previous_id)
+{
+    char timestamp[32];
+    time_t now = time(NULL);
+
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    switch (output)
     {
-        lxi_discover(&info, timeout, DISCOVER_VXI11);
-        printf("\n");
-        if (device_count == 0)
-            printf("No devices found\n");
-        else
-            printf("Found %d device%c\n", device_count, device_count > 1 ? 's' : ' ');
+        case OUTPUT_TEXT:
+            printf("%s %-11s %s \"%s\"", timestamp, event, device->address, device->id);
+            if (previous_id != NULL)
+                printf(" (was \"%s\")", previous_id);
+            if (device->present && (device->latency >= 0))
+                printf(" %.3f ms", device->latency);
+            printf("\n");
+            break;
+
+        case OUTPUT_JSON:
+            // One JSON object per line
+            printf("{\"time\": \"%s\", \"event\": \"%s\", \"address\": ", timestamp, event);
+            json_print_string(stdout, device->address);
+            printf(", \"id\": ");
+            json_print_string(stdout, device->id);
+            if (previous_id != NULL)
+            {
+                printf(", \"previous_id\": ");
+                json_print_string(stdout, previous_id);
+            }
+            if (device->present && (device->latency >= 0))
+                printf(", \"latency_ms\": %.3f}\n", device->latency);
+            else
+                printf(", \"latency_ms\": null}\n");
+            break;
+
+        case OUTPUT_CSV:
+            printf("%s,%s,", timestamp, event);
+            csv_print_string(stdout, device->address);
+            putchar(',');
+            csv_print_string(stdout, device->id);
+            putchar(',');
+            csv_print_string(stdout, previous_id != NULL ? previous_id : "");
+            putchar(',');
+            if (device->present && (device->latency >= 0))
+                printf("%.3f", device->latency);
+            printf("\n");
+            break;
+    }
+    fflush(stdout);
+}
+
+static void watch_seen(const char *address, const char *id, double latency)
+{
+    struct watched_device *device = NULL;
+    char previous_id[ID_LENGTH_MAX];
+    int i;
+
+    pthread_mutex_lock(&discover_mutex);
+
+    for (i=0; i<watched_count; i++)
+    {
+        if (strcmp(watched[i].address, address) == 0)
+        {
+            device = &watched[i];
+            break;
+        }
     }
 
-    printf("\n");
+    if (device == NULL)
+    {
+        device = realloc(watched, (watched_count + 1) * sizeof(struct watched_device));
+        if (device == NULL)
+            goto done;
+        watched = device;
+        device = &watched[watched_count++];
+        memset(device, 0, sizeof(struct watched_device));
+        strncpy(device->address, address, ADDRESS_LENGTH_MAX - 1);
+        strncpy(device->id, id, ID_LENGTH_MAX - 1);
+    }
+
+    device->seen = true;
+    device->latency = latency;
+
+    // Instrument at known address answers with new identity
+    if ((strlen(id) > 0) && (strncmp(device->id, id, ID_LENGTH_MAX - 1) != 0))
+    {
+        strcpy(previous_id, device->id);
+        strncpy(device->id, id, ID_LENGTH_MAX - 1);
+        if (device->present)
+            watch_event("changed", device, previous_id);
+    }
+
+done:
+    pthread_mutex_unlock(&discover_mutex);
+}
+
+static void watch_device(const char *address, const char *id)
+{
+    double latency = event_latency();
+
+    inventory_device(address, id, "VXI11", 0, latency);
+    if (scanning && (scan_vxi11_port() > 0))
+        inventory_service(address, id, "vxi-11", scan_vxi11_port(), latency);
+    watch_seen(address, id, latency);
+}
+
+static void watch_service(const char *address, const char *id, const char *service, int port)
+{
+    double latency = event_latency();
+    struct inventory_entry entry;
+
+    inventory_service(address, id, service, port, latency);
+
+    // Prefer instrument ID over service name
+    if (inventory_find(address, &entry))
+        id = entry.id;
+
+    watch_seen(address, id, latency);
+}
+
+static void watch_refreshed(const char *address, const char *id)
+{
+    struct inventory_entry entry;
+    double latency = -1;
+
+    if (inventory_find(address, &entry))
+        latency = entry.latency;
+
+    watch_seen(address, id, latency);
+}
+
+static void watch_discover(bool vxi11, bool mdns, const char *network, int concurrency, int timeout)
+{
+    lxi_info_t info;
+
+    info.broadcast = &broadcast;
+    info.device = &watch_device;
+    info.service = &watch_service;
+
+    clock_gettime(CLOCK_MONOTONIC, &discover_start);
+    memset(&event_time, 0, sizeof(event_time));
+
+    if (strlen(network) > 0)
+    {
+        scanning = true;
+        scan(network, concurrency, timeout, &info);
+        scanning = false;
+        return;
+    }
+
+    if (vxi11)
+        lxi_discover(&info, timeout, DISCOVER_VXI11);
+    if (mdns)
+        lxi_discover(&info, timeout, DISCOVER_MDNS);
+}
+
+int discover_watch(bool vxi11, bool mdns, const char *network, int concurrency, int timeout, int interval_max)
+{
+    lxi_info_t info;
+    int interval = WATCH_INTERVAL_MIN;
+    int cycle, changes, i;
+
+    // Presence checks report via inventory refresh
+    info.broadcast = NULL;
+    info.device = &watch_refreshed;
+    info.service = NULL;
+
+    if (interval_max < WATCH_INTERVAL_MIN)
+        interval_max = WATCH_INTERVAL_MIN;
+
+    if (output == OUTPUT_CSV)
+        printf("time,event,address,id,previous_id,latency_ms\n");
+
+    // Inventory is kept in memory between cycles
+    inventory_load();
+
+    for (cycle = 0; ; cycle++)
+    {
+        for (i=0; i<watched_count; i++)
+            watched[i].seen = false;
+
+        // Look for new instruments once in a while, otherwise only check
+        // presence of known instruments which is cheap (TCP connect)
+        if ((cycle % WATCH_DISCOVER_CYCLES) == 0)
+            watch_discover(vxi11, mdns, network, concurrency, timeout);
+        inventory_refresh(timeout, &info);
+
+        // Report presence changes since last cycle
+        changes = 0;
+        pthread_mutex_lock(&discover_mutex);
+        for (i=0; i<watched_count; i++)
+        {
+            if (watched[i].seen && !watched[i].present)
+            {
+                watched[i].present = true;
+                watch_event("appeared", &watched[i], NULL);
+                changes++;
+            }
+            else if (!watched[i].seen && watched[i].present)
+            {
+                watched[i].present = false;
+                watch_event("disappeared", &watched[i], NULL);
+                changes++;
+            }
+        }
+        pthread_mutex_unlock(&discover_mutex);
+
+        if ((changes > 0) || ((cycle % WATCH_DISCOVER_CYCLES) == 0))
+            inventory_save();
+
+        // Check often while instruments come and go, back off when stable
+        if (changes > 0)
+            interval = WATCH_INTERVAL_MIN;
+        else if (interval < interval_max)
+            interval = MIN(interval * 2, interval_max);
+
+        sleep(interval);
+    }
 
     return 0;
 }
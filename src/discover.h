@@ -32,4 +32,8 @@
 
 #include <stdbool.h>
 
-int discover(bool mdns, int timeout);
+int discover(bool vxi11, bool mdns, int timeout, int expect);
+int discover_inventory(int timeout);
+int discover_scan(const char *network, int concurrency, int timeout);
+int discover_set_output(const char *format);
+int discover_watch(bool vxi11, bool mdns, const char *network, int concurrency, int timeout, int interval_max);
@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <lxi.h>
+#include "inventory.h"
+#include "error.h"
+#include "misc.h"
+
+#define INVENTORY_VERSION 1
+#define INVENTORY_STALE_AGE (60 * 60)               // Identify again after 1 hour
+#define INVENTORY_EXPIRE_AGE (30 * 24 * 60 * 60)    // Forget unreachable after 30 days
+#define REFRESH_THREADS_MAX 32
+#define PORT_PORTMAPPER 111
+#define PORT_RAW 5025
+
+static struct inventory_entry *entries = NULL;
+static int entry_count = 0;
+static pthread_mutex_t inventory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int refresh_next;
+static int refresh_timeout;
+static lxi_info_t *refresh_info;
+
+static int inventory_path(char *path, size_t size, bool create)
+{
+    char directory[PATH_MAX];
+
+    if (cache_directory(directory, sizeof(directory), create) != 0)
+        return -1;
+
+    if (snprintf(path, size, "%s/inventory", directory) >= (int) size)
+        return -1;
+
+    return 0;
+}
+
+static void sanitize(char *string)
+{
+    // Tabs and newlines separate fields and entries
+    for (; *string != 0; string++)
+        if ((*string == '\t') || (*string == '\n') || (*string == '\r'))
+            *string = ' ';
+}
+
+static struct inventory_entry *entry_find(const char *address)
+{
+    int i;
+
+    for (i=0; i<entry_count; i++)
+        if (strcmp(entries[i].address, address) == 0)
+            return &entries[i];
+
+    return NULL;
+}
+
+static struct inventory_entry *entry_find_or_add(const char *address)
+{
+    struct inventory_entry *entry;
+
+    entry = entry_find(address);
+    if (entry != NULL)
+        return entry;
+
+    entry = realloc(entries, (entry_count + 1) * sizeof(struct inventory_entry));
+    if (entry == NULL)
+        return NULL;
+    entries = entry;
+
+    entry = &entries[entry_count++];
+    memset(entry, 0, sizeof(struct inventory_entry));
+    strncpy(entry->address, address, sizeof(entry->address) - 1);
+    entry->first_seen = time(NULL);
+    entry->latency = -1;
+
+    return entry;
+}
+
+int inventory_load(void)
+{
+    char path[PATH_MAX];
+    char *line = NULL, *cursor;
+    char *field[9];
+    struct inventory_entry *entry;
+    size_t size = 0;
+    FILE *file;
+    int i;
+
+    if (inventory_path(path, sizeof(path), false) != 0)
+        return -1;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return -1; // No inventory yet
+
+    pthread_mutex_lock(&inventory_mutex);
+
+    while (getline(&line, &size, file) > 0)
+    {
+        if (line[0] == '#')
+            continue;
+        strip_trailing_space(line);
+
+        // Fields: address, protocol, port, first seen, last seen, latency, reachable, services, id
+        cursor = line;
+        for (i=0; i<9; i++)
+            field[i] = strsep(&cursor, "\t");
+        if ((field[8] == NULL) || (strlen(field[0]) == 0))
+            continue;
+
+        entry = entry_find_or_add(field[0]);
+        if (entry == NULL)
+            break;
+        strncpy(entry->protocol, field[1], sizeof(entry->protocol) - 1);
+        entry->port = atoi(field[2]);
+        entry->first_seen = atoll(field[3]);
+        entry->last_seen = atoll(field[4]);
+        entry->latency = atof(field[5]);
+        entry->reachable = atoi(field[6]);
+        strncpy(entry->services, field[7], sizeof(entry->services) - 1);
+        strncpy(entry->id, field[8], sizeof(entry->id) - 1);
+    }
+
+    pthread_mutex_unlock(&inventory_mutex);
+
+    free(line);
+    fclose(file);
+
+    return 0;
+}
+
+int inventory_save(void)
+{
+    char path[PATH_MAX], path_tmp[PATH_MAX + 4];
+    struct inventory_entry *entry;
+    time_t now = time(NULL);
+    FILE *file;
+    int i;
+
+    if (inventory_path(path, sizeof(path), true) != 0)
+        return -1;
+
+    // Write to temporary file first so inventory is replaced atomically
+    snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", path);
+    file = fopen(path_tmp, "w");
+    if (file == NULL)
+    {
+        error_printf("Could not write inventory file (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&inventory_mutex);
+
+    fprintf(file, "# lxi-tools inventory v%d\n", INVENTORY_VERSION);
+    fprintf(file, "# address\tprotocol\tport\tfirst-seen\tlast-seen\tlatency-ms\treachable\tservices\tid\n");
+
+    for (i=0; i<entry_count; i++)
+    {
+        entry = &entries[i];
+
+        // Forget entries which have been unreachable for long
+        if (!entry->reachable && ((now - entry->last_seen) > INVENTORY_EXPIRE_AGE))
+            continue;
+
+        sanitize(entry->id);
+        sanitize(entry->services);
+        fprintf(file, "%s\t%s\t%d\t%lld\t%lld\t%.3f\t%d\t%s\t%s\n",
+                entry->address, entry->protocol, entry->port,
+                (long long) entry->first_seen, (long long) entry->last_seen,
+                entry->latency, entry->reachable, entry->services, entry->id);
+    }
+
+    pthread_mutex_unlock(&inventory_mutex);
+
+    fclose(file);
+
+    if (rename(path_tmp, path) != 0)
+    {
+        error_printf("Could not write inventory file (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int inventory_count(void)
+{
+    int count;
+
+    pthread_mutex_lock(&inventory_mutex);
+    count = entry_count;
+    pthread_mutex_unlock(&inventory_mutex);
+
+    return count;
+}
+
+bool inventory_get(int index, struct inventory_entry *entry)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&inventory_mutex);
+    if ((index >= 0) && (index < entry_count))
+    {
+        *entry = entries[index];
+        found = true;
+    }
+    pthread_mutex_unlock(&inventory_mutex);
+
+    return found;
+}
+
+bool inventory_find(const char *address, struct inventory_entry *entry)
+{
+    struct inventory_entry *found;
+
+    pthread_mutex_lock(&inventory_mutex);
+    found = entry_find(address);
+    if (found != NULL)
+        *entry = *found;
+    pthread_mutex_unlock(&inventory_mutex);
+
+    return found != NULL;
+}
+
+void inventory_device(const char *address, const char *id, const char *protocol, int port, double latency)
+{
+    struct inventory_entry *entry;
+
+    pthread_mutex_lock(&inventory_mutex);
+
+    entry = entry_find_or_add(address);
+    if (entry != NULL)
+    {
+        if ((id != NULL) && (strlen(id) > 0))
+            strncpy(entry->id, id, sizeof(entry->id) - 1);
+        if ((protocol != NULL) && (strlen(protocol) > 0))
+        {
+            strncpy(entry->protocol, protocol, sizeof(entry->protocol) - 1);
+            entry->port = port;
+        }
+        if (latency >= 0)
+            entry->latency = latency;
+        entry->last_seen = time(NULL);
+        entry->reachable = true;
+    }
+
+    pthread_mutex_unlock(&inventory_mutex);
+}
+
+void inventory_service(const char *address, const char *id, const char *service, int port, double latency)
+{
+    struct inventory_entry *entry;
+    char service_port[300];
+
+    pthread_mutex_lock(&inventory_mutex);
+
+    entry = entry_find_or_add(address);
+    if (entry != NULL)
+    {
+        // Do not replace instrument ID with service name
+        if ((strlen(entry->id) == 0) && (id != NULL))
+            strncpy(entry->id, id, sizeof(entry->id) - 1);
+
+        // Add service to list of services
+        snprintf(service_port, sizeof(service_port), "%s:%d", service, port);
+        if (strstr(entry->services, service_port) == NULL)
+        {
+            if (strlen(entry->services) > 0)
+                strncat(entry->services, " ", sizeof(entry->services) - strlen(entry->services) - 1);
+            strncat(entry->services, service_port, sizeof(entry->services) - strlen(entry->services) - 1);
+        }
+
+        // Services which tell how to talk SCPI to instrument (VXI-11 preferred)
+        if (strcmp(service, "vxi-11") == 0)
+        {
+            strcpy(entry->protocol, "VXI11");
+            entry->port = 0;
+        }
+        else if ((strcmp(service, "scpi-raw") == 0) && (strcmp(entry->protocol, "VXI11") != 0))
+        {
+            strcpy(entry->protocol, "RAW");
+            entry->port = port;
+        }
+
+        if (latency >= 0)
+            entry->latency = latency;
+        entry->last_seen = time(NULL);
+        entry->reachable = true;
+    }
+
+    pthread_mutex_unlock(&inventory_mutex);
+}
+
+// Returns connect latency in ms or -1 if port can not be connected
+static double tcp_ping(const char *address, int port, int timeout)
+{
+    struct addrinfo hints, *result;
+    struct timespec start;
+    struct pollfd pfd;
+    char service[12];
+    int fd, error = 0;
+    socklen_t length = sizeof(error);
+    double latency = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(address, service, &hints, &result) != 0)
+        return -1;
+
+    fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd < 0)
+        goto error_socket;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((connect(fd, result->ai_addr, result->ai_addrlen) < 0) && (errno != EINPROGRESS))
+        goto error_connect;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, timeout) != 1)
+        goto error_connect;
+
+    if ((getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0) && (error == 0))
+        latency = elapsed_ms(&start, NULL);
+
+error_connect:
+    close(fd);
+error_socket:
+    freeaddrinfo(result);
+    return latency;
+}
+
+// Returns *IDN? round trip latency in ms or -1 on failure
+static double identify(const char *address, const char *protocol, int port, char *id, int timeout)
+{
+    struct timespec start;
+    double latency = -1;
+    int device, length;
+    const char *command = "*IDN?";
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (strcmp(protocol, "RAW") == 0)
+    {
+        device = lxi_connect(address, port > 0 ? port : PORT_RAW, NULL, timeout, RAW);
+        command = "*IDN?\n";
+    }
+    else
+        device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    if (device == LXI_ERROR)
+        return -1;
+
+    if (lxi_send(device, command, strlen(command), timeout) < 0)
+        goto error;
+
+    length = lxi_receive(device, id, INVENTORY_ID_LENGTH_MAX - 1, timeout);
+    if (length <= 0)
+        goto error;
+    id[length] = 0;
+    strip_trailing_space(id);
+
+    latency = elapsed_ms(&start, NULL);
+
+error:
+    lxi_disconnect(device);
+    return latency;
+}
+
+static int check_port(struct inventory_entry *entry)
+{
+    char *port;
+
+    if (strcmp(entry->protocol, "VXI11") == 0)
+        return PORT_PORTMAPPER;
+    if (strcmp(entry->protocol, "RAW") == 0)
+        return entry->port > 0 ? entry->port : PORT_RAW;
+
+    // Fall back to port of first service
+    port = strchr(entry->services, ':');
+    if (port != NULL)
+        return atoi(port + 1);
+
+    return -1;
+}
+
+static void refresh_entry(struct inventory_entry *entry)
+{
+    char id[INVENTORY_ID_LENGTH_MAX];
+    double latency = -1;
+    int port;
+
+    // Cheap check of known good entry
+    if (entry->reachable && ((time(NULL) - entry->last_seen) < INVENTORY_STALE_AGE))
+    {
+        port = check_port(entry);
+        if (port > 0)
+            latency = tcp_ping(entry->address, port, refresh_timeout);
+    }
+
+    // Identify stale, unreachable or unconfirmed entry again
+    if (latency < 0)
+    {
+        latency = identify(entry->address, entry->protocol, entry->port, id, refresh_timeout);
+        if ((latency < 0) && (strlen(entry->protocol) == 0))
+        {
+            // Unknown protocol, try raw/TCP too
+            latency = identify(entry->address, "RAW", PORT_RAW, id, refresh_timeout);
+            if (latency >= 0)
+                strcpy(entry->protocol, "RAW");
+        }
+        else if ((latency >= 0) && (strlen(entry->protocol) == 0))
+            strcpy(entry->protocol, "VXI11");
+        if (latency >= 0)
+            strcpy(entry->id, id);
+    }
+
+    if (latency >= 0)
+    {
+        entry->latency = latency;
+        entry->last_seen = time(NULL);
+        entry->reachable = true;
+    }
+    else
+        entry->reachable = false;
+}
+
+static void *refresh_worker_thread(void *data)
+{
+    struct inventory_entry entry, *update;
+    bool done;
+    int i;
+
+    UNUSED(data);
+
+    while (true)
+    {
+        // Take copy of next entry
+        pthread_mutex_lock(&inventory_mutex);
+        i = refresh_next++;
+        done = (i >= entry_count);
+        if (!done)
+            entry = entries[i];
+        pthread_mutex_unlock(&inventory_mutex);
+
+        if (done)
+            break;
+
+        refresh_entry(&entry);
+
+        // Apply result (entry may have moved meanwhile)
+        pthread_mutex_lock(&inventory_mutex);
+        update = entry_find(entry.address);
+        if (update != NULL)
+        {
+            strcpy(update->id, entry.id);
+            strcpy(update->protocol, entry.protocol);
+            update->latency = entry.latency;
+            update->last_seen = entry.last_seen;
+            update->reachable = entry.reachable;
+        }
+        pthread_mutex_unlock(&inventory_mutex);
+
+        // Report reachable instrument
+        if (entry.reachable && (refresh_info != NULL) && (refresh_info->device != NULL))
+            refresh_info->device(entry.address, entry.id);
+    }
+
+    return NULL;
+}
+
+int inventory_refresh(int timeout, lxi_info_t *info)
+{
+    pthread_t threads[REFRESH_THREADS_MAX];
+    int thread_count, i;
+
+    refresh_next = 0;
+    refresh_timeout = timeout;
+    refresh_info = info;
+
+    // Check entries in parallel
+    thread_count = inventory_count();
+    if (thread_count > REFRESH_THREADS_MAX)
+        thread_count = REFRESH_THREADS_MAX;
+    for (i=0; i<thread_count; i++)
+    {
+        if (pthread_create(&threads[i], NULL, refresh_worker_thread, NULL) != 0)
+            break;
+    }
+    thread_count = i;
+    if (thread_count == 0)
+        refresh_worker_thread(NULL);
+    for (i=0; i<thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <time.h>
+#include <lxi.h>
+
+#define INVENTORY_ADDRESS_LENGTH_MAX 256
+#define INVENTORY_ID_LENGTH_MAX 1024
+#define INVENTORY_SERVICES_LENGTH_MAX 512
+
+struct inventory_entry
+{
+    char address[INVENTORY_ADDRESS_LENGTH_MAX];
+    char id[INVENTORY_ID_LENGTH_MAX];
+    char protocol[16];      // "VXI11", "RAW" or "" if unknown
+    int port;               // Port of SCPI service (0 = default for protocol)
+    char services[INVENTORY_SERVICES_LENGTH_MAX]; // Space separated <service>:<port> list
+    time_t first_seen;
+    time_t last_seen;
+    double latency;         // Response latency of last check in ms (-1 = unknown)
+    bool reachable;
+};
+
+// Persistent inventory of discovered instruments (stored in user cache directory)
+int inventory_load(void);
+int inventory_save(void);
+int inventory_count(void);
+bool inventory_get(int index, struct inventory_entry *entry);
+bool inventory_find(const char *address, struct inventory_entry *entry);
+
+// Record discovered device or service
+void inventory_device(const char *address, const char *id, const char *protocol, int port, double latency);
+void inventory_service(const char *address, const char *id, const char *service, int port, double latency);
+
+// Confirm inventory entries, known good entries are confirmed by a connect to
+// their SCPI port while stale or unreachable entries are identified again.
+// Reachable entries are reported via info callbacks (if any).
+int inventory_refresh(int timeout, lxi_info_t *info);
+
+#ifdef __cplusplus
+}
+#endif
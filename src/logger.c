@@ -0,0 +1,632 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "logger.h"
+#include "misc.h"
+
+#define LOGS_MAX 1024
+#define LOG_ROWS_INITIAL 1024
+#define LOG_STRINGS_INITIAL 4096
+#define LOG_MAGIC "LXILOG1\n"
+#define LOG_INTEGER_MAX 9007199254740992.0  // Integers exactly representable as double
+
+enum log_cell
+{
+    LOG_NONE = 0,       // Empty cell (row shorter than other rows or nil)
+    LOG_NUMBER,
+    LOG_INTEGER,
+    LOG_STRING,         // Value is offset of string in string pool
+    LOG_TRUE,
+    LOG_FALSE,
+};
+
+struct log_column
+{
+    uint8_t *kinds;
+    double *values;
+};
+
+// Rows stored column by column, also the unit written to binary log files
+struct log_chunk
+{
+    uint32_t rows;
+    uint32_t column_count;
+    uint32_t strings_size;
+    struct log_column *columns;
+    char *strings;
+};
+
+struct log_t
+{
+    bool allocated;
+    void *owner;                // Lua state which created log
+    pthread_mutex_t lock;
+    struct log_chunk chunk;
+    uint32_t capacity;          // Rows allocated per column
+    uint32_t strings_capacity;
+    uint32_t spill_rows;        // Spill rows to disk when reached (0 = never)
+    FILE *spill;
+};
+
+static struct log_t logs[LOGS_MAX];
+static pthread_mutex_t logs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t logs_once = PTHREAD_ONCE_INIT;
+static const char logs_owner_key = 0;
+
+static void logs_init(void)
+{
+    int i;
+
+    for (i=0; i<LOGS_MAX; i++)
+        pthread_mutex_init(&logs[i].lock, NULL);
+}
+
+// Returns log with its lock held (lock order: logs_mutex, then log lock)
+static struct log_t *log_lock(lua_State *L, int index)
+{
+    int handle = luaL_checkinteger(L, index);
+    struct log_t *log;
+
+    if ((handle < 0) || (handle >= LOGS_MAX))
+        luaL_argerror(L, index, "invalid log handle");
+
+    pthread_once(&logs_once, logs_init);
+    log = &logs[handle];
+    pthread_mutex_lock(&log->lock);
+    if (!log->allocated)
+    {
+        pthread_mutex_unlock(&log->lock);
+        luaL_argerror(L, index, "invalid log handle");
+    }
+
+    return log;
+}
+
+static void chunk_free(struct log_chunk *chunk)
+{
+    uint32_t i;
+
+    for (i=0; i<chunk->column_count; i++)
+    {
+        free(chunk->columns[i].kinds);
+        free(chunk->columns[i].values);
+    }
+    free(chunk->columns);
+    free(chunk->strings);
+    memset(chunk, 0, sizeof(struct log_chunk));
+}
+
+static bool column_alloc(struct log_column *column, uint32_t capacity)
+{
+    column->kinds = calloc(capacity, sizeof(uint8_t));
+    column->values = malloc(capacity * sizeof(double));
+
+    return (column->kinds != NULL) && (column->values != NULL);
+}
+
+static bool log_reserve_columns(struct log_t *log, uint32_t count)
+{
+    struct log_column *columns;
+    struct log_chunk *chunk = &log->chunk;
+
+    if (count <= chunk->column_count)
+        return true;
+
+    columns = realloc(chunk->columns, count * sizeof(struct log_column));
+    if (columns == NULL)
+        return false;
+    chunk->columns = columns;
+
+    // New columns are empty for rows logged so far
+    for (; chunk->column_count < count; chunk->column_count++)
+        if (!column_alloc(&columns[chunk->column_count], log->capacity))
+            return false;
+
+    return true;
+}
+
+static bool log_reserve_row(struct log_t *log)
+{
+    struct log_chunk *chunk = &log->chunk;
+    uint32_t capacity, i;
+    uint8_t *kinds;
+    double *values;
+
+    if (chunk->rows < log->capacity)
+        return true;
+
+    // Grow all columns by doubling
+    capacity = log->capacity * 2;
+    for (i=0; i<chunk->column_count; i++)
+    {
+        kinds = realloc(chunk->columns[i].kinds, capacity * sizeof(uint8_t));
+        if (kinds == NULL)
+            return false;
+        memset(kinds + log->capacity, LOG_NONE, capacity - log->capacity);
+        chunk->columns[i].kinds = kinds;
+
+        values = realloc(chunk->columns[i].values, capacity * sizeof(double));
+        if (values == NULL)
+            return false;
+        chunk->columns[i].values = values;
+    }
+    log->capacity = capacity;
+
+    return true;
+}
+
+static bool log_add_string(struct log_t *log, const char *string, size_t length, uint32_t *offset)
+{
+    struct log_chunk *chunk = &log->chunk;
+    uint32_t capacity = log->strings_capacity;
+    char *strings;
+
+    if ((size_t) chunk->strings_size + length + 1 > UINT32_MAX)
+        return false;
+
+    while ((size_t) chunk->strings_size + length + 1 > capacity)
+        capacity = (capacity > UINT32_MAX / 2) ? UINT32_MAX : capacity * 2;
+    if (capacity != log->strings_capacity)
+    {
+        strings = realloc(chunk->strings, capacity);
+        if (strings == NULL)
+            return false;
+        chunk->strings = strings;
+        log->strings_capacity = capacity;
+    }
+
+    *offset = chunk->strings_size;
+    memcpy(chunk->strings + chunk->strings_size, string, length);
+    chunk->strings[chunk->strings_size + length] = 0;
+    chunk->strings_size += length + 1;
+
+    return true;
+}
+
+static bool chunk_write(struct log_chunk *chunk, FILE *file)
+{
+    uint32_t header[3] = { chunk->rows, chunk->column_count, chunk->strings_size };
+    uint32_t i;
+
+    if (fwrite(header, sizeof(header), 1, file) != 1)
+        return false;
+
+    for (i=0; i<chunk->column_count; i++)
+    {
+        if (fwrite(chunk->columns[i].kinds, sizeof(uint8_t), chunk->rows, file) != chunk->rows)
+            return false;
+        if (fwrite(chunk->columns[i].values, sizeof(double), chunk->rows, file) != chunk->rows)
+            return false;
+    }
+
+    if (fwrite(chunk->strings, 1, chunk->strings_size, file) != chunk->strings_size)
+        return false;
+
+    return true;
+}
+
+static bool chunk_read(struct log_chunk *chunk, FILE *file)
+{
+    uint32_t header[3];
+    uint32_t i;
+
+    memset(chunk, 0, sizeof(struct log_chunk));
+
+    if (fread(header, sizeof(header), 1, file) != 1)
+        return false;
+
+    chunk->columns = calloc(header[1], sizeof(struct log_column));
+    chunk->strings = malloc(header[2] + 1);
+    if ((chunk->columns == NULL) || (chunk->strings == NULL))
+        goto error;
+    chunk->rows = header[0];
+    chunk->strings_size = header[2];
+
+    for (i=0; i<header[1]; i++)
+    {
+        chunk->column_count++;
+        if (!column_alloc(&chunk->columns[i], chunk->rows > 0 ? chunk->rows : 1))
+            goto error;
+        if (fread(chunk->columns[i].kinds, sizeof(uint8_t), chunk->rows, file) != chunk->rows)
+            goto error;
+        if (fread(chunk->columns[i].values, sizeof(double), chunk->rows, file) != chunk->rows)
+            goto error;
+    }
+
+    if (fread(chunk->strings, 1, chunk->strings_size, file) != chunk->strings_size)
+        goto error;
+
+    return true;
+
+error:
+    chunk_free(chunk);
+    return false;
+}
+
+// Format numbers the way tostring() does
+static void csv_write_number(double value, bool integer, FILE *file)
+{
+    char buffer[32];
+
+#if LUA_VERSION_NUM >= 503
+    if (integer)
+    {
+        fprintf(file, "%lld", (long long) value);
+        return;
+    }
+    snprintf(buffer, sizeof(buffer), "%.14g", value);
+    if (buffer[strspn(buffer, "-0123456789")] == 0)
+        strcat(buffer, ".0");
+#else
+    (void) integer;
+    snprintf(buffer, sizeof(buffer), "%.14g", value);
+#endif
+    fputs(buffer, file);
+}
+
+static void chunk_write_csv(struct log_chunk *chunk, FILE *file)
+{
+    struct log_column *column;
+    uint32_t row, i, width;
+
+    for (row=0; row<chunk->rows; row++)
+    {
+        // Rows only have as many fields as values logged
+        for (width = chunk->column_count; width > 0; width--)
+            if (chunk->columns[width - 1].kinds[row] != LOG_NONE)
+                break;
+
+        for (i=0; i<width; i++)
+        {
+            column = &chunk->columns[i];
+            if (i > 0)
+                putc(',', file);
+
+            switch (column->kinds[row])
+            {
+                case LOG_NUMBER:
+                case LOG_INTEGER:
+                    csv_write_number(column->values[row], column->kinds[row] == LOG_INTEGER, file);
+                    break;
+                case LOG_STRING:
+                    csv_print_string(file, chunk->strings + (uint32_t) column->values[row]);
+                    break;
+                case LOG_TRUE:
+                    fputs("true", file);
+                    break;
+                case LOG_FALSE:
+                    fputs("false", file);
+                    break;
+                default:
+                    break;
+            }
+        }
+        putc('\n', file);
+    }
+}
+
+static void log_reset(struct log_t *log)
+{
+    uint32_t i;
+
+    for (i=0; i<log->chunk.column_count; i++)
+        memset(log->chunk.columns[i].kinds, LOG_NONE, log->chunk.rows);
+    log->chunk.rows = 0;
+    log->chunk.strings_size = 0;
+}
+
+// Move rows in memory to spill file
+static bool log_spill(struct log_t *log)
+{
+    if (log->spill == NULL)
+    {
+        log->spill = tmpfile();
+        if (log->spill == NULL)
+            return false;
+    }
+
+    if (!chunk_write(&log->chunk, log->spill))
+        return false;
+    log_reset(log);
+
+    return true;
+}
+
+// lua: log = log_new(spill_rows)
+static int log_new(lua_State *L)
+{
+    int spill_rows = luaL_optinteger(L, 1, 0);
+    struct log_t *log;
+    void *owner;
+    int handle;
+
+    lua_pushlightuserdata(L, (void *) &logs_owner_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    owner = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    // Find free log (logs are shared by spawned Lua states)
+    pthread_once(&logs_once, logs_init);
+    pthread_mutex_lock(&logs_mutex);
+    for (handle=0; handle<LOGS_MAX; handle++)
+        if (!logs[handle].allocated)
+            break;
+    if (handle == LOGS_MAX)
+    {
+        pthread_mutex_unlock(&logs_mutex);
+        return luaL_error(L, "log_new: too many logs");
+    }
+
+    log = &logs[handle];
+    pthread_mutex_lock(&log->lock);
+    memset(&log->chunk, 0, sizeof(struct log_chunk));
+    log->allocated = true;
+    log->owner = owner;
+    log->capacity = LOG_ROWS_INITIAL;
+    log->strings_capacity = LOG_STRINGS_INITIAL;
+    log->chunk.strings = malloc(log->strings_capacity);
+    log->spill_rows = spill_rows > 0 ? spill_rows : 0;
+    log->spill = NULL;
+    if ((log->spill_rows > 0) && (log->capacity > log->spill_rows))
+        log->capacity = log->spill_rows;
+    pthread_mutex_unlock(&log->lock);
+    pthread_mutex_unlock(&logs_mutex);
+
+    // Return log handle
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+// lua: log_add(log, ...)
+static int log_add(lua_State *L)
+{
+    struct log_t *log = log_lock(L, 1);
+    int count = lua_gettop(L) - 1;
+    struct log_column *column;
+    uint32_t row, offset;
+    const char *string;
+    lua_Number number;
+    size_t length;
+    int i;
+
+    if (!log_reserve_columns(log, count) || !log_reserve_row(log) || (log->chunk.strings == NULL))
+        goto error_memory;
+
+    row = log->chunk.rows;
+    for (i=0; i<count; i++)
+    {
+        column = &log->chunk.columns[i];
+        switch (lua_type(L, i + 2))
+        {
+            case LUA_TNUMBER:
+                number = lua_tonumber(L, i + 2);
+                column->values[row] = number;
+#if LUA_VERSION_NUM >= 503
+                if (lua_isinteger(L, i + 2) && (number > -LOG_INTEGER_MAX) && (number < LOG_INTEGER_MAX))
+#else
+                if ((number > -LOG_INTEGER_MAX) && (number < LOG_INTEGER_MAX) && (number == (lua_Number) (long long) number))
+#endif
+                    column->kinds[row] = LOG_INTEGER;
+                else
+                    column->kinds[row] = LOG_NUMBER;
+                break;
+            case LUA_TBOOLEAN:
+                column->kinds[row] = lua_toboolean(L, i + 2) ? LOG_TRUE : LOG_FALSE;
+                break;
+            case LUA_TNIL:
+                column->kinds[row] = LOG_NONE;
+                break;
+            default:
+                // Anything but strings is logged as its type name
+                if (lua_type(L, i + 2) == LUA_TSTRING)
+                    string = lua_tolstring(L, i + 2, &length);
+                else
+                {
+                    string = luaL_typename(L, i + 2);
+                    length = strlen(string);
+                }
+                if (!log_add_string(log, string, length, &offset))
+                    goto error_memory;
+                column->values[row] = offset;
+                column->kinds[row] = LOG_STRING;
+                break;
+        }
+    }
+    log->chunk.rows++;
+
+    // Keep memory use bounded
+    if ((log->spill_rows > 0) && (log->chunk.rows >= log->spill_rows))
+        if (!log_spill(log))
+            goto error_spill;
+
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+
+error_memory:
+    pthread_mutex_unlock(&log->lock);
+    return luaL_error(L, "log_add: out of memory");
+
+error_spill:
+    pthread_mutex_unlock(&log->lock);
+    return luaL_error(L, "log_add: failed to spill log to disk (%s)", strerror(errno));
+}
+
+static int log_save(lua_State *L, bool binary)
+{
+    const char *filename = luaL_checkstring(L, 2);
+    struct log_t *log = log_lock(L, 1);
+    struct log_chunk chunk;
+    char buffer[65536];
+    size_t length;
+    bool ok = true;
+    FILE *file;
+
+    file = fopen(filename, binary ? "wb" : "w");
+    if (file == NULL)
+        goto error;
+    setvbuf(file, NULL, _IOFBF, 1024 * 1024);
+
+    if (binary)
+        ok = fwrite(LOG_MAGIC, strlen(LOG_MAGIC), 1, file) == 1;
+
+    // Spilled rows first
+    if (log->spill != NULL)
+    {
+        fflush(log->spill);
+        rewind(log->spill);
+        if (binary)
+        {
+            while (ok && ((length = fread(buffer, 1, sizeof(buffer), log->spill)) > 0))
+                ok = fwrite(buffer, 1, length, file) == length;
+        }
+        else
+        {
+            while (chunk_read(&chunk, log->spill))
+            {
+                chunk_write_csv(&chunk, file);
+                chunk_free(&chunk);
+            }
+        }
+        fseek(log->spill, 0, SEEK_END);
+    }
+
+    if (binary)
+        ok = ok && chunk_write(&log->chunk, file);
+    else
+        chunk_write_csv(&log->chunk, file);
+
+    if ((fclose(file) != 0) || !ok)
+        goto error;
+
+    pthread_mutex_unlock(&log->lock);
+    lua_pushboolean(L, true);
+    return 1;
+
+error:
+    pthread_mutex_unlock(&log->lock);
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    return 2;
+}
+
+// lua: log_save_csv(log, filename)
+static int log_save_csv(lua_State *L)
+{
+    return log_save(L, false);
+}
+
+// lua: log_save_binary(log, filename)
+static int log_save_binary(lua_State *L)
+{
+    return log_save(L, true);
+}
+
+static void log_release(struct log_t *log)
+{
+    chunk_free(&log->chunk);
+    if (log->spill != NULL)
+        fclose(log->spill);
+    log->spill = NULL;
+    log->owner = NULL;
+    log->allocated = false;
+}
+
+// lua: log_free(log)
+static int log_free(lua_State *L)
+{
+    int handle = luaL_checkinteger(L, 1);
+    bool allocated = false;
+
+    pthread_once(&logs_once, logs_init);
+    if ((handle >= 0) && (handle < LOGS_MAX))
+    {
+        pthread_mutex_lock(&logs_mutex);
+        pthread_mutex_lock(&logs[handle].lock);
+        allocated = logs[handle].allocated;
+        if (allocated)
+            log_release(&logs[handle]);
+        pthread_mutex_unlock(&logs[handle].lock);
+        pthread_mutex_unlock(&logs_mutex);
+    }
+
+    if (!allocated)
+        luaL_argerror(L, 1, "invalid log handle");
+
+    return 0;
+}
+
+// Release logs left behind when Lua state is closed
+static int logs_owner_gc(lua_State *L)
+{
+    void *owner = lua_touserdata(L, 1);
+    int handle;
+
+    pthread_once(&logs_once, logs_init);
+    pthread_mutex_lock(&logs_mutex);
+    for (handle=0; handle<LOGS_MAX; handle++)
+    {
+        pthread_mutex_lock(&logs[handle].lock);
+        if (logs[handle].allocated && (logs[handle].owner == owner))
+            log_release(&logs[handle]);
+        pthread_mutex_unlock(&logs[handle].lock);
+    }
+    pthread_mutex_unlock(&logs_mutex);
+
+    return 0;
+}
+
+int lua_register_logger(lua_State *L)
+{
+    // Owner of logs created by this state, collected when state is closed
+    lua_pushlightuserdata(L, (void *) &logs_owner_key);
+    lua_newuserdata(L, 1);
+    lua_newtable(L);
+    lua_pushcfunction(L, logs_owner_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_register(L, "log_new", log_new);
+    lua_register(L, "log_add", log_add);
+    lua_register(L, "log_save_csv", log_save_csv);
+    lua_register(L, "log_save_binary", log_save_binary);
+    lua_register(L, "log_free", log_free);
+
+    return 0;
+}
@@ -33,9 +33,13 @@
 #include "config.h"
 #include "lxi_gui-window.h"
 #include "screenshot.h"
+#include "inventory.h"
 #include "benchmark.h"
 #include "misc.h"
 #include "lxilua.h"
+#include "spawn.h"
+#include "profiler.h"
+#include "bytecode.h"
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -47,16 +51,62 @@
 
 static lxi_info_t info;
 
+// Instrument list item
+#define LXI_GUI_TYPE_INSTRUMENT (lxi_gui_instrument_get_type())
+G_DECLARE_FINAL_TYPE (LxiGuiInstrument, lxi_gui_instrument, LXI_GUI, INSTRUMENT, GObject)
+
+struct _LxiGuiInstrument
+{
+    GObject parent_instance;
+    char *address;
+    char *id;
+};
+
+G_DEFINE_TYPE (LxiGuiInstrument, lxi_gui_instrument, G_TYPE_OBJECT)
+
+static void lxi_gui_instrument_finalize(GObject *object)
+{
+    LxiGuiInstrument *instrument = LXI_GUI_INSTRUMENT(object);
+
+    g_free(instrument->address);
+    g_free(instrument->id);
+
+    G_OBJECT_CLASS (lxi_gui_instrument_parent_class)->finalize (object);
+}
+
+static void lxi_gui_instrument_class_init(LxiGuiInstrumentClass *klass)
+{
+    G_OBJECT_CLASS (klass)->finalize = lxi_gui_instrument_finalize;
+}
+
+static void lxi_gui_instrument_init(LxiGuiInstrument *instrument)
+{
+    UNUSED(instrument);
+}
+
+static LxiGuiInstrument *lxi_gui_instrument_new(const char *address, const char *id)
+{
+    LxiGuiInstrument *instrument = g_object_new(LXI_GUI_TYPE_INSTRUMENT, NULL);
+
+    instrument->address = g_strdup(address);
+    instrument->id = g_strdup(id);
+
+    return instrument;
+}
+
 struct _LxiGuiWindow
 {
     GtkApplicationWindow  parent_instance;
 
     /* Template widgets */
     GSettings           *settings;
-    GtkListBox          *list_instruments;
+    GtkListView         *list_instruments;
+    GListStore          *instruments;
+    GHashTable          *instruments_by_address;
+    GHashTable          *instruments_by_id;
+    LxiGuiInstrument    *instrument_selected;
     GMenuModel          *list_widget_menu_model;
     GtkWidget           *list_widget_popover_menu;
-    GtkViewport         *list_viewport;
     GdkClipboard        *clipboard;
     GtkEntry            *entry_scpi;
     GtkTextView         *text_view_scpi;
@@ -67,6 +117,7 @@ struct _LxiGuiWindow
     GThread             *screenshot_worker_thread;
     GThread             *screenshot_grab_worker_thread;
     GThread             *search_worker_thread;
+    GThread             *inventory_worker_thread;
     GThread             *send_worker_thread;
     GtkProgressBar      *progress_bar_benchmark;
     GThread             *benchmark_worker_thread;
@@ -83,13 +134,14 @@ struct _LxiGuiWindow
     GtkLabel            *label_info_bar;
     GtkViewport         *viewport_screenshot;
     GtkToggleButton     *toggle_button_script_run;
+    GtkToggleButton     *toggle_button_script_profile;
     AdwFlap             *flap;
     AdwStatusPage       *status_page_instruments;
     unsigned int        benchmark_requests_count;
     const char          *id;
     const char          *ip;
-    char                *image_buffer;
-    int                 image_size;
+    GBytes              *image_bytes;
+    struct screenshot_timing screenshot_timing;
     char                image_format[10];
     char                image_filename[1000];
     GFile               *script_file;
@@ -99,12 +151,13 @@ struct _LxiGuiWindow
     int                 screenshot_size;
     double              progress_bar_fraction;
     char                *benchmark_result_text;
-    gboolean            lua_stop_requested;
+    gboolean            lua_profile;
     GMutex              mutex_gui_chart;
-    GMutex              mutex_discover;
     GMutex              mutex_save_png;
     GMutex              mutex_save_csv;
+    GMutex              mutex_lua;
     bool                no_instruments;
+    gint                search_started;
 };
 
 G_DEFINE_TYPE (LxiGuiWindow, lxi_gui_window, GTK_TYPE_APPLICATION_WINDOW)
@@ -195,82 +248,49 @@ static void hide_info_bar(LxiGuiWindow *self)
     gtk_widget_hide(GTK_WIDGET(self->info_bar));
 }
 
-static GtkWidget* find_child_by_name(GtkWidget* parent, const gchar* name)
+static gboolean hide_info_bar_timeout(gpointer user_data)
 {
-    GtkWidget *child;
-    GList *children = NULL;
-
-    g_assert(GTK_IS_WIDGET(parent) == true);
-
-    if (g_strcmp0(gtk_widget_get_name(parent), name) == 0)
-        return parent;
-
-    for (child = gtk_widget_get_first_child(parent);
-            child != NULL;
-            child = gtk_widget_get_next_sibling(child))
-    {
-        children = g_list_append(children, child);
-    }
-
-    while (children != NULL)
-    {
-        GtkWidget* widget = find_child_by_name(children->data, name);
-
-        if (widget != NULL)
-            return widget;
+    LxiGuiWindow *self = user_data;
 
-        children = children->next;
-    }
+    hide_info_bar(self);
 
-    return NULL;
+    return G_SOURCE_REMOVE;
 }
 
 static void pressed_cb (GtkGestureClick *gesture,
         guint            n_press,
         double           x,
         double           y,
-        LxiGuiWindow     *self)
+        GtkListItem      *list_item)
 {
-    GtkWidget *child;
-    GtkListBoxRow *row;
-    GtkAdjustment* adjustment;
-    double y_adjustment, y_adjusted;
+    LxiGuiWindow *self = self_global;
+    LxiGuiInstrument *instrument;
+    GtkWidget *row;
+    double list_x, list_y;
 
-    UNUSED(gesture);
     UNUSED(n_press);
 
-    // Adjust y value to account for scrolling offset so we can pick the right row
-    adjustment = gtk_list_box_get_adjustment(self->list_instruments);
-    y_adjustment = gtk_adjustment_get_value(adjustment);
-    y_adjusted = y + y_adjustment;
-    row = gtk_list_box_get_row_at_y(self->list_instruments, y_adjusted);
-
-    if (row != NULL)
-    {
-        child = find_child_by_name(GTK_WIDGET(row), "list-title");
-        if (child != NULL)
-        {
-            // Save IP selected via GUI
-            self->ip = gtk_label_get_text(GTK_LABEL(child));
-        }
+    instrument = gtk_list_item_get_item(list_item);
+    if (instrument == NULL)
+        return;
 
-        child = find_child_by_name(GTK_WIDGET(row), "list-subtitle");
-        if (child != NULL)
-        {
-            // Save ID selected via GUI
-            self->id = gtk_label_get_text(GTK_LABEL(child));
-        }
+    // Save IP and ID selected via GUI (keep instrument alive while selected)
+    g_set_object(&self->instrument_selected, instrument);
+    self->ip = instrument->address;
+    self->id = instrument->id;
 
-        // If right click
-        if (gtk_gesture_single_get_current_button(GTK_GESTURE_SINGLE(gesture)) == GDK_BUTTON_SECONDARY)
-        {
-            /* Place our popup menu at the point where
-             * the click happened, before popping it up.
-             */
-            gtk_popover_set_pointing_to (GTK_POPOVER (self->list_widget_popover_menu),
-                    &(const GdkRectangle){ x, y, 1, 1 });
-            gtk_popover_popup (GTK_POPOVER (self->list_widget_popover_menu));
-        }
+    // If right click
+    if (gtk_gesture_single_get_current_button(GTK_GESTURE_SINGLE(gesture)) == GDK_BUTTON_SECONDARY)
+    {
+        /* Place our popup menu at the point where
+         * the click happened, before popping it up.
+         */
+        row = gtk_event_controller_get_widget(GTK_EVENT_CONTROLLER(gesture));
+        if (!gtk_widget_translate_coordinates(row, GTK_WIDGET(self->list_instruments), x, y, &list_x, &list_y))
+            return;
+        gtk_popover_set_pointing_to (GTK_POPOVER (self->list_widget_popover_menu),
+                &(const GdkRectangle){ list_x, list_y, 1, 1 });
+        gtk_popover_popup (GTK_POPOVER (self->list_widget_popover_menu));
     }
 }
 
@@ -305,27 +325,15 @@ static void action_cb (GtkWidget  *widget,
     }
 }
 
-static gboolean gui_update_search_add_instrument_thread(gpointer data)
+static void list_item_setup_cb(GtkSignalListItemFactory *factory, GtkListItem *list_item)
 {
-    GtkWidget *list_box = data;
-
-    // Add list box to list (GtkListBoxRow automatically inserted inbetween)
-    gtk_list_box_append(self_global->list_instruments, list_box);
-
-    g_mutex_unlock(&self_global->mutex_discover);
-
-    return G_SOURCE_REMOVE;
-}
-
-/* Add instrument to list */
-static void list_add_instrument (LxiGuiWindow *self, const char *ip, const char *id)
-{
-    UNUSED(self);
+    UNUSED(factory);
 
     GtkWidget *list_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
     GtkWidget *list_text_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
-    GtkWidget *list_title = gtk_label_new(ip);
-    GtkWidget *list_subtitle = gtk_label_new (id);
+    GtkWidget *list_title = gtk_label_new(NULL);
+    GtkWidget *list_subtitle = gtk_label_new(NULL);
+    GtkGesture *gesture = gtk_gesture_click_new();
 
     // Set properties of list box
     gtk_widget_set_size_request(list_box, -1, 60);
@@ -349,29 +357,97 @@ static void list_add_instrument (LxiGuiWindow *self, const char *ip, const char
     gtk_widget_set_halign(list_title, GTK_ALIGN_START);
     gtk_box_append(GTK_BOX(list_text_box), list_title);
 
-    // Add subtitle to list text box
+    // Add subtitle to list text box (styled via application CSS)
     gtk_widget_set_name(list_subtitle, "list-subtitle");
-    gtk_widget_add_css_class(list_subtitle, "subtitle");
-    GtkStyleContext *context = gtk_widget_get_style_context (GTK_WIDGET (list_subtitle));
-    GtkCssProvider *provider = gtk_css_provider_new ();
-    gtk_css_provider_load_from_data (provider, "label.subtitle {opacity: 1; font-size: x-small;}", -1);
-    gtk_style_context_add_provider (context, GTK_STYLE_PROVIDER (provider), GTK_STYLE_PROVIDER_PRIORITY_USER);
+    gtk_widget_add_css_class(list_subtitle, "list-subtitle");
     gtk_widget_set_vexpand(list_subtitle, true);
     gtk_widget_set_vexpand_set(list_subtitle, true);
     gtk_widget_set_valign(list_subtitle, GTK_ALIGN_START);
     gtk_label_set_wrap(GTK_LABEL(list_subtitle), true);
-    //  gtk_label_set_natural_wrap_mode(GTK_LABEL(list_subtitle), GTK_NATURAL_WRAP_NONE);
     gtk_label_set_wrap_mode(GTK_LABEL(list_subtitle), PANGO_WRAP_CHAR);
     gtk_box_append(GTK_BOX(list_text_box), list_subtitle);
 
     // Add text box to list box
     gtk_box_append(GTK_BOX(list_box), list_text_box);
 
-    // Add list box to instrument list
-    g_idle_add(gui_update_search_add_instrument_thread, list_box);
+    // Add event controller to handle any click gesture on list item widget
+    gtk_gesture_single_set_button (GTK_GESTURE_SINGLE (gesture), 0);
+    g_signal_connect (gesture, "pressed", G_CALLBACK (pressed_cb), list_item);
+    gtk_widget_add_controller (list_box, GTK_EVENT_CONTROLLER (gesture));
+
+    gtk_list_item_set_child(list_item, list_box);
+}
+
+static void list_item_bind_cb(GtkSignalListItemFactory *factory, GtkListItem *list_item)
+{
+    UNUSED(factory);
+
+    LxiGuiInstrument *instrument = gtk_list_item_get_item(list_item);
+    GtkWidget *list_text_box = gtk_widget_get_last_child(gtk_list_item_get_child(list_item));
+    GtkWidget *list_title = gtk_widget_get_first_child(list_text_box);
+    GtkWidget *list_subtitle = gtk_widget_get_next_sibling(list_title);
+
+    // Recycled row widgets only need new text
+    gtk_label_set_text(GTK_LABEL(list_title), instrument->address);
+    gtk_label_set_text(GTK_LABEL(list_subtitle), instrument->id);
+}
+
+struct instrument_data_t
+{
+    LxiGuiWindow *self;
+    char *address;
+    char *id;
+    bool match_id;
+    bool inventory;
+};
+
+static gboolean gui_update_search_add_instrument_thread(gpointer user_data)
+{
+    struct instrument_data_t *data = user_data;
+    LxiGuiWindow *self = data->self;
+    LxiGuiInstrument *instrument;
+
+    // Skip instruments from inventory queued before user started a search
+    if (data->inventory && g_atomic_int_get(&self->search_started))
+        goto done;
+
+    // Skip instruments already listed
+    if (g_hash_table_contains(self->instruments_by_address, data->address))
+        goto done;
+    if (data->match_id && g_hash_table_contains(self->instruments_by_id, data->id))
+        goto done;
+
+    // Add instrument to list model and index (keys owned by instrument)
+    instrument = lxi_gui_instrument_new(data->address, data->id);
+    g_hash_table_insert(self->instruments_by_address, instrument->address, instrument);
+    g_hash_table_insert(self->instruments_by_id, instrument->id, instrument);
+    g_list_store_append(self->instruments, instrument);
+    g_object_unref(instrument);
 
     // Mark instrument list populated
     self->no_instruments = false;
+
+done:
+    g_free(data->address);
+    g_free(data->id);
+    g_free(data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Add instrument to list (callable from any thread) */
+static void list_add_instrument (LxiGuiWindow *self, const char *ip, const char *id, bool match_id, bool inventory)
+{
+    struct instrument_data_t *data = g_new0(struct instrument_data_t, 1);
+
+    data->self = self;
+    data->address = g_strdup(ip);
+    data->id = g_strdup(id);
+    data->match_id = match_id;
+    data->inventory = inventory;
+
+    // List is only touched from main thread where it is deduplicated via index
+    g_idle_add(gui_update_search_add_instrument_thread, data);
 }
 
 static void mdns_service(const char *address, const char *id, const char *service, int port)
@@ -379,29 +455,14 @@ static void mdns_service(const char *address, const char *id, const char *servic
     UNUSED(service);
     UNUSED(port);
 
-    GtkWidget *child, *subtitle_child;
-
-    g_mutex_lock(&self_global->mutex_discover);
-
-    // Traverse list of instruments
-    for (child = gtk_widget_get_first_child(GTK_WIDGET(self_global->list_instruments));
-            child != NULL;
-            child = gtk_widget_get_next_sibling(child))
-    {
-        subtitle_child = find_child_by_name(GTK_WIDGET(child), "list-subtitle");
-        if (subtitle_child != NULL)
-        {
-            if (strcmp(id, gtk_label_get_text(GTK_LABEL(subtitle_child))) == 0)
-            {
-                // Instruments already exists, do not add
-                g_mutex_unlock(&self_global->mutex_discover);
-                return;
-            }
-        }
-    }
+    // Services of same instrument only listed once
+    list_add_instrument(self_global, address, id, true, false);
+}
 
-    // No match found, add instrument to list box
-    list_add_instrument(self_global, address, id);
+static void mdns_service_record(const char *address, const char *id, const char *service, int port)
+{
+    inventory_service(address, id, service, port, -1);
+    mdns_service(address, id, service, port);
 }
 
 static void vxi11_broadcast(const char *address, const char *interface)
@@ -415,9 +476,9 @@ static void vxi11_broadcast(const char *address, const char *interface)
 
 static void vxi11_device(const char *address, const char *id)
 {
-    g_mutex_lock(&self_global->mutex_discover);
+    inventory_device(address, id, "VXI11", 0, -1);
 
-    list_add_instrument(self_global, address, id);
+    list_add_instrument(self_global, address, id, false, false);
 }
 
 static gboolean gui_update_script_run_worker_function_finished_thread(gpointer data)
@@ -481,15 +542,74 @@ static gpointer search_worker_thread(gpointer data)
     else
         lxi_discover(&info, timeout, DISCOVER_VXI11);
 
+    // Remember found instruments
+    inventory_save();
+
     g_idle_add(gui_update_search_finished_thread, self);
 
     return NULL;
 }
 
+static void list_clear_instruments(LxiGuiWindow *self)
+{
+    // Index keys are owned by instruments so clear index first
+    g_hash_table_remove_all(self->instruments_by_address);
+    g_hash_table_remove_all(self->instruments_by_id);
+    g_list_store_remove_all(self->instruments);
+}
+
+static gboolean gui_update_inventory_clear_thread(gpointer data)
+{
+    LxiGuiWindow *self = data;
+
+    // Leave list alone if user started a search meanwhile
+    if (!g_atomic_int_get(&self->search_started))
+        list_clear_instruments(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void inventory_populate(LxiGuiWindow *self)
+{
+    struct inventory_entry entry;
+    int i;
+
+    for (i=0; inventory_get(i, &entry); i++)
+    {
+        if (g_atomic_int_get(&self->search_started))
+            break;
+        if (!entry.reachable)
+            continue;
+
+        list_add_instrument(self, entry.address, entry.id, false, true);
+    }
+}
+
+static gpointer inventory_worker_thread(gpointer data)
+{
+    LxiGuiWindow *self = data;
+    unsigned int timeout = g_settings_get_uint(self->settings, "timeout-discover");
+
+    // Populate instrument list instantly with instruments known from before
+    if (inventory_load() != 0)
+        return NULL;
+    inventory_populate(self);
+
+    // Confirm instruments in background and show those still reachable
+    inventory_refresh(timeout, NULL);
+    inventory_save();
+    if (!g_atomic_int_get(&self->search_started))
+    {
+        g_idle_add(gui_update_inventory_clear_thread, self);
+        inventory_populate(self);
+    }
+
+    return NULL;
+}
+
 static gboolean gui_update_search_start_thread(gpointer data)
 {
     LxiGuiWindow *self = data;
-    GtkWidget *child;
 
     // Hide instruments status page
     gtk_widget_set_visible(GTK_WIDGET(self->status_page_instruments), false);
@@ -501,13 +621,9 @@ static gboolean gui_update_search_start_thread(gpointer data)
     // Only allow one search activity at a time
     gtk_widget_set_sensitive(GTK_WIDGET(self->toggle_button_search), false);
 
-    // Clear instrument list
-    child = gtk_widget_get_first_child (GTK_WIDGET(self->list_instruments));
-    while (child != NULL)
-    {
-        gtk_list_box_remove (GTK_LIST_BOX (self->list_instruments), child);
-        child = gtk_widget_get_first_child (GTK_WIDGET(self->list_instruments));
-    }
+    // Clear instrument list (stop any population from inventory)
+    g_atomic_int_set(&self->search_started, true);
+    list_clear_instruments(self);
 
     // Start thread which searches for LXI instruments
     self->search_worker_thread = g_thread_new("search_worker", search_worker_thread, (gpointer)self);
@@ -930,6 +1046,7 @@ static bool grab_screenshot(LxiGuiWindow *self)
     char *plugin_name = (char *) "";
     char *filename = (char *) "";
     unsigned int timeout = g_settings_get_uint(self->settings, "timeout-screenshot");
+    struct screenshot_image image;
     int status;
 
     // Check for instrument
@@ -939,58 +1056,70 @@ static bool grab_screenshot(LxiGuiWindow *self)
         return 1;
     }
 
-    // Allocate 20 MB for image data
-    self->image_buffer = g_malloc(0x100000*20);
-    if (self->image_buffer == NULL)
-    {
-        show_error(self, "Failure allocating memory for image data");
-        return 1;
-    }
-
     // Capture screenshot
-    status = screenshot((char *)self->ip, plugin_name, filename, timeout, false, self->image_buffer, &(self->image_size), self->image_format, self->image_filename);
-    if (status != 0)
+    status = screenshot((char *)self->ip, plugin_name, filename, timeout, false, &image);
+    if ((status != 0) || (image.buffer == NULL))
     {
         show_error(self, "Failed to grab screenshot");
-        g_free(self->image_buffer);
+        free(image.buffer);
         return 1;
     }
 
+    // Take over image buffer from plugin without copying
+    self->image_bytes = g_bytes_new_with_free_func(image.data, image.size, free, image.buffer);
+    strcpy(self->image_format, image.format);
+    strcpy(self->image_filename, image.filename);
+    self->screenshot_timing = image.timing;
+
     return 0;
 }
 
 static gboolean gui_update_grab_screenshot_finished_thread(gpointer user_data)
 {
     LxiGuiWindow *self = user_data;
+    struct screenshot_timing *t = &self->screenshot_timing;
     GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf;
+    gint64 decode_start;
+    char text[300];
 
     if (self->screenshot_ready)
     {
         // Show screenshot
-        //loader = gdk_pixbuf_loader_new ();
+        decode_start = g_get_monotonic_time();
         loader = gdk_pixbuf_loader_new_with_type(self->image_format, NULL);
-        gdk_pixbuf_loader_write(loader, (const guchar *) self->image_buffer, (gsize)self->image_size, NULL);
-        self->pixbuf_screenshot = gdk_pixbuf_loader_get_pixbuf (loader);
-        if (self->pixbuf_screenshot == NULL)
+        gdk_pixbuf_loader_write_bytes(loader, self->image_bytes, NULL);
+        gdk_pixbuf_loader_close(loader, NULL);
+        pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+        if (pixbuf == NULL)
         {
             show_error(self, "Failure handling image format");
             self->screenshot_loaded = false;
         }
         else
         {
+            // Replace previous screenshot
+            g_clear_object(&self->pixbuf_screenshot);
+            self->pixbuf_screenshot = g_object_ref(pixbuf);
+
             self->screenshot_size = gdk_pixbuf_get_width(self->pixbuf_screenshot);
             self->screenshot_loaded = true;
             gtk_widget_set_valign(GTK_WIDGET(self->picture_screenshot), GTK_ALIGN_FILL);
             gtk_widget_set_halign(GTK_WIDGET(self->picture_screenshot), GTK_ALIGN_FILL);
             gtk_picture_set_pixbuf(self->picture_screenshot, self->pixbuf_screenshot);
-            gdk_pixbuf_loader_close(loader, NULL);
-            g_object_unref(loader);
 
             // Make screenshot picture zoomable
             //gtk_widget_set_sensitive(GTK_WIDGET(self->viewport_screenshot), true);
-        }
 
-        g_free(self->image_buffer);
+            // Report timing of screenshot phases
+            snprintf(text, sizeof(text), "Identify %.0f ms, connect %.0f ms, command %.0f ms, "
+                     "response %.0f ms (%d bytes), process %.0f ms, decode %.0f ms, total %.0f ms",
+                     t->identify, t->connect, t->command, t->response, t->bytes, t->process,
+                     (g_get_monotonic_time() - decode_start) / 1000.0, t->total);
+            show_info(self, text);
+            g_timeout_add_seconds(5, hide_info_bar_timeout, self);
+        }
+        g_object_unref(loader);
     }
 
     // Restore screenshot buttons
@@ -1008,6 +1137,9 @@ static gpointer screenshot_grab_worker_thread(gpointer data)
 {
     LxiGuiWindow *self = data;
 
+    // Release previously grabbed image data
+    g_clear_pointer(&self->image_bytes, g_bytes_unref);
+
     if (grab_screenshot(self) == 0)
     {
         self->screenshot_ready = true;
@@ -1040,23 +1172,98 @@ static void button_clicked_screenshot_grab(LxiGuiWindow *self, GtkButton *button
     self->screenshot_grab_worker_thread = g_thread_new("screenshot_grab_worker", screenshot_grab_worker_thread, (gpointer) self);
 }
 
+struct screenshot_save_job
+{
+    LxiGuiWindow *self;
+    GFile *file;
+    GBytes *bytes;
+    GdkPixbuf *pixbuf;
+    bool encode;
+};
+
+static gpointer screenshot_save_worker_thread(gpointer data)
+{
+    struct screenshot_save_job *job = data;
+    GError *error = NULL;
+    gchar *buffer = NULL;
+    gsize original_size = 0, size = 0;
+    gint64 start, encode_time = 0;
+    gconstpointer image_data;
+    char text[200];
+
+    if (job->encode)
+    {
+        // Encode to PNG here so the GUI stays responsive for large images
+        start = g_get_monotonic_time();
+        if (gdk_pixbuf_save_to_buffer(job->pixbuf, &buffer, &size, "png", &error, NULL) == false)
+        {
+            show_error(job->self, "Failed to encode screenshot");
+            goto error;
+        }
+        encode_time = g_get_monotonic_time() - start;
+        image_data = buffer;
+    }
+    else
+    {
+        // Write grabbed PNG image data as is, no need to encode it again
+        image_data = g_bytes_get_data(job->bytes, &size);
+    }
+
+    if (g_file_replace_contents(job->file, image_data, size, NULL, false, 0, NULL, NULL, &error) == false)
+    {
+        show_error(job->self, "Failed to save screenshot");
+        goto error;
+    }
+
+    // Report bytes saved and encode time
+    if (job->bytes != NULL)
+        original_size = g_bytes_get_size(job->bytes);
+    if (job->encode && (original_size > size))
+        snprintf(text, sizeof(text), "Saved screenshot as PNG (%zu bytes, %zu bytes saved, encoded in %.1f ms)",
+                 size, original_size - size, encode_time / 1000.0);
+    else if (job->encode)
+        snprintf(text, sizeof(text), "Saved screenshot as PNG (%zu bytes, encoded in %.1f ms)",
+                 size, encode_time / 1000.0);
+    else
+        snprintf(text, sizeof(text), "Saved screenshot as PNG (%zu bytes)", size);
+    show_info(job->self, text);
+
+    // Hide save report again after a while
+    g_timeout_add_seconds(3, hide_info_bar_timeout, job->self);
+
+error:
+    if (error != NULL)
+        g_error_free(error);
+    g_free(buffer);
+    g_clear_pointer(&job->bytes, g_bytes_unref);
+    g_clear_object(&job->pixbuf);
+    g_object_unref(job->file);
+    g_free(job);
+
+    return NULL;
+}
+
 static void on_screenshot_file_save_response(GtkDialog *dialog,
         int        response)
 {
-    GError *error = NULL;
-    gboolean status = true;
+    GThread *thread;
 
     if (response == GTK_RESPONSE_ACCEPT)
     {
         GtkFileChooser *chooser = GTK_FILE_CHOOSER (dialog);
+        struct screenshot_save_job *job = g_new0(struct screenshot_save_job, 1);
 
-        g_autoptr(GFile) file = gtk_file_chooser_get_file (chooser);
+        // Hand snapshot of current screenshot to save worker so the next grab can proceed
+        job->self = self_global;
+        job->file = gtk_file_chooser_get_file (chooser);
+        if (self_global->image_bytes != NULL)
+            job->bytes = g_bytes_ref(self_global->image_bytes);
+        job->pixbuf = g_object_ref(self_global->pixbuf_screenshot);
+        job->encode = (job->bytes == NULL) || (strcmp(self_global->image_format, "png") != 0);
 
-        status = gdk_pixbuf_save(self_global->pixbuf_screenshot, g_file_get_path(file), "png", &error, NULL);
-        if (status == false)
-        {
-            g_error ("Error: %s\n", error->message);
-        }
+        // Start worker thread that will encode and write the image file
+        thread = g_thread_new("screenshot_save_worker", screenshot_save_worker_thread, job);
+        g_thread_unref(thread);
     }
 
     gtk_window_destroy (GTK_WINDOW (dialog));
@@ -1459,8 +1666,6 @@ void initialize_script_engine(LxiGuiWindow *self)
     text_view_add_buffer(self->text_view_script_status, text);
     text_view_add_buffer(self->text_view_script_status, "Loaded lxi-tools extensions\n");
     g_free(text);
-
-    self->lua_stop_requested = false;
 }
 
 static void lua_print_error(LxiGuiWindow *self, const char *string)
@@ -2059,17 +2264,6 @@ static const struct luaL_Reg gui_lib [] =
     {NULL, NULL}
 };
 
-static void lua_line_hook(lua_State *L, lua_Debug *ar)
-{
-    if (ar->event == LUA_HOOKLINE)
-    {
-        if (self_global->lua_stop_requested == true)
-        {
-            luaL_error(L, "Stopped by user");
-        }
-    }
-}
-
 extern int lua_register_gui(lua_State *L)
 {
     // Register gui functions
@@ -2077,35 +2271,9 @@ extern int lua_register_gui(lua_State *L)
     luaL_setfuncs(L, gui_lib, 0);
     lua_pop(L, 1);
 
-    // Install line hook to manage run/stop execution
-    lua_sethook(L, &lua_line_hook, LUA_MASKLINE, 0);
-
     return 0;
 }
 
-static void load_log_script(lua_State *L)
-{
-    gsize size;
-    int error;
-
-    GResource *resource = lxi_gui_get_resource();
-
-    GBytes *script = g_resource_lookup_data (resource,
-            "/io/github/lxi-tools/lxi-gui/log.lua",
-            G_RESOURCE_LOOKUP_FLAGS_NONE,
-            NULL);
-
-    gconstpointer script_buffer = g_bytes_get_data (script, &size);
-
-    error = luaL_loadbuffer(L, script_buffer, strlen(script_buffer), "lxi-gui") ||
-        lua_pcall(L, 0, 0, 0);
-    if (error)
-    {
-        lua_print_error(self_global, lua_tostring(L, -1));
-        lua_pop(L, 1);  /* pop error message from the stack */
-    }
-}
-
 static gpointer script_run_worker_function(gpointer data)
 {
     LxiGuiWindow *self = data;
@@ -2115,9 +2283,13 @@ static gpointer script_run_worker_function(gpointer data)
     int error;
     char *chunkname = NULL;
     char *filename;
+    char *folded_filename;
+    char *report;
+    struct profiler *profiler = NULL;
 
     // Reset lua control state
-    self->lua_stop_requested = false;
+    lua_stop_reset();
+    spawn_stop_reset();
 
     // Initialize new Lua session
     lua_State *L = luaL_newstate();
@@ -2128,12 +2300,9 @@ static gpointer script_run_worker_function(gpointer data)
     // Bind GUI functions
     lua_register_gui(L);
 
-    // Bind lxi functions
+    // Bind lxi functions (including data logger)
     lua_register_lxi(L);
 
-    // Load data logger script
-    load_log_script(L);
-
     // Hardcode locale so script handles number conversion correct etc.
     setlocale(LC_ALL, "C.UTF-8");
 
@@ -2154,12 +2323,63 @@ static gpointer script_run_worker_function(gpointer data)
     }
 
     // Let lua load buffer and do error checking before running
-    error = luaL_loadbuffer(L, code_buffer, strlen(code_buffer), chunkname) ||
-        lua_pcall(L, 0, 0, 0);
+    error = bytecode_load(L, code_buffer, strlen(code_buffer), chunkname);
+    if (!error)
+    {
+        if (self->lua_profile)
+            profiler = profiler_start(L, NULL, 0, 0);
+
+        // Make state available to stop button
+        g_mutex_lock(&self->mutex_lua);
+        self->L = L;
+        g_mutex_unlock(&self->mutex_lua);
+
+        error = lua_pcall(L, 0, 0, 0);
+
+        g_mutex_lock(&self->mutex_lua);
+        self->L = NULL;
+        g_mutex_unlock(&self->mutex_lua);
+
+        if (profiler != NULL)
+            profiler_stop(L, profiler);
+    }
     if (error)
     {
         lua_print_error(self, lua_tostring(L, -1));
         lua_pop(L, 1);  /* pop error message from the stack */
+
+        // Spawned states may wait for values from failed script
+        spawn_stop();
+    }
+
+    // Wait for Lua states spawned by script
+    spawn_wait();
+
+    if (profiler != NULL)
+    {
+        report = profiler_report(profiler);
+        if (report != NULL)
+            lua_print_error(self, report);
+        free(report);
+
+        // Save stacks for flame graph next to script file
+        if (self->script_file != NULL)
+        {
+            filename = g_file_get_path(self->script_file);
+            folded_filename = g_strdup_printf("%s.folded", filename);
+            g_free(filename);
+        }
+        else
+            folded_filename = g_build_filename(g_get_user_cache_dir(), "lxi-gui-profile.folded", NULL);
+
+        if (profiler_save_folded(profiler, folded_filename) == 0)
+        {
+            report = g_strdup_printf("Saved folded stacks to %s", folded_filename);
+            lua_print_error(self, report);
+            g_free(report);
+        }
+        g_free(folded_filename);
+        profiler_free(profiler);
     }
 
     // Cleanup
@@ -2181,17 +2401,22 @@ static void toggle_button_clicked_script_run(LxiGuiWindow *self, GtkButton *butt
 
     text_view_clear_buffer(self->text_view_script_status);
 
+    self->lua_profile = gtk_toggle_button_get_active(self->toggle_button_script_profile);
+
     // Start thread which starts interpreting the Lua script
     self->script_run_worker_thread = g_thread_new("script_worker", script_run_worker_function, (gpointer) self);
 }
 
 static void button_clicked_script_stop(LxiGuiWindow *self, GtkButton *button)
 {
-    UNUSED(self);
     UNUSED(button);
 
     // Signal lua script engine to stop execution
-    self->lua_stop_requested = true;
+    g_mutex_lock(&self->mutex_lua);
+    if (self->L != NULL)
+        lua_stop(self->L);
+    g_mutex_unlock(&self->mutex_lua);
+    spawn_stop();
 }
 
 static void info_bar_clicked(LxiGuiWindow *self, GtkInfoBar *infobar)
@@ -2209,8 +2434,22 @@ static void lxi_gui_window_dispose(GObject *object)
 
     g_object_unref (window->settings);
 
-    // Remove list view port as parent to list popover menu
-    gtk_widget_unparent(GTK_WIDGET(window->list_widget_popover_menu));
+    // Release screenshot image data
+    g_clear_pointer(&window->image_bytes, g_bytes_unref);
+    g_clear_object(&window->pixbuf_screenshot);
+
+    // Remove list view as parent to list popover menu
+    if (window->list_widget_popover_menu != NULL)
+    {
+        gtk_widget_unparent(GTK_WIDGET(window->list_widget_popover_menu));
+        window->list_widget_popover_menu = NULL;
+    }
+
+    // Release instrument list model and index
+    g_clear_object(&window->instrument_selected);
+    g_clear_pointer(&window->instruments_by_address, g_hash_table_unref);
+    g_clear_pointer(&window->instruments_by_id, g_hash_table_unref);
+    g_clear_object(&window->instruments);
 
     G_OBJECT_CLASS (lxi_gui_window_parent_class)->dispose (object);
 }
@@ -2268,7 +2507,6 @@ static void lxi_gui_window_class_init(LxiGuiWindowClass *class)
     // Bind widgets
     gtk_widget_class_set_template_from_resource (widget_class, "/io/github/lxi-tools/lxi-gui/lxi_gui-window.ui");
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, list_instruments);
-    gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, list_viewport);
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, entry_scpi);
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, text_view_scpi);
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, toggle_button_scpi_send);
@@ -2287,6 +2525,7 @@ static void lxi_gui_window_class_init(LxiGuiWindowClass *class)
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, label_info_bar);
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, viewport_screenshot);
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, toggle_button_script_run);
+    gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, toggle_button_script_profile);
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, flap);
     gtk_widget_class_bind_template_child (widget_class, LxiGuiWindow, status_page_instruments);
 
@@ -2329,7 +2568,7 @@ static void lxi_gui_window_class_init(LxiGuiWindowClass *class)
     // Set up search information callbacks
     info.broadcast = &vxi11_broadcast;
     info.device = &vxi11_device;
-    info.service = &mdns_service; // For mDNS
+    info.service = &mdns_service_record; // For mDNS
 }
 
 static gboolean scroll_screenshot(
@@ -2372,7 +2611,8 @@ static gboolean scroll_screenshot(
 
 static void lxi_gui_window_init(LxiGuiWindow *self)
 {
-    GtkGesture *list_widget_gesture = gtk_gesture_click_new();
+    GtkListItemFactory *list_factory;
+    GtkSingleSelection *list_selection;
 
     gtk_widget_init_template (GTK_WIDGET (self));
 
@@ -2414,13 +2654,25 @@ static void lxi_gui_window_init(LxiGuiWindow *self)
     self->list_widget_popover_menu = gtk_popover_menu_new_from_model(self->list_widget_menu_model);
     gtk_popover_set_has_arrow(GTK_POPOVER(self->list_widget_popover_menu), false);
 
-    // Add list view port as parent to list popover menu
-    gtk_widget_set_parent (GTK_WIDGET(self->list_widget_popover_menu), GTK_WIDGET(self->list_viewport));
-
-    // Add event controller to handle any click gesture on list item widget
-    gtk_gesture_single_set_button (GTK_GESTURE_SINGLE (list_widget_gesture), 0);
-    g_signal_connect (list_widget_gesture, "pressed", G_CALLBACK (pressed_cb), self);
-    gtk_widget_add_controller (GTK_WIDGET(self->list_viewport), GTK_EVENT_CONTROLLER (list_widget_gesture));
+    // Add list view as parent to list popover menu
+    gtk_widget_set_parent (GTK_WIDGET(self->list_widget_popover_menu), GTK_WIDGET(self->list_instruments));
+
+    // Set up instrument list model indexed by address and ID
+    self->instruments = g_list_store_new(LXI_GUI_TYPE_INSTRUMENT);
+    self->instruments_by_address = g_hash_table_new(g_str_hash, g_str_equal);
+    self->instruments_by_id = g_hash_table_new(g_str_hash, g_str_equal);
+    self->instrument_selected = NULL;
+
+    // Show instrument list model via list view which recycles row widgets
+    list_selection = gtk_single_selection_new(G_LIST_MODEL(g_object_ref(self->instruments)));
+    gtk_single_selection_set_autoselect(list_selection, false);
+    list_factory = gtk_signal_list_item_factory_new();
+    g_signal_connect (list_factory, "setup", G_CALLBACK (list_item_setup_cb), NULL);
+    g_signal_connect (list_factory, "bind", G_CALLBACK (list_item_bind_cb), NULL);
+    gtk_list_view_set_model(self->list_instruments, GTK_SELECTION_MODEL(list_selection));
+    gtk_list_view_set_factory(self->list_instruments, list_factory);
+    g_object_unref(list_selection);
+    g_object_unref(list_factory);
 
     // Add event controller to capture scroll events on the surface of screenshot viewport
     GtkEventController *event_controller_screenshot;
@@ -2440,6 +2692,10 @@ static void lxi_gui_window_init(LxiGuiWindow *self)
     // Register LXI screenshot plugins
     screenshot_register_plugins();
 
+    // Populate instrument list from inventory and refresh it in background
+    g_atomic_int_set(&self->search_started, false);
+    self->inventory_worker_thread = g_thread_new("inventory_worker", inventory_worker_thread, (gpointer) self);
+
     // Set greeting image on screenshot page and make it not zoomable
     gtk_widget_set_size_request(GTK_WIDGET(self->picture_screenshot), 200, 200);
     gtk_picture_set_resource(self->picture_screenshot, "/io/github/lxi-tools/lxi-gui/images/photo-camera.png");
@@ -33,24 +33,91 @@
 #include <lauxlib.h>
 #include <lualib.h>
 #include <string.h>
+#include <ctype.h>
+#include <sys/param.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <stdint.h>
 #include <lxi.h>
 #include "error.h"
 #include "misc.h"
+#include "screenshot.h"
+#include "array.h"
+#include "logger.h"
+#include "stream.h"
+#include "spawn.h"
+#include "lxilua.h"
 #include <stdlib.h>
 
 #define RESPONSE_LENGTH_MAX 0x400000
-#define SESSIONS_MAX 1024
+#define RESPONSE_BUFFER_INITIAL 0x10000
+#define BATCH_LENGTH_MAX 1024           // Default maximum length of combined message
+#define BATCH_DRAIN_TIMEOUT 100         // Time to wait for further responses to combined message (ms)
 #define CLOCKS_MAX 1024
+#define SCREENSHOT_TIMEOUT 10000
+#define SCREENSHOT_CACHE_MAX 16
+#define ASYNC_THREADS 16
+#define STOP_CHECK_INTERVAL 100000000   // Nanoseconds between stop checks when sleeping
+#define FUTURE_METATABLE "lxi.future"
 
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+
+// Latency histogram bucket upper bounds in seconds (last bucket is overflow)
+static const double latency_bounds[] =
+{
+    0.0001, 0.0002, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05,
+    0.1, 0.2, 0.5, 1, 2, 5, 10
+};
+
+#define LATENCY_BUCKETS (sizeof(latency_bounds) / sizeof(latency_bounds[0]) + 1)
+
+struct session_stats_t
+{
+    unsigned long long commands;
+    unsigned long long queries;
+    unsigned long long errors;
+    unsigned long long bytes_out;
+    unsigned long long bytes_in;
+    double latency_total;
+    double latency_min;
+    double latency_max;
+    unsigned long long latency_histogram[LATENCY_BUCKETS];
+};
+
+// Connection to device (Lua userdata holds pointer to session)
 struct session_t
 {
+    int device;             // liblxi handle or LXI_ERROR when disconnected
     int timeout;
     int protocol;
+    char address[256];
+    const char *plugin;
+    char *buffer;           // Receive buffer reused by all requests
+    size_t size;
+    pthread_mutex_t lock;   // Serializes requests of Lua states sharing session
+    int refs;               // Lua userdata, spawn messages and async jobs
+    int async_pending;      // Async jobs queued or running
+    bool async_busy;        // Session served by async worker
+    struct session_stats_t stats;
 };
 
-static struct session_t session[SESSIONS_MAX];
+// Protects session references and statistics
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Screenshot plugins resolved per address (avoids identifying instrument again)
+struct screenshot_cache_t
+{
+    char address[256];
+    const char *plugin;
+};
+
+static struct screenshot_cache_t screenshot_cache[SCREENSHOT_CACHE_MAX];
+static int screenshot_cache_next = 0;
 
 struct lua_clock_t
 {
@@ -59,65 +126,157 @@ struct lua_clock_t
 };
 
 static struct lua_clock_t lua_clock[CLOCKS_MAX];
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t screenshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Set when running scripts are requested to stop
+static volatile bool stop_requested = false;
+
+// Coroutine being resumed by Lua state, so lua_stop() can reach it (hooks
+// are per thread and only inherited by threads created after install)
+struct stop_thread
+{
+    lua_State *main;
+    lua_State *thread;
+    struct stop_thread *next;
+};
+
+static struct stop_thread *stop_threads = NULL;
+static pthread_mutex_t stop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char stop_main_key = 0;
+
+// Asynchronous SCPI request serviced by I/O thread pool
+struct async_job
+{
+    struct session_t *session;
+    char *command;
+    int timeout;
+    char *response;
+    int length;             // Response length or negative on error
+    bool done;
+    int refs;               // Held by queue/worker and by Lua future
+    struct async_job *next;
+};
+
+// Registry key of coroutines run as tasks by async_run() (weak keys)
+static const char async_tasks_key = 0;
+
+static struct async_job *async_queue = NULL;
+static int async_threads = 0;
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_done_cond = PTHREAD_COND_INITIALIZER;
+
+void session_push(lua_State *L, struct session_t *session)
+{
+    struct session_t **userdata;
+
+    pthread_mutex_lock(&session_mutex);
+    session->refs++;
+    pthread_mutex_unlock(&session_mutex);
+
+    userdata = lua_newuserdata(L, sizeof(struct session_t *));
+    *userdata = session;
+    luaL_getmetatable(L, SESSION_METATABLE);
+    lua_setmetatable(L, -2);
+}
+
+struct session_t *session_ref(lua_State *L, int index)
+{
+    struct session_t **userdata;
+    bool equal;
+
+    if ((lua_type(L, index) != LUA_TUSERDATA) || !lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, SESSION_METATABLE);
+    equal = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (!equal)
+        return NULL;
+
+    userdata = lua_touserdata(L, index);
+    if (*userdata == NULL)
+        return NULL;
 
-static char log_script[] =
-"__log_data = {}\n"
-"\n"
-"function log_new()\n"
-"\n"
-"    local data = __log_data\n"
-"\n"
-"    handle = #data + 1\n"
-"    data[handle] = {}\n"
-"\n"
-"    return handle\n"
-"end\n"
-"\n"
-"function log_free(handle)\n"
-"--    table.remove(data, handle)\n"
-"end\n"
-"\n"
-"function log_add (handle, ...)\n"
-"\n"
-"    local data = __log_data\n"
-"\n"
-"    i = #data[handle] + 1\n"
-"\n"
-"    data[handle][i] = {}\n"
-"    for j,v in ipairs{...} do\n"
-"        data[handle][i][j] = v\n"
-"    end\n"
-"end\n"
-"\n"
-"function log_save_csv(handle, filename)\n"
-"\n"
-"    local data = __log_data\n"
-"\n"
-"    file = io.open(filename, \"w\")\n"
-"    io.output(file)\n"
-"\n"
-"    for i=1, #data[handle], 1\n"
-"    do \n"
-"        for j=1, #data[handle][i], 1\n"
-"        do\n"
-"            if (j == #data[handle][i])\n"
-"            then\n"
-"                io.write(data[handle][i][j])\n"
-"            else\n"
-"                io.write(data[handle][i][j] .. \",\")\n"
-"            end\n"
-"        end\n"
-"        io.write(\"\\n\")\n"
-"    end\n"
-"\n"
-"    io.close(file)\n"
-"end\n";
+    pthread_mutex_lock(&session_mutex);
+    (*userdata)->refs++;
+    pthread_mutex_unlock(&session_mutex);
 
+    return *userdata;
+}
+
+void session_unref(struct session_t *session)
+{
+    int refs;
+
+    pthread_mutex_lock(&session_mutex);
+    refs = --session->refs;
+    pthread_mutex_unlock(&session_mutex);
+
+    if (refs > 0)
+        return;
+
+    // Last reference gone so close connection
+    if (session->device != LXI_ERROR)
+        lxi_disconnect(session->device);
+    pthread_mutex_destroy(&session->lock);
+    free(session->buffer);
+    free(session);
+}
+
+// Check that argument at index is a connected device
+static struct session_t *session_check(lua_State *L, int index)
+{
+    struct session_t *session = *(struct session_t **) luaL_checkudata(L, index, SESSION_METATABLE);
+
+    if ((session == NULL) || (session->device == LXI_ERROR))
+        luaL_argerror(L, index, "device not connected");
+
+    return session;
+}
+
+static void session_count_error(struct session_t *session)
+{
+    pthread_mutex_lock(&session_mutex);
+    session->stats.errors++;
+    pthread_mutex_unlock(&session_mutex);
+}
+
+// Account completed query which was started at given time
+static void session_count_query(struct session_t *session, double start)
+{
+    struct session_stats_t *stats = &session->stats;
+    double latency = time_now() - start;
+    size_t i;
+
+    for (i=0; i<LATENCY_BUCKETS-1; i++)
+        if (latency <= latency_bounds[i])
+            break;
+
+    pthread_mutex_lock(&session_mutex);
+    if ((stats->queries == 0) || (latency < stats->latency_min))
+        stats->latency_min = latency;
+    if (latency > stats->latency_max)
+        stats->latency_max = latency;
+    stats->latency_total += latency;
+    stats->latency_histogram[i]++;
+    stats->queries++;
+    pthread_mutex_unlock(&session_mutex);
+}
 
+// Wait for asynchronous requests of device to finish so responses do not mix
+static void async_wait_idle(struct session_t *session)
+{
+    pthread_mutex_lock(&async_mutex);
+    while (session->async_pending > 0)
+        pthread_cond_wait(&async_done_cond, &async_mutex);
+    pthread_mutex_unlock(&async_mutex);
+}
 
 // lua: device = lxi_connect(address, port, name, timeout, protocol)
 static int connect(lua_State *L)
 {
+    struct session_t *session;
     int device;
     const char *address = lua_tostring(L, 1);
     int port = lua_tointeger(L, 2);
@@ -152,14 +311,39 @@ static int connect(lua_State *L)
     // Connect to LXI instrument using VXI11
     device = lxi_connect(address, arg_port, arg_name, arg_timeout, arg_protocol);
     if (device == LXI_ERROR)
+    {
         error_printf("Failed to connect\n");
+        lua_pushnil(L);
+        return 1;
+    }
 
     // Save session data for later reuse
-    session[device].timeout = arg_timeout;
-    session[device].protocol = arg_protocol;
+    session = calloc(1, sizeof(struct session_t));
+    if (session == NULL)
+    {
+        lxi_disconnect(device);
+        return luaL_error(L, "connect: out of memory");
+    }
+    session->device = device;
+    session->timeout = arg_timeout;
+    session->protocol = arg_protocol;
+    strncpy(session->address, address, sizeof(session->address) - 1);
+    session->plugin = NULL;
+    pthread_mutex_init(&session->lock, NULL);
 
-    // Return status
-    lua_pushinteger(L, device);
+    // VXI11 responses must fit in buffer of one receive while raw/TCP
+    // responses are received in pieces into buffer growing as needed
+    session->size = (arg_protocol == VXI11) ? RESPONSE_LENGTH_MAX : RESPONSE_BUFFER_INITIAL;
+    session->buffer = malloc(session->size);
+    if (session->buffer == NULL)
+    {
+        lxi_disconnect(device);
+        free(session);
+        return luaL_error(L, "connect: out of memory");
+    }
+
+    // Return device
+    session_push(L, session);
     return 1;
 }
 
@@ -167,62 +351,174 @@ static int connect(lua_State *L)
 static int disconnect(lua_State *L)
 {
     int status = 0;
-    int device = lua_tointeger(L, 1);
+    struct session_t *session = session_check(L, 1);
+
+    async_wait_idle(session);
 
     // Disconnect
-    status = lxi_disconnect(device);
+    pthread_mutex_lock(&session->lock);
+    status = lxi_disconnect(session->device);
+    session->device = LXI_ERROR;
+    pthread_mutex_unlock(&session->lock);
 
     // Return status
     lua_pushnumber(L, status);
     return 1;
 }
 
+static int session_gc(lua_State *L)
+{
+    struct session_t **userdata = luaL_checkudata(L, 1, SESSION_METATABLE);
+
+    if (*userdata != NULL)
+        session_unref(*userdata);
+    *userdata = NULL;
+
+    return 0;
+}
+
+static int session_tostring(lua_State *L)
+{
+    struct session_t **userdata = luaL_checkudata(L, 1, SESSION_METATABLE);
+
+    if ((*userdata == NULL) || ((*userdata)->device == LXI_ERROR))
+        lua_pushstring(L, "device (disconnected)");
+    else
+        lua_pushfstring(L, "device (%s)", (*userdata)->address);
+    return 1;
+}
+
+// Grow receive buffer of session to at least given size
+static int receive_grow(struct session_t *session, size_t size)
+{
+    char *buffer;
+
+    buffer = realloc(session->buffer, size);
+    if (buffer == NULL)
+        return -1;
+    session->buffer = buffer;
+    session->size = size;
+
+    return 0;
+}
+
+// Send command, adding newline in case of raw/TCP session
+static int send_command(struct session_t *session, const char *command, bool newline, int timeout)
+{
+    size_t length = strlen(command);
+    int status;
+
+    if (newline && (session->protocol == RAW))
+    {
+        // Reuse receive buffer to build command with newline appended
+        if ((length + 2 > session->size) && (receive_grow(session, length + 2) != 0))
+            return -1;
+        memcpy(session->buffer, command, length);
+        session->buffer[length++] = '\n';
+        command = session->buffer;
+    }
+
+    status = lxi_send(session->device, command, length, timeout);
+
+    pthread_mutex_lock(&session_mutex);
+    if (status < 0)
+        session->stats.errors++;
+    else
+    {
+        session->stats.commands++;
+        session->stats.bytes_out += length;
+    }
+    pthread_mutex_unlock(&session_mutex);
+
+    return status;
+}
+
+// Receive more response data into growing buffer, returns length received or -1
+static int receive_more(struct session_t *session, size_t received, size_t wanted, int timeout)
+{
+    int length;
+
+    // Keep room for terminating zero
+    if ((wanted + 1 > session->size) && (receive_grow(session, wanted + 1) != 0))
+        return -1;
+
+    length = lxi_receive(session->device, session->buffer + received, session->size - 1 - received, timeout);
+    if (length <= 0)
+    {
+        session_count_error(session);
+        return -1;
+    }
+
+    pthread_mutex_lock(&session_mutex);
+    session->stats.bytes_in += length;
+    pthread_mutex_unlock(&session_mutex);
+
+    return length;
+}
+
+// Receive complete response (raw/TCP responses may arrive in pieces)
+static int receive_response(struct session_t *session, int timeout)
+{
+    size_t received = 0;
+    int length;
+
+    do
+    {
+        // Grow buffer when full
+        length = receive_more(session, received, MAX(session->size - 1, received + RESPONSE_LENGTH_MAX / 4), timeout);
+        if (length < 0)
+            return -1;
+        received += length;
+    } while ((session->protocol == RAW) && (session->buffer[received - 1] != '\n'));
+
+    session->buffer[received] = 0;
+
+    return received;
+}
+
 // lua: scpi(device, command, timeout)
 static int scpi(lua_State *L)
 {
-    char* response = malloc(RESPONSE_LENGTH_MAX);
+    struct session_t *session = session_check(L, 1);
     int status = 0, length;
-    int device = lua_tointeger(L, 1);
-    const char *command = lua_tostring(L, 2);
+    const char *command = luaL_checkstring(L, 2);
     int timeout = lua_tointeger(L, 3);
-    char command_buffer[1000];
+    double start = time_now();
+    char *response;
 
     // Use session timeout if no timeout provided
     if (timeout == 0)
-        timeout = session[device].timeout;
+        timeout = session->timeout;
 
     strip_trailing_space((char *) command);
 
-    if (session[device].protocol == RAW)
-    {
-        // Add newline to command string
-        strcpy(command_buffer, command);
-        command_buffer[strlen(command)] = '\n';
-        command_buffer[strlen(command)+1] = 0;
-        command = command_buffer;
-    }
+    async_wait_idle(session);
+    pthread_mutex_lock(&session->lock);
 
     // Send SCPI command
-    length = lxi_send(device, command, strlen(command), timeout);
+    length = send_command(session, command, true, timeout);
     if (length < 0)
     {
         error_printf("Failed to send message\n");
         status = length;
         goto error;
     }
+    length = 0;
 
     // Only expect response in case we are firing a question command
     if (question(command))
     {
-        length = lxi_receive(device, response, RESPONSE_LENGTH_MAX, timeout);
+        length = receive_response(session, timeout);
         if (length < 0)
         {
             error_printf("Failed to receive message\n");
             status = length;
             goto error;
         }
+        session_count_query(session, start);
     }
 
+    response = session->buffer;
     if (length > 0)
     {
         // Strip newline
@@ -230,186 +526,1655 @@ static int scpi(lua_State *L)
             response[--length] = 0;
 
         // Strip carriage return
-        if (response[length-1] == '\r')
+        if ((length > 0) && (response[length-1] == '\r'))
             response[--length] = 0;
     }
 
     lua_pushlstring(L, response, length);
-    free(response);
+    pthread_mutex_unlock(&session->lock);
     return 1;
 
 error:
     // Return status
+    pthread_mutex_unlock(&session->lock);
     lua_pushnumber(L, status);
-    free(response);
     return 1;
 }
 
 // lua: scpi_raw(device, command, timeout)
 static int scpi_raw(lua_State *L)
 {
-    char* response = malloc(RESPONSE_LENGTH_MAX);
+    struct session_t *session = session_check(L, 1);
     int status = 0, length;
-    int device = lua_tointeger(L, 1);
-    const char *command = lua_tostring(L, 2);
+    const char *command = luaL_checkstring(L, 2);
     int timeout = lua_tointeger(L, 3);
+    double start = time_now();
 
     // Use session timeout if no timeout provided
     if (timeout == 0)
-        timeout = session[device].timeout;
+        timeout = session->timeout;
+
+    async_wait_idle(session);
+    pthread_mutex_lock(&session->lock);
 
     // Send SCPI command
-    length = lxi_send(device, command, strlen(command), timeout);
+    length = send_command(session, command, false, timeout);
     if (length < 0)
     {
         error_printf("Failed to send message\n");
         status = length;
         goto error;
     }
+    length = 0;
 
     // Only expect response in case we are firing a question command
     if (question(command))
     {
-        length = lxi_receive(device, response, RESPONSE_LENGTH_MAX, timeout);
+        length = receive_more(session, 0, session->size - 1, timeout);
         if (length < 0)
         {
             error_printf("Failed to receive message\n");
             status = length;
             goto error;
         }
+        session_count_query(session, start);
     }
 
-    lua_pushlstring(L, response, length);
-    free(response);
+    lua_pushlstring(L, session->buffer, length);
+    pthread_mutex_unlock(&session->lock);
     return 1;
 
 error:
     // Return status
+    pthread_mutex_unlock(&session->lock);
     lua_pushnumber(L, status);
-    free(response);
     return 1;
 }
 
+// Strip trailing newline/carriage return and leading/trailing whitespace
+static const char *response_trim(const char *response, size_t *length)
+{
+    while ((*length > 0) && isspace((unsigned char) response[*length - 1]))
+        (*length)--;
+    while ((*length > 0) && isspace((unsigned char) *response))
+    {
+        response++;
+        (*length)--;
+    }
 
-// lua: sleep(seconds)
-static int sleep_(lua_State *L)
+    return response;
+}
+
+struct batch_response
 {
-    long seconds = lua_tointeger(L, 1);
+    char *data;
+    size_t length;
+};
 
-    sleep(seconds);
+// Store copy of trimmed response, pushed once session lock is released
+static int batch_store(struct batch_response *response, const char *data, size_t length)
+{
+    data = response_trim(data, &length);
+    response->data = malloc(length + 1);
+    if (response->data == NULL)
+        return -1;
+    memcpy(response->data, data, length);
+    response->data[length] = 0;
+    response->length = length;
 
     return 0;
 }
 
-// lua: msleep(miliseconds)
-static int msleep(lua_State *L)
+// Command can be combined with other commands in one message
+static bool batch_packable(const char *command)
 {
-    long mseconds = lua_tointeger(L, 1);
-    long useconds = mseconds * 1000;
+    const char *p;
 
-    usleep(useconds);
+    // Compound commands and binary block arguments are sent on their own
+    if ((command[0] == 0) || (strchr(command, ';') != NULL))
+        return false;
+    for (p = strchr(command, '#'); p != NULL; p = strchr(p + 1, '#'))
+        if (isdigit((unsigned char) p[1]))
+            return false;
 
-    return 0;
+    return true;
 }
 
-// lua: handle = clock_new()
-static int clock_new(lua_State *L)
+// Split combined response at ';' or newline outside strings and blocks and
+// store parts as responses of the queries among commands[first..]. Only
+// counts parts if responses is NULL. Returns number of parts found (count + 1
+// if more than count) or -1 if out of memory.
+static int batch_split(const char *response, size_t length, int count, char **commands, int first, struct batch_response *responses)
 {
-    int handle;
+    const char *begin, *end, *p;
+    size_t block, digits;
+    int parts = 0, i = first;
+    char quote;
 
-    // Find free clock
-    for (handle=0; handle<CLOCKS_MAX; handle++)
+    // Ignore terminating newline of last response
+    response = response_trim(response, &length);
+    begin = p = response;
+    end = response + length;
+
+    while (p <= end)
     {
-        if (lua_clock[handle].allocated == false)
+        if ((p == end) || (*p == ';') || (*p == '\n'))
         {
-            lua_clock[handle].allocated = true;
-            lua_clock[handle].time_start = 0;
+            if (parts == count)
+                return count + 1;
+            if (responses != NULL)
+            {
+                while (!question(commands[i]))
+                    i++;
+                if (batch_store(&responses[i++], begin, p - begin) != 0)
+                    return -1;
+            }
+            parts++;
+            begin = ++p;
+        }
+        else if ((*p == '"') || (*p == '\''))
+        {
+            // Quoted string (quotes inside are doubled)
+            for (quote = *p++; (p < end) && (*p != quote); p++)
+                ;
+            p++;
+        }
+        else if ((*p == '#') && (p + 1 < end) && (p[1] >= '1') && (p[1] <= '9'))
+        {
+            // Definite length block
+            digits = p[1] - '0';
+            if ((size_t) (end - p) < 2 + digits)
+                break;
+            for (block = 0, p += 2; digits > 0; digits--, p++)
+                block = block * 10 + (*p - '0');
+            p += MIN(block, (size_t) (end - p));
+        }
+        else
+            p++;
+    }
+
+    return parts;
+}
+
+// Receive data still arriving within drain timeout after received bytes
+// (no data arriving is not an error here). Returns total length received.
+static size_t batch_drain(struct session_t *session, size_t received)
+{
+    int length;
+
+    for (;;)
+    {
+        // Discard data which does not fit
+        if ((received + 1 >= session->size) &&
+            ((session->size >= RESPONSE_LENGTH_MAX) || (receive_grow(session, session->size * 2) != 0)))
+            received = 0;
+
+        length = lxi_receive(session->device, session->buffer + received, session->size - 1 - received, BATCH_DRAIN_TIMEOUT);
+        if (length <= 0)
             break;
+        received += length;
+
+        pthread_mutex_lock(&session_mutex);
+        session->stats.bytes_in += length;
+        pthread_mutex_unlock(&session_mutex);
+    }
+
+    session->buffer[received] = 0;
+
+    return received;
+}
+
+// Send commands[first..last] in one message and store their responses ("" if
+// command has no response). Returns -1 on error with error message set.
+static int batch_send(struct session_t *session, char **commands, int first, int last, int timeout,
+                      struct batch_response *responses, const char **error)
+{
+    double start = time_now();
+    size_t message_length = 0;
+    int queries = 0, parts, i, length;
+    char *message, *p;
+
+    for (i=first; i<=last; i++)
+    {
+        message_length += strlen(commands[i]) + 2;
+        if (question(commands[i]))
+            queries++;
+        else if (batch_store(&responses[i], "", 0) != 0)
+            goto error_memory;
+    }
+
+    // Join commands with ';' restarting at root of command tree with ':'
+    message = malloc(message_length + 1);
+    if (message == NULL)
+        goto error_memory;
+    p = message;
+    for (i=first; i<=last; i++)
+    {
+        if (i > first)
+        {
+            *p++ = ';';
+            if ((commands[i][0] != ':') && (commands[i][0] != '*'))
+                *p++ = ':';
         }
+        p = stpcpy(p, commands[i]);
     }
 
-    // Return clock handle
-    lua_pushinteger(L, handle);
-    return 1;
+    length = send_command(session, message, true, timeout);
+    free(message);
+    if (length < 0)
+    {
+        *error = "Failed to send message";
+        return -1;
+    }
+
+    if (queries == 0)
+        return 0;
+
+    length = receive_response(session, timeout);
+    if (length < 0)
+    {
+        // Discard late response so it is not taken as response to next command
+        batch_drain(session, 0);
+        *error = "Failed to receive response";
+        return -1;
+    }
+    session_count_query(session, start);
+
+    // Response of command sent on its own is not split
+    if (first == last)
+    {
+        if (batch_store(&responses[first], session->buffer, length) != 0)
+            goto error_memory;
+        return 0;
+    }
+
+    if (batch_split(session->buffer, length, queries, commands, first, NULL) != queries)
+    {
+        // Instrument may answer each query of combined message separately so
+        // collect responses still arriving. Queries are never sent again as the
+        // commands of the message have already been executed.
+        length = batch_drain(session, length);
+    }
+
+    parts = batch_split(session->buffer, length, queries, commands, first, responses);
+    if (parts < 0)
+        goto error_memory;
+    if (parts != queries)
+    {
+        *error = "Number of responses does not match queries of combined message";
+        return -1;
+    }
+
+    return 0;
+
+error_memory:
+    *error = "Out of memory";
+    return -1;
 }
 
-// lua: clock = clock_read()
-static int clock_read(lua_State *L)
+// lua: responses, error = scpi_batch(device, commands, max_length, timeout)
+static int scpi_batch(lua_State *L)
 {
-    int handle = lua_tointeger(L, 1);
-    struct timespec time_spec;
-    double time;
+    struct session_t *session = session_check(L, 1);
+    int max_length = luaL_optinteger(L, 3, BATCH_LENGTH_MAX);
+    int timeout = lua_tointeger(L, 4);
+    struct batch_response *responses = NULL;
+    const char *error = "Out of memory";
+    int count, first, i, status = 0;
+    size_t length = 0;
+    char **commands;
 
-    // Get current time
-    clock_gettime(CLOCK_MONOTONIC, &time_spec);
-    time = time_spec.tv_sec;
-    time += time_spec.tv_nsec * 0.000000001;
+    luaL_checktype(L, 2, LUA_TTABLE);
 
-    // If first read call
-    if (lua_clock[handle].time_start == 0)
+    // Use session timeout if no timeout provided
+    if (timeout == 0)
+        timeout = session->timeout;
+
+    count = lua_rawlen(L, 2);
+    for (i=1; i<=count; i++)
     {
-        // Save start time
-        lua_clock[handle].time_start = time;
+        lua_rawgeti(L, 2, i);
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "commands must be strings");
+        lua_pop(L, 1);
+    }
+    lua_createtable(L, count, 0);
 
-        // Return 0 time
-        lua_pushnumber(L, 0);
-        return 1;
+    commands = calloc(count + 1, sizeof(char *));
+    responses = calloc(count + 1, sizeof(struct batch_response));
+    if ((commands == NULL) || (responses == NULL))
+    {
+        status = -1;
+        goto done;
+    }
+    for (i=0; i<count; i++)
+    {
+        lua_rawgeti(L, 2, i + 1);
+        commands[i] = strdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        if (commands[i] == NULL)
+        {
+            status = -1;
+            goto done;
+        }
+        strip_trailing_space(commands[i]);
+    }
+
+    async_wait_idle(session);
+    pthread_mutex_lock(&session->lock);
+
+    // Pack as many commands into each message as length allows
+    for (first=0; (status == 0) && (first<count); first=i)
+    {
+        length = strlen(commands[first]);
+        for (i=first+1; batch_packable(commands[first]) && (i<count) && batch_packable(commands[i]); i++)
+        {
+            if (length + strlen(commands[i]) + 2 > (size_t) max_length)
+                break;
+            length += strlen(commands[i]) + 2;
+        }
+
+        status = batch_send(session, commands, first, i - 1, timeout, responses, &error);
+    }
+
+    pthread_mutex_unlock(&session->lock);
+
+done:
+    // Move responses received into table (nil for commands not completed)
+    for (i=0; i<count; i++)
+    {
+        if (commands != NULL)
+            free(commands[i]);
+        if ((responses != NULL) && (responses[i].data != NULL))
+        {
+            lua_pushlstring(L, responses[i].data, responses[i].length);
+            lua_rawseti(L, -2, i + 1);
+            free(responses[i].data);
+        }
+    }
+    free(commands);
+    free(responses);
+
+    if (status != 0)
+    {
+        error_printf("Failed to send batch: %s\n", error);
+        lua_pushstring(L, error);
+        return 2;
     }
 
-    // Return elapsed time since clock start
-    time = time - lua_clock[handle].time_start;
-    lua_pushnumber(L, time);
     return 1;
 }
 
-// lua: clock_reset()
-static int clock_reset(lua_State *L)
+// lua: array = scpi_values(device, command, type, timeout)
+struct array_copy
 {
-    int handle = lua_tointeger(L, 1);
+    enum array_type type;
+    char *data;
+    size_t size;
+    bool binary;
+    bool big_endian;
+};
 
-    lua_clock[handle].time_start = 0;
+// Copy response out of session buffer so array can be pushed without
+// holding session lock (pushing may raise an error)
+static bool array_copy_new(struct array_copy *copy, const char *data, size_t size)
+{
+    copy->data = malloc(size + 1);
+    if (copy->data == NULL)
+        return false;
+    memcpy(copy->data, data, size);
+    copy->data[size] = 0;
+    copy->size = size;
 
-    return 0;
+    return true;
 }
 
-// lua: clock_free()
-static int clock_free(lua_State *L)
+static int array_copy_push(lua_State *L)
 {
-    int handle = lua_tointeger(L, 1);
+    struct array_copy *copy = lua_touserdata(L, 1);
 
-    lua_clock[handle].allocated = false;
-    lua_clock[handle].time_start = 0;
-
-    return 0;
+    if (copy->binary)
+        return array_push_binary(L, copy->type, copy->data, copy->size, copy->big_endian) != NULL;
+    else
+        return array_push_values(L, copy->type, copy->data, copy->size) != NULL;
 }
 
-static void load_log_script(lua_State *L)
+// Push array from copy (or nothing on invalid data) and release copy. Expects
+// array_copy_push() pushed before copy was made.
+static bool array_copy_finish(lua_State *L, struct array_copy *copy)
 {
-    int error;
+    int status;
 
-    error = luaL_loadbuffer(L, log_script, strlen(log_script), "lxi") ||
-        lua_pcall(L, 0, 0, 0);
-    if (error)
+    lua_pushlightuserdata(L, copy);
+    status = lua_pcall(L, 1, 1, 0);
+    free(copy->data);
+    if (status != 0)
+        lua_error(L);
+
+    if (lua_isnil(L, -1))
     {
-        error_printf("%s\n", lua_tostring(L, -1));
-        lua_pop(L, 1);  /* pop error message from the stack */
+        lua_pop(L, 1);
+        return false;
     }
+
+    return true;
 }
 
-int lua_register_lxi(lua_State *L)
+static int scpi_values(lua_State *L)
 {
-    lua_register(L, "connect", connect);
-    lua_register(L, "disconnect", disconnect);
-    lua_register(L, "scpi", scpi);
-    lua_register(L, "scpi_raw", scpi_raw);
-    lua_register(L, "sleep", sleep_);
-    lua_register(L, "msleep", msleep);
-    lua_register(L, "clock_new", clock_new);
-    lua_register(L, "clock_read", clock_read);
-    lua_register(L, "clock_reset", clock_reset);
-    lua_register(L, "clock_free", clock_free);
+    struct session_t *session = session_check(L, 1);
+    const char *command = luaL_checkstring(L, 2);
+    enum array_type type = array_check_type(L, 3);
+    int timeout = lua_tointeger(L, 4);
+    double start = time_now();
+    struct array_copy copy = { .type = type, .binary = false };
+    char *values;
+    int length;
+
+    // Use session timeout if no timeout provided
+    if (timeout == 0)
+        timeout = session->timeout;
+
+    lua_pushcfunction(L, array_copy_push);
+
+    async_wait_idle(session);
+    pthread_mutex_lock(&session->lock);
+
+    if (send_command(session, command, true, timeout) < 0)
+    {
+        error_printf("Failed to send message\n");
+        goto error;
+    }
+
+    length = receive_response(session, timeout);
+    if (length < 0)
+    {
+        error_printf("Failed to receive message\n");
+        goto error;
+    }
+    session_count_query(session, start);
+
+    // Skip block header some instruments put in front of ASCII data
+    values = session->buffer;
+    if ((values[0] == '#') && isdigit((unsigned char) values[1]) && (length >= 2 + values[1] - '0'))
+        values += 2 + values[1] - '0';
+
+    if (!array_copy_new(&copy, values, length - (values - session->buffer)))
+    {
+        error_printf("Failed to allocate memory\n");
+        goto error;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    if (!array_copy_finish(L, &copy))
+    {
+        error_printf("Failed to parse values\n");
+        lua_pushnil(L);
+    }
+    return 1;
+
+error:
+    pthread_mutex_unlock(&session->lock);
+    lua_pushnil(L);
+    return 1;
+}
+
+// lua: array = scpi_block(device, command, type, byte_order, timeout)
+static int scpi_block(lua_State *L)
+{
+    struct session_t *session = session_check(L, 1);
+    const char *command = luaL_checkstring(L, 2);
+    enum array_type type = array_check_type(L, 3);
+    bool big_endian = array_check_big_endian(L, 4);
+    int timeout = lua_tointeger(L, 5);
+    double start = time_now();
+    struct array_copy copy = { .type = type, .binary = true, .big_endian = big_endian };
+    size_t received, header_length, data_length, i;
+    char *response;
+    int length;
+
+    // Use session timeout if no timeout provided
+    if (timeout == 0)
+        timeout = session->timeout;
+
+    lua_pushcfunction(L, array_copy_push);
+
+    async_wait_idle(session);
+    pthread_mutex_lock(&session->lock);
+
+    if (send_command(session, command, true, timeout) < 0)
+    {
+        error_printf("Failed to send message\n");
+        goto error;
+    }
+
+    length = receive_more(session, 0, session->size - 1, timeout);
+    if (length < 0)
+    {
+        error_printf("Failed to receive message\n");
+        goto error;
+    }
+    received = length;
+
+    // Wait for complete block header (#<n><n digits of data length>)
+    while ((received < 2) || ((session->buffer[0] == '#') && isdigit((unsigned char) session->buffer[1]) &&
+            (received < 2 + (size_t) (session->buffer[1] - '0'))))
+    {
+        length = receive_more(session, received, session->size - 1, timeout);
+        if (length < 0)
+            goto error_block;
+        received += length;
+    }
+    response = session->buffer;
+    if ((response[0] != '#') || !isdigit((unsigned char) response[1]))
+        goto error_block;
+
+    header_length = 2 + response[1] - '0';
+    if (header_length == 2)
+    {
+        // Indefinite length block ends with newline
+        if (session->protocol == RAW)
+        {
+            while (session->buffer[received - 1] != '\n')
+            {
+                length = receive_more(session, received, MAX(session->size - 1, received + RESPONSE_LENGTH_MAX / 4), timeout);
+                if (length < 0)
+                    goto error_block;
+                received += length;
+            }
+        }
+        data_length = received - header_length;
+        if ((data_length > 0) && (session->buffer[received - 1] == '\n'))
+            data_length--;
+    }
+    else
+    {
+        // Definite length block
+        data_length = 0;
+        for (i=2; i<header_length; i++)
+            data_length = data_length * 10 + (response[i] - '0');
+
+        // Receive remaining block data directly into (grown) buffer
+        while (received < header_length + data_length)
+        {
+            length = receive_more(session, received, header_length + data_length + 1, timeout);
+            if (length < 0)
+                goto error_block;
+            received += length;
+        }
+
+        // Consume response terminator so it does not end up in next response
+        if ((session->protocol == RAW) && (received == header_length + data_length))
+            receive_more(session, received, received + 1, timeout);
+    }
+    session_count_query(session, start);
+
+    if (!array_copy_new(&copy, session->buffer + header_length, data_length))
+    {
+        error_printf("Failed to allocate memory\n");
+        goto error;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    if (!array_copy_finish(L, &copy))
+    {
+        error_printf("Block size (%lu) is not a multiple of sample size\n", (unsigned long) data_length);
+        lua_pushnil(L);
+    }
+    return 1;
+
+error_block:
+    error_printf("Failed to receive block\n");
+error:
+    pthread_mutex_unlock(&session->lock);
+    lua_pushnil(L);
+    return 1;
+}
+
+// lua: statistics = stats(device)
+static int stats(lua_State *L)
+{
+    struct session_t *session = *(struct session_t **) luaL_checkudata(L, 1, SESSION_METATABLE);
+    struct session_stats_t stats;
+    size_t i;
+
+    luaL_argcheck(L, session != NULL, 1, "device not connected");
+
+    pthread_mutex_lock(&session_mutex);
+    stats = session->stats;
+    pthread_mutex_unlock(&session_mutex);
+
+    lua_newtable(L);
+    lua_pushinteger(L, stats.commands);
+    lua_setfield(L, -2, "commands");
+    lua_pushinteger(L, stats.queries);
+    lua_setfield(L, -2, "queries");
+    lua_pushinteger(L, stats.errors);
+    lua_setfield(L, -2, "errors");
+    lua_pushinteger(L, stats.bytes_out);
+    lua_setfield(L, -2, "bytes_out");
+    lua_pushinteger(L, stats.bytes_in);
+    lua_setfield(L, -2, "bytes_in");
+    lua_pushnumber(L, stats.latency_min);
+    lua_setfield(L, -2, "latency_min");
+    lua_pushnumber(L, stats.latency_max);
+    lua_setfield(L, -2, "latency_max");
+    lua_pushnumber(L, stats.queries > 0 ? stats.latency_total / stats.queries : 0);
+    lua_setfield(L, -2, "latency_mean");
+
+    // Histogram as list of { le = <upper bound>, count = <queries> }
+    lua_createtable(L, LATENCY_BUCKETS, 0);
+    for (i=0; i<LATENCY_BUCKETS; i++)
+    {
+        lua_createtable(L, 0, 2);
+        lua_pushnumber(L, (i < LATENCY_BUCKETS - 1) ? latency_bounds[i] : HUGE_VAL);
+        lua_setfield(L, -2, "le");
+        lua_pushinteger(L, stats.latency_histogram[i]);
+        lua_setfield(L, -2, "count");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "latency_histogram");
+
+    return 1;
+}
+
+static void async_job_release(struct async_job *job)
+{
+    // Called with async mutex held
+    if (--job->refs > 0)
+        return;
+
+    session_unref(job->session);
+    free(job->command);
+    free(job->response);
+    free(job);
+}
+
+static void async_job_run(struct async_job *job)
+{
+    struct session_t *session = job->session;
+    double start = time_now();
+    int length;
+
+    pthread_mutex_lock(&session->lock);
+
+    if (session->device == LXI_ERROR)
+        length = -1;
+    else
+        length = send_command(session, job->command, true, job->timeout);
+    if ((length >= 0) && question(job->command))
+    {
+        length = receive_response(session, job->timeout);
+        if (length >= 0)
+            session_count_query(session, start);
+    }
+    else if (length >= 0)
+        length = 0;
+
+    if (length > 0)
+    {
+        // Strip newline and carriage return
+        if (session->buffer[length-1] == '\n')
+            length--;
+        if ((length > 0) && (session->buffer[length-1] == '\r'))
+            length--;
+    }
+
+    // Copy response out of session buffer
+    if (length >= 0)
+    {
+        job->response = malloc(length + 1);
+        if (job->response != NULL)
+            memcpy(job->response, session->buffer, length);
+        else
+            length = -1;
+    }
+    job->length = length;
+
+    pthread_mutex_unlock(&session->lock);
+}
+
+static void *async_worker_thread(void *data)
+{
+    struct async_job **link, *job;
+
+    UNUSED(data);
+
+    pthread_mutex_lock(&async_mutex);
+    while (true)
+    {
+        // Take first queued job of a device which is not already served
+        for (link = &async_queue; *link != NULL; link = &(*link)->next)
+            if (!(*link)->session->async_busy)
+                break;
+        if (*link == NULL)
+        {
+            pthread_cond_wait(&async_job_cond, &async_mutex);
+            continue;
+        }
+        job = *link;
+        *link = job->next;
+        job->session->async_busy = true;
+        pthread_mutex_unlock(&async_mutex);
+
+        async_job_run(job);
+
+        pthread_mutex_lock(&async_mutex);
+        job->done = true;
+        job->session->async_busy = false;
+        job->session->async_pending--;
+        async_job_release(job);
+
+        // Wake up awaiters and workers waiting for device to become free
+        pthread_cond_broadcast(&async_done_cond);
+        pthread_cond_broadcast(&async_job_cond);
+    }
+
+    return NULL;
+}
+
+static struct async_job *future_check(lua_State *L, int index)
+{
+    return *(struct async_job **) luaL_checkudata(L, index, FUTURE_METATABLE);
+}
+
+// lua: future = scpi_async(device, command, timeout)
+static int scpi_async(lua_State *L)
+{
+    struct session_t *session = session_check(L, 1);
+    const char *command = luaL_checkstring(L, 2);
+    int timeout = lua_tointeger(L, 3);
+    struct async_job *job, **link, **future;
+    pthread_t thread;
+
+    // Use session timeout if no timeout provided
+    if (timeout == 0)
+        timeout = session->timeout;
+
+    future = lua_newuserdata(L, sizeof(struct async_job *));
+    *future = NULL;
+    luaL_getmetatable(L, FUTURE_METATABLE);
+    lua_setmetatable(L, -2);
+
+    job = calloc(1, sizeof(struct async_job));
+    if (job == NULL)
+        return luaL_error(L, "scpi_async: out of memory");
+    job->session = session_ref(L, 1);
+    job->command = strdup(command);
+    job->timeout = timeout;
+    job->refs = 2;
+    strip_trailing_space(job->command);
+    *future = job;
+
+    pthread_mutex_lock(&async_mutex);
+
+    // Start I/O threads on first use
+    while (async_threads < ASYNC_THREADS)
+    {
+        if (pthread_create(&thread, NULL, async_worker_thread, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        async_threads++;
+    }
+
+    // Queue job (requests of same device are served in order)
+    for (link = &async_queue; *link != NULL; link = &(*link)->next);
+    *link = job;
+    session->async_pending++;
+    pthread_cond_signal(&async_job_cond);
+
+    pthread_mutex_unlock(&async_mutex);
+
+    if (async_threads == 0)
+        return luaL_error(L, "scpi_async: failed to start I/O threads");
+
+    return 1;
+}
+
+static int future_gc(lua_State *L)
+{
+    struct async_job **future = luaL_checkudata(L, 1, FUTURE_METATABLE);
+
+    if (*future == NULL)
+        return 0;
+
+    pthread_mutex_lock(&async_mutex);
+    async_job_release(*future);
+    pthread_mutex_unlock(&async_mutex);
+    *future = NULL;
+
+    return 0;
+}
+
+static bool future_done(struct async_job *job)
+{
+    bool done;
+
+    pthread_mutex_lock(&async_mutex);
+    done = job->done;
+    pthread_mutex_unlock(&async_mutex);
+
+    return done;
+}
+
+// lua: done = future:done()
+static int future_done_(lua_State *L)
+{
+    lua_pushboolean(L, future_done(future_check(L, 1)));
+    return 1;
+}
+
+// Block until all futures in list are done
+static void future_wait(struct async_job **jobs, int count)
+{
+    int i;
+
+    pthread_mutex_lock(&async_mutex);
+    for (i=0; i<count; i++)
+        while (!jobs[i]->done)
+            pthread_cond_wait(&async_done_cond, &async_mutex);
+    pthread_mutex_unlock(&async_mutex);
+}
+
+// Returns job of future at index or NULL if value is not a future
+static struct async_job *future_test(lua_State *L, int index)
+{
+    struct async_job **future = lua_touserdata(L, index);
+
+    if ((future == NULL) || !lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, FUTURE_METATABLE);
+    if (!lua_rawequal(L, -1, -2))
+        future = NULL;
+    lua_pop(L, 2);
+
+    return (future != NULL) ? *future : NULL;
+}
+
+// Push table of coroutines run as tasks by async_run()
+static void async_tasks_push(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *) &async_tasks_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1))
+        return;
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, (void *) &async_tasks_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+#if LUA_VERSION_NUM >= 503
+// Running coroutine is task of async_run() which resumes it when its
+// futures are done (other coroutines know nothing about futures)
+static bool async_task_running(lua_State *L)
+{
+    bool task;
+
+    if (!lua_isyieldable(L))
+        return false;
+
+    async_tasks_push(L);
+    lua_pushthread(L);
+    lua_rawget(L, -2);
+    task = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+
+    return task;
+}
+#endif
+
+// Push response of finished job, returns number of values pushed
+static int future_push_result(lua_State *L, struct async_job *job)
+{
+    if (job->length < 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to send or receive message");
+        return 2;
+    }
+
+    lua_pushlstring(L, job->response, job->length);
+    return 1;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int await_continue(lua_State *L, int status, lua_KContext context);
+static int await_all_continue(lua_State *L, int status, lua_KContext context);
+#endif
+
+// lua: response = await(future)
+static int await(lua_State *L)
+{
+    struct async_job *job = future_check(L, 1);
+
+    lua_settop(L, 1);
+
+#if LUA_VERSION_NUM >= 503
+    // Let other tasks run while response is pending
+    if (!future_done(job) && async_task_running(L))
+    {
+        // Yield copy of future to async_run(), continuation gets argument
+        lua_pushvalue(L, 1);
+        return lua_yieldk(L, 1, 0, await_continue);
+    }
+#endif
+
+    future_wait(&job, 1);
+
+    return future_push_result(L, job);
+}
+
+// lua: responses = await_all(futures)
+static int await_all(lua_State *L)
+{
+    struct async_job **jobs;
+    int count, i;
+    bool done = true;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    count = lua_rawlen(L, 1);
+
+    jobs = lua_newuserdata(L, (count > 0 ? count : 1) * sizeof(struct async_job *));
+    for (i=0; i<count; i++)
+    {
+        lua_rawgeti(L, 1, i + 1);
+        jobs[i] = future_check(L, -1);
+        lua_pop(L, 1);
+        done = done && future_done(jobs[i]);
+    }
+
+#if LUA_VERSION_NUM >= 503
+    if (!done && async_task_running(L))
+    {
+        lua_settop(L, 1);
+        lua_pushvalue(L, 1);
+        return lua_yieldk(L, 1, 0, await_all_continue);
+    }
+#else
+    UNUSED(done);
+#endif
+
+    future_wait(jobs, count);
+
+    // Failed requests are false in list of responses
+    lua_createtable(L, count, 0);
+    for (i=0; i<count; i++)
+    {
+        if (jobs[i]->length < 0)
+            lua_pushboolean(L, false);
+        else
+            lua_pushlstring(L, jobs[i]->response, jobs[i]->length);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int await_continue(lua_State *L, int status, lua_KContext context)
+{
+    UNUSED(status);
+    UNUSED(context);
+
+    return await(L);
+}
+
+static int await_all_continue(lua_State *L, int status, lua_KContext context)
+{
+    UNUSED(status);
+    UNUSED(context);
+
+    return await_all(L);
+}
+#endif
+
+// Task can be resumed as future(s) it yielded at index are done (nil or other
+// values yielded by task itself). Call with async_mutex held.
+static bool async_task_ready(lua_State *L, int index)
+{
+    struct async_job *job;
+    int i, count;
+
+    if (lua_istable(L, index))
+    {
+        count = lua_rawlen(L, index);
+        for (i=1; i<=count; i++)
+        {
+            lua_rawgeti(L, index, i);
+            job = future_test(L, -1);
+            lua_pop(L, 1);
+            if ((job != NULL) && !job->done)
+                return false;
+        }
+        return true;
+    }
+
+    job = future_test(L, index);
+    return (job == NULL) || job->done;
+}
+
+// lua: result1, result2, ... = async_run(function1, function2, ...)
+static int async_run(lua_State *L)
+{
+    int count = lua_gettop(L);
+    int running = count, next = 0, i;
+    lua_State *thread;
+
+    for (i=1; i<=count; i++)
+        luaL_checktype(L, i, LUA_TFUNCTION);
+    luaL_checkstack(L, count + 8, "async_run: too many functions");
+
+    // Replace functions with task coroutines at 1..count, what each task
+    // waits for (and finally its result) is at count+1..2*count
+    async_tasks_push(L);
+    for (i=1; i<=count; i++)
+    {
+        thread = lua_newthread(L);
+        lua_pushvalue(L, i);
+        lua_xmove(L, thread, 1);
+        lua_pushvalue(L, -1);
+        lua_pushboolean(L, true);
+        lua_rawset(L, count + 1);
+        lua_replace(L, i);
+    }
+    lua_pop(L, 1);
+    for (i=1; i<=count; i++)
+        lua_pushnil(L);
+
+    while (running > 0)
+    {
+        // Wait until next task in turn can continue
+        pthread_mutex_lock(&async_mutex);
+        for (;;)
+        {
+            for (i=0; i<count; i++)
+            {
+                next = next % count + 1;
+                if (lua_isthread(L, next) && async_task_ready(L, count + next))
+                    break;
+            }
+            if (i < count)
+                break;
+            pthread_cond_wait(&async_done_cond, &async_mutex);
+        }
+        pthread_mutex_unlock(&async_mutex);
+
+        // Resume with coroutine.resume() so task can be stopped
+        lua_getglobal(L, "coroutine");
+        lua_getfield(L, -1, "resume");
+        lua_remove(L, -2);
+        lua_pushvalue(L, next);
+        lua_call(L, 1, 2);
+        if (!lua_toboolean(L, -2))
+            return lua_error(L);
+
+        lua_replace(L, count + next);
+        lua_pop(L, 1);
+        if (lua_status(lua_tothread(L, next)) != LUA_YIELD)
+        {
+            // Finished, keep first result
+            lua_pushboolean(L, false);
+            lua_replace(L, next);
+            running--;
+        }
+    }
+
+    return count;
+}
+
+static const char **screenshot_cache_lookup(const char *address)
+{
+    int i;
+
+    for (i=0; i<SCREENSHOT_CACHE_MAX; i++)
+    {
+        if (strcmp(screenshot_cache[i].address, address) == 0)
+            return &screenshot_cache[i].plugin;
+    }
+
+    // Not found, replace oldest entry
+    i = screenshot_cache_next;
+    screenshot_cache_next = (screenshot_cache_next + 1) % SCREENSHOT_CACHE_MAX;
+    strncpy(screenshot_cache[i].address, address, sizeof(screenshot_cache[i].address) - 1);
+    screenshot_cache[i].plugin = NULL;
+
+    return &screenshot_cache[i].plugin;
+}
+
+static int screenshot_grab(lua_State *L, int plugin_index, int timeout_index, struct screenshot_image *image)
+{
+    const char *plugin_name = lua_tostring(L, plugin_index);
+    int timeout = lua_tointeger(L, timeout_index);
+    const char **plugin;
+    char address[256];
+    struct session_t *session = NULL;
+    int status;
+
+    // Make sure screenshot plugins are available
+    screenshot_register_plugins();
+
+    if (timeout == 0)
+        timeout = SCREENSHOT_TIMEOUT;
+
+    if (lua_type(L, 1) == LUA_TUSERDATA)
+    {
+        // Capture from connected device
+        session = session_check(L, 1);
+        strcpy(address, session->address);
+        async_wait_idle(session);
+        pthread_mutex_lock(&screenshot_mutex);
+        plugin = &session->plugin;
+    }
+    else
+    {
+        // Capture from address
+        strncpy(address, luaL_checkstring(L, 1), sizeof(address) - 1);
+        address[sizeof(address) - 1] = 0;
+        pthread_mutex_lock(&screenshot_mutex);
+        plugin = screenshot_cache_lookup(address);
+    }
+
+    // Screenshot plugins keep global state so captures are serialized
+
+    // Use plugin previously resolved for instrument
+    if ((plugin_name == NULL) && (*plugin != NULL))
+        plugin_name = *plugin;
+    if (plugin_name == NULL)
+        plugin_name = "";
+
+    // Plugins talk VXI11 so only reuse link of VXI11 sessions
+    if ((session != NULL) && (session->protocol == VXI11))
+    {
+        pthread_mutex_lock(&session->lock);
+        status = screenshot_device(session->device, address, (char *) plugin_name, timeout, image);
+        pthread_mutex_unlock(&session->lock);
+    }
+    else
+        status = screenshot(address, (char *) plugin_name, "", timeout, false, image);
+
+    if ((status != 0) || (image->buffer == NULL))
+    {
+        pthread_mutex_unlock(&screenshot_mutex);
+        free(image->buffer);
+        return 1;
+    }
+
+    // Remember plugin for next capture
+    *plugin = image->plugin;
+    pthread_mutex_unlock(&screenshot_mutex);
+
+    return 0;
+}
+
+// lua: image, format = screenshot(address|device, plugin, timeout)
+static int screenshot_(lua_State *L)
+{
+    struct screenshot_image image;
+
+    if (screenshot_grab(L, 2, 3, &image) != 0)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Return image data and format
+    lua_pushlstring(L, image.data, image.size);
+    lua_pushstring(L, image.format);
+    free(image.buffer);
+    return 2;
+}
+
+// lua: filename = screenshot_save(address|device, filename, plugin, timeout)
+static int screenshot_save(lua_State *L)
+{
+    const char *filename = lua_tostring(L, 2);
+    struct screenshot_image image;
+    FILE *file;
+
+    if (screenshot_grab(L, 3, 4, &image) != 0)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // Use automatic filename if no filename provided
+    if ((filename == NULL) || (strlen(filename) == 0))
+        filename = image.filename;
+
+    // Write image to file
+    file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        error_printf("Could not write screenshot file\n");
+        free(image.buffer);
+        lua_pushnil(L);
+        return 1;
+    }
+    fwrite(image.data, 1, image.size, file);
+    fclose(file);
+
+    // Return name of written file
+    lua_pushstring(L, filename);
+    free(image.buffer);
+    return 1;
+}
+
+static int64_t time_now_ns(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+    return (int64_t) time_spec.tv_sec * 1000000000 + time_spec.tv_nsec;
+}
+
+// Sleep until absolute monotonic time (no drift from time spent before call)
+static void sleep_until(int64_t deadline)
+{
+    struct timespec time_spec;
+
+    time_spec.tv_sec = deadline / 1000000000;
+    time_spec.tv_nsec = deadline % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time_spec, NULL) == EINTR);
+}
+
+static void stop_hook(lua_State *L, lua_Debug *ar)
+{
+    UNUSED(ar);
+
+    luaL_error(L, "Stopped by user");
+}
+
+void lua_stop(lua_State *L)
+{
+    struct stop_thread *node;
+
+    stop_requested = true;
+
+    // Hook fires at next instruction (safe to install from other thread)
+    lua_sethook(L, stop_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+
+    // Coroutines resumed by state do not have the hook of the state
+    pthread_mutex_lock(&stop_mutex);
+    for (node = stop_threads; node != NULL; node = node->next)
+        if (node->main == L)
+            lua_sethook(node->thread, stop_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+    pthread_mutex_unlock(&stop_mutex);
+}
+
+void lua_stop_reset(void)
+{
+    stop_requested = false;
+}
+
+static void stop_check(lua_State *L)
+{
+    if (stop_requested)
+        luaL_error(L, "Stopped by user");
+}
+
+void lua_stop_line_hook(lua_State *L, lua_Debug *ar)
+{
+    UNUSED(ar);
+
+    stop_check(L);
+}
+
+static void stop_thread_begin(lua_State *L, lua_State *thread, struct stop_thread *node)
+{
+    lua_pushlightuserdata(L, (void *) &stop_main_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    node->main = lua_touserdata(L, -1);
+    node->thread = thread;
+    lua_pop(L, 1);
+
+    if (stop_requested)
+        lua_sethook(thread, stop_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+
+    pthread_mutex_lock(&stop_mutex);
+    node->next = stop_threads;
+    stop_threads = node;
+    pthread_mutex_unlock(&stop_mutex);
+}
+
+static void stop_thread_end(struct stop_thread *node)
+{
+    struct stop_thread **link;
+
+    pthread_mutex_lock(&stop_mutex);
+    for (link = &stop_threads; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == node)
+        {
+            *link = node->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stop_mutex);
+}
+
+// Call function at upvalue 1 with all arguments while thread is resumed
+static int stop_thread_call(lua_State *L, lua_State *thread)
+{
+    struct stop_thread node;
+    int status;
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+
+    if (thread == NULL)
+    {
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+
+    stop_thread_begin(L, thread, &node);
+    status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    stop_thread_end(&node);
+    if (status != 0)
+        lua_error(L);
+
+    return lua_gettop(L);
+}
+
+// lua: ok, ... = coroutine.resume(co, ...)
+static int coroutine_resume(lua_State *L)
+{
+    return stop_thread_call(L, lua_tothread(L, 1));
+}
+
+// Function returned by coroutine.wrap()
+static int coroutine_wrapped(lua_State *L)
+{
+    return stop_thread_call(L, lua_tothread(L, lua_upvalueindex(2)));
+}
+
+// lua: f = coroutine.wrap(function)
+static int coroutine_wrap(lua_State *L)
+{
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, 1);
+
+    // Coroutine is upvalue of wrapping function
+    if ((lua_getupvalue(L, -1, 1) == NULL) || (lua_type(L, -1) != LUA_TTHREAD))
+    {
+        lua_settop(L, 1);
+        return 1;
+    }
+    lua_pushcclosure(L, coroutine_wrapped, 2);
+
+    return 1;
+}
+
+// Sleep until absolute monotonic time in slices so stop requests are served
+static void sleep_until_stoppable(lua_State *L, int64_t deadline)
+{
+    int64_t slice;
+
+    do
+    {
+        stop_check(L);
+        slice = time_now_ns() + STOP_CHECK_INTERVAL;
+        sleep_until(slice < deadline ? slice : deadline);
+    } while (slice < deadline);
+
+    stop_check(L);
+}
+
+// lua: sleep(seconds)
+static int sleep_(lua_State *L)
+{
+    long seconds = lua_tointeger(L, 1);
+
+    sleep_until_stoppable(L, time_now_ns() + (int64_t) seconds * 1000000000);
+
+    return 0;
+}
+
+// lua: msleep(miliseconds)
+static int msleep(lua_State *L)
+{
+    long mseconds = lua_tointeger(L, 1);
+
+    sleep_until_stoppable(L, time_now_ns() + (int64_t) mseconds * 1000000);
+
+    return 0;
+}
+
+// lua: statistics = every(period, function, count)
+static int every(lua_State *L)
+{
+    double period = luaL_checknumber(L, 1);
+    lua_Integer count = luaL_optinteger(L, 3, 0);
+    int64_t period_ns = period * 1000000;
+    int64_t start, deadline, now, late, skipped;
+    lua_Integer ticks = 0, overruns = 0, missed = 0;
+    double jitter, jitter_sum = 0, jitter_sum2 = 0, jitter_max = 0;
+    bool stop = false;
+
+    luaL_argcheck(L, period_ns > 0, 1, "period must be positive");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    start = time_now_ns();
+    deadline = start;
+
+    while (!stop && ((count <= 0) || (ticks < count)))
+    {
+        sleep_until_stoppable(L, deadline);
+
+        // Jitter is how late tick starts compared to its deadline
+        late = time_now_ns() - deadline;
+        jitter = late * 0.000000001;
+        jitter_sum += jitter;
+        jitter_sum2 += jitter * jitter;
+        if (jitter > jitter_max)
+            jitter_max = jitter;
+
+        // Call function(tick, time), returning false stops schedule
+        lua_pushvalue(L, 2);
+        lua_pushinteger(L, ticks + 1);
+        lua_pushnumber(L, (deadline - start) * 0.000000001);
+        lua_call(L, 2, 1);
+        stop = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        ticks++;
+
+        // Next deadline is on grid of start time. If tick ran past it, skip
+        // ticks that are already entirely missed and run next one late.
+        deadline += period_ns;
+        now = time_now_ns();
+        if (now > deadline)
+        {
+            overruns++;
+            skipped = (now - deadline) / period_ns;
+            missed += skipped;
+            deadline += skipped * period_ns;
+        }
+    }
+
+    // Return statistics
+    lua_newtable(L);
+    lua_pushinteger(L, ticks);
+    lua_setfield(L, -2, "ticks");
+    lua_pushinteger(L, overruns);
+    lua_setfield(L, -2, "overruns");
+    lua_pushinteger(L, missed);
+    lua_setfield(L, -2, "missed");
+    lua_pushnumber(L, ticks > 0 ? jitter_sum / ticks : 0);
+    lua_setfield(L, -2, "jitter_mean");
+    lua_pushnumber(L, jitter_max);
+    lua_setfield(L, -2, "jitter_max");
+    jitter = ticks > 0 ? jitter_sum2 / ticks - (jitter_sum / ticks) * (jitter_sum / ticks) : 0;
+    lua_pushnumber(L, jitter > 0 ? sqrt(jitter) : 0);
+    lua_setfield(L, -2, "jitter_std");
+    return 1;
+}
+
+// lua: late = schedule_at(time, function)
+static int schedule_at(lua_State *L)
+{
+    double time = luaL_checknumber(L, 1);
+    int64_t deadline = time * 1000000000;
+    int64_t late;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    sleep_until_stoppable(L, deadline);
+    late = time_now_ns() - deadline;
+
+    lua_pushvalue(L, 2);
+    lua_call(L, 0, 0);
+
+    // Return how late function was called in seconds
+    lua_pushnumber(L, late > 0 ? late * 0.000000001 : 0);
+    return 1;
+}
+
+// lua: time = clock_now()
+static int clock_now(lua_State *L)
+{
+    lua_pushnumber(L, time_now_ns() * 0.000000001);
+    return 1;
+}
+
+// lua: handle = clock_new()
+static int clock_new(lua_State *L)
+{
+    int handle;
+
+    // Find free clock (clocks are shared by spawned Lua states)
+    pthread_mutex_lock(&clock_mutex);
+    for (handle=0; handle<CLOCKS_MAX; handle++)
+    {
+        if (lua_clock[handle].allocated == false)
+        {
+            lua_clock[handle].allocated = true;
+            lua_clock[handle].time_start = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clock_mutex);
+
+    // Return clock handle
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+// lua: clock = clock_read()
+static int clock_read(lua_State *L)
+{
+    int handle = lua_tointeger(L, 1);
+    double time = time_now();
+
+    // If first read call
+    if (lua_clock[handle].time_start == 0)
+    {
+        // Save start time
+        lua_clock[handle].time_start = time;
+
+        // Return 0 time
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+
+    // Return elapsed time since clock start
+    time = time - lua_clock[handle].time_start;
+    lua_pushnumber(L, time);
+    return 1;
+}
+
+// lua: clock_reset()
+static int clock_reset(lua_State *L)
+{
+    int handle = lua_tointeger(L, 1);
+
+    lua_clock[handle].time_start = 0;
+
+    return 0;
+}
+
+// lua: clock_free()
+static int clock_free(lua_State *L)
+{
+    int handle = lua_tointeger(L, 1);
+
+    lua_clock[handle].allocated = false;
+    lua_clock[handle].time_start = 0;
+
+    return 0;
+}
+
+int lua_register_lxi(lua_State *L)
+{
+    lua_register(L, "connect", connect);
+    lua_register(L, "disconnect", disconnect);
+    lua_register(L, "scpi", scpi);
+    lua_register(L, "scpi_raw", scpi_raw);
+    lua_register(L, "scpi_values", scpi_values);
+    lua_register(L, "scpi_block", scpi_block);
+    lua_register(L, "scpi_batch", scpi_batch);
+    lua_register(L, "scpi_async", scpi_async);
+    lua_register(L, "await", await);
+    lua_register(L, "await_all", await_all);
+    lua_register(L, "async_run", async_run);
+    lua_register(L, "stats", stats);
+    lua_register(L, "screenshot", screenshot_);
+    lua_register(L, "screenshot_save", screenshot_save);
+    lua_register(L, "sleep", sleep_);
+    lua_register(L, "msleep", msleep);
+    lua_register(L, "clock_new", clock_new);
+    lua_register(L, "clock_read", clock_read);
+    lua_register(L, "clock_reset", clock_reset);
+    lua_register(L, "clock_free", clock_free);
+    lua_register(L, "clock_now", clock_now);
+    lua_register(L, "every", every);
+    lua_register(L, "schedule_at", schedule_at);
+
+    lua_register_array(L);
+    lua_register_logger(L);
+    lua_register_stream(L);
+    lua_register_spawn(L);
+
+    // Track resumed coroutines so lua_stop() can stop them too
+    lua_pushlightuserdata(L, (void *) &stop_main_key);
+    lua_pushlightuserdata(L, L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_getglobal(L, "coroutine");
+    if (lua_istable(L, -1))
+    {
+        lua_getfield(L, -1, "resume");
+        lua_pushcclosure(L, coroutine_resume, 1);
+        lua_setfield(L, -2, "resume");
+        lua_getfield(L, -1, "wrap");
+        lua_pushcclosure(L, coroutine_wrap, 1);
+        lua_setfield(L, -2, "wrap");
+    }
+    lua_pop(L, 1);
+
+    // Device returned by connect()
+    luaL_newmetatable(L, SESSION_METATABLE);
+    lua_pushcfunction(L, session_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, session_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
 
-    load_log_script(L);
+    // Future returned by scpi_async()
+    luaL_newmetatable(L, FUTURE_METATABLE);
+    lua_pushcfunction(L, future_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_newtable(L);
+    lua_pushcfunction(L, future_done_);
+    lua_setfield(L, -2, "done");
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
 
     return 0;
 }
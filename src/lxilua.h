@@ -34,4 +34,29 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#define SESSION_METATABLE "lxi.session"
+
+struct session_t;
+
 int lua_register_lxi(lua_State *L);
+
+// Request running Lua state to stop. Costs nothing until requested: a hook
+// is installed on demand and blocking functions (msleep(), every(), ...)
+// check for stop while waiting.
+void lua_stop(lua_State *L);
+
+// Clear stop request before running new script
+void lua_stop_reset(void);
+
+// Line hook checking for stop request on every line, the way scripts used to
+// be stopped (lxi run --line-hook, for benchmarking)
+void lua_stop_line_hook(lua_State *L, lua_Debug *ar);
+
+// Push device userdata for session (takes new reference)
+void session_push(lua_State *L, struct session_t *session);
+
+// Take reference to session of device at index (NULL if not a device)
+struct session_t *session_ref(lua_State *L, int index);
+
+// Drop reference to session (disconnects when last reference is dropped)
+void session_unref(struct session_t *session);
@@ -42,8 +42,11 @@
 #include "discover.h"
 #include "scpi.h"
 #include "screenshot.h"
+#include "transcode.h"
 #include "benchmark.h"
 #include "run.h"
+#include "testcase.h"
+#include "bytecode.h"
 #include <lxi.h>
 
 int main(int argc, char* argv[])
@@ -60,10 +63,21 @@ int main(int argc, char* argv[])
     switch (option.command)
     {
         case DISCOVER:
-            if (option.mdns)
-                status = discover(true, option.timeout);
+            if (discover_set_output(option.output) != 0)
+                status = EXIT_FAILURE;
+            else if (option.watch)
+                status = discover_watch(!option.mdns || option.all, option.mdns || option.all,
+                        option.scan_network, option.concurrency, option.timeout, option.watch_interval);
+            else if (option.inventory)
+                status = discover_inventory(option.timeout);
+            else if (strlen(option.scan_network) > 0)
+                status = discover_scan(option.scan_network, option.concurrency, option.timeout);
+            else if (option.all)
+                status = discover(true, true, option.timeout, option.expect);
+            else if (option.mdns)
+                status = discover(false, true, option.timeout, option.expect);
             else
-                status = discover(false, option.timeout);
+                status = discover(true, false, option.timeout, option.expect);
             break;
         case SCPI:
             if (option.interactive)
@@ -78,13 +92,31 @@ int main(int argc, char* argv[])
                 screenshot_list_plugins();
                 return EXIT_SUCCESS;
             }
-            status = screenshot(option.ip, option.plugin_name, option.screenshot_filename, option.timeout, true, NULL, NULL, NULL, NULL);
+            if ((strlen(option.image_format) > 0) && (transcode_start(option.image_format) != 0))
+                return EXIT_FAILURE;
+            screenshot_timing_enable(option.timing);
+            if (option.interval > 0)
+                status = screenshot_timelapse(option.ip, option.plugin_name, option.screenshot_filename, option.timeout, option.interval, option.duration);
+            else
+                status = screenshot(option.ip, option.plugin_name, option.screenshot_filename, option.timeout, true, NULL);
+            transcode_finish();
             break;
         case BENCHMARK:
             status = benchmark(option.ip, option.port, option.timeout, option.protocol, option.count, true, &result, NULL);
             break;
          case RUN:
-            status = run(option.lua_script_filename, option.timeout);
+            bytecode_cache_enable(!option.no_cache);
+            if (option.test)
+                status = run_test(option.lua_script_filename, option.lua_script_args, option.lua_script_arg_count,
+                                  option.jobs, option.report_filename, option.targets, option.concurrency);
+            else if (option.targets != NULL)
+                status = run_targets(option.lua_script_filename, option.lua_script_args, option.lua_script_arg_count,
+                                     option.targets, option.concurrency);
+            else if (option.parallel)
+                status = run_parallel(option.lua_script_filenames, option.lua_script_count, option.timeout);
+            else
+                status = run(option.lua_script_filename, option.lua_script_args, option.lua_script_arg_count,
+                             option.timeout, option.profile, option.line_hook);
             break;
    }
 
@@ -34,6 +34,10 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "misc.h"
 
 void hex_print(void *data, int length)
 {
@@ -84,3 +88,107 @@ int question(const char *string)
     return false;
 }
 
+
+uint64_t hash_fnv1a(const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    // 64-bit FNV-1a hash
+    for (i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+double time_now(void)
+{
+    struct timespec time_spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_spec);
+    return time_spec.tv_sec + time_spec.tv_nsec * 0.000000001;
+}
+
+double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    struct timespec now;
+
+    if (end == NULL)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        end = &now;
+    }
+
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+void json_print_string(FILE *file, const char *string)
+{
+    fputc('"', file);
+    for (; *string != 0; string++)
+    {
+        if ((*string == '"') || (*string == '\\'))
+            fprintf(file, "\\%c", *string);
+        else if ((unsigned char) *string < 0x20)
+            fprintf(file, "\\u%04x", *string);
+        else
+            fputc(*string, file);
+    }
+    fputc('"', file);
+}
+
+void csv_print_string(FILE *file, const char *string)
+{
+    if (string[strcspn(string, ",\"\r\n")] == 0)
+    {
+        fputs(string, file);
+        return;
+    }
+
+    fputc('"', file);
+    for (; *string != 0; string++)
+    {
+        if (*string == '"')
+            fputc('"', file);
+        fputc(*string, file);
+    }
+    fputc('"', file);
+}
+
+int cache_directory(char *directory, size_t size, bool create)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *p;
+    int length;
+
+    if ((cache != NULL) && (strlen(cache) > 0))
+        length = snprintf(directory, size, "%s/lxi-tools", cache);
+    else if (home != NULL)
+        length = snprintf(directory, size, "%s/.cache/lxi-tools", home);
+    else
+        return -1;
+    if ((length < 0) || ((size_t) length >= size))
+        return -1;
+
+    if (!create || (access(directory, W_OK) == 0))
+        return 0;
+
+    // Create missing parent directories too
+    for (p = directory + 1; *p != 0; p++)
+    {
+        if (*p != '/')
+            continue;
+        *p = 0;
+        mkdir(directory, 0755);
+        *p = '/';
+    }
+    if ((mkdir(directory, 0755) != 0) && (errno != EEXIST))
+        return -1;
+
+    return 0;
+}
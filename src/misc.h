@@ -30,8 +30,29 @@
 
 #pragma once
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
 void hex_print(void *data, int length);
 void strip_trailing_space(char *line);
 int question(const char *string);
+uint64_t hash_fnv1a(const void *data, size_t length);
+
+// Monotonic time in seconds
+double time_now(void);
+
+// Milliseconds from start to end (or to now if end is NULL)
+double elapsed_ms(const struct timespec *start, const struct timespec *end);
+
+// Print string quoted for JSON or CSV (RFC 4180, quoted only where needed)
+void json_print_string(FILE *file, const char *string);
+void csv_print_string(FILE *file, const char *string);
+
+// Get cache directory of lxi-tools ($XDG_CACHE_HOME/lxi-tools or
+// ~/.cache/lxi-tools) and optionally create it. Returns 0 on success.
+int cache_directory(char *directory, size_t size, bool create);
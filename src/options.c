@@ -47,6 +47,9 @@
 #define TIMEOUT_DISCOVER       1
 #define TIMEOUT_DISCOVER_MDNS  5
 
+#define SCAN_CONCURRENCY 512
+#define WATCH_INTERVAL 60
+
 #define PORT_VXI11 111
 #define PORT_RAW 5025
 
@@ -59,13 +62,27 @@ struct option_t option =
     .hex = false,              // Default no hexadecimal print
     .interactive = false,      // Default no interactive mode
     .lua_script_filename = "", // Default lua script filename
+    .jobs = 1,                 // Default run test cases in sequence
+    .report_filename = NULL,   // Default no test report
     .plugin_name = "",         // Default screenshot plugin name
     .list = false,             // Default no list
     .screenshot_filename = "", // Default screenshot filename
     .protocol = VXI11,         // Default protocol
     .port = 0,                 // Default port (set later)
     .mdns = false,             // Default no mDNS discover
+    .all = false,              // Default no combined discover
+    .inventory = false,        // Default no inventory check
+    .expect = 0,               // Default no expected number of devices
     .count = 100,              // Default number of requests in benchmark
+    .interval = 0,             // Default no screenshot interval
+    .duration = 0,             // Default no screenshot duration limit
+    .image_format = "",        // Default no screenshot image conversion
+    .timing = false,           // Default no screenshot timing
+    .scan_network = "",        // Default no network scan
+    .concurrency = SCAN_CONCURRENCY, // Default number of concurrent probes
+    .output = "text",          // Default human readable discover output
+    .watch = false,            // Default no discover watch mode
+    .watch_interval = WATCH_INTERVAL, // Default max seconds between watch cycles
 };
 
 void print_help(char *argv[])
@@ -80,11 +97,19 @@ void print_help(char *argv[])
     printf("  scpi [<options>] <scpi-command>      Send SCPI command\n");
     printf("  screenshot [<options>] [<filename>]  Capture screenshot\n");
     printf("  benchmark [<options>]                Benchmark\n");
-    printf("  run <filename>                       Run Lua script\n");
+    printf("  run [<options>] <filename>...        Run Lua script\n");
     printf("\n");
     printf("Discover options:\n");
     printf("  -t, --timeout <seconds>              Timeout (default: Normal: %d, mDNS: %d)\n", TIMEOUT_DISCOVER, TIMEOUT_DISCOVER_MDNS);
     printf("  -m, --mdns                           Search via mDNS/DNS-SD\n");
+    printf("  -A, --all                            Search via both VXI-11 and mDNS/DNS-SD\n");
+    printf("  -e, --expect <count>                 Stop when number of devices are found\n");
+    printf("  -i, --inventory                      Check devices known from previous searches\n");
+    printf("  -s, --scan <network>                 Scan network (e.g. 10.20.0.0/22)\n");
+    printf("  -c, --concurrency <count>            Number of concurrent scan probes (default: %d)\n", SCAN_CONCURRENCY);
+    printf("  -o, --output <format>                Output format (text, json, csv)\n");
+    printf("  -w, --watch                          Watch for instruments appearing, disappearing or changing\n");
+    printf("  -I, --interval <seconds>             Maximum interval between watch cycles (default: %d)\n", WATCH_INTERVAL);
     printf("\n");
     printf("Scpi options:\n");
     printf("  -a, --address <ip>                   Device IP address\n");
@@ -99,6 +124,10 @@ void print_help(char *argv[])
     printf("  -t, --timeout <seconds>              Timeout (default: %d)\n", TIMEOUT_SCREENSHOT);
     printf("  -p, --plugin <name>                  Use screenshot plugin by name\n");
     printf("  -l, --list                           List available screenshot plugins\n");
+    printf("  -i, --interval <ms>                  Capture screenshots at interval\n");
+    printf("  -d, --duration <seconds>             Duration of interval capture (default: unlimited)\n");
+    printf("  -f, --format <format>                Convert screenshot image to format (e.g. png)\n");
+    printf("  -T, --timing                         Print timing of screenshot phases\n");
     printf("\n");
     printf("Benchmark options:\n");
     printf("  -a, --address <ip>                   Device IP address\n");
@@ -107,6 +136,17 @@ void print_help(char *argv[])
     printf("  -c, --count <count>                  Number of requests (default: %d)\n", option.count);
     printf("  -r, --raw                            Use raw/TCP\n");
     printf("\n");
+    printf("Run options:\n");
+    printf("  -P, --parallel                       Run multiple scripts in parallel\n");
+    printf("  -p, --profile                        Profile script (writes <filename>.folded)\n");
+    printf("  -T, --test                           Run script as test cases\n");
+    printf("  -j, --jobs <count>                   Number of test cases to run concurrently (default: 1)\n");
+    printf("  -R, --report <file>                  Save test report (JUnit XML or .json)\n");
+    printf("  -x, --targets <list>                 Run script once per target (comma separated or @<file>)\n");
+    printf("  -c, --concurrency <count>            Number of targets to run concurrently (default: all)\n");
+    printf("  -n, --no-cache                       Do not use cached bytecode of scripts\n");
+    printf("  -L, --line-hook                      Check for stop requests on every line (benchmarking)\n");
+    printf("\n");
 }
 
 void print_version(void)
@@ -139,13 +179,21 @@ void parse_options(int argc, char *argv[])
         {
             {"timeout",        required_argument, 0, 't'},
             {"mdns",           no_argument,       0, 'm'},
+            {"all",            no_argument,       0, 'A'},
+            {"expect",         required_argument, 0, 'e'},
+            {"inventory",      no_argument,       0, 'i'},
+            {"scan",           required_argument, 0, 's'},
+            {"concurrency",    required_argument, 0, 'c'},
+            {"output",         required_argument, 0, 'o'},
+            {"watch",          no_argument,       0, 'w'},
+            {"interval",       required_argument, 0, 'I'},
             {0,                0,                 0,  0 }
         };
 
         static bool no_timeout_provided = true;
 
         /* Parse discover options */
-        c = getopt_long(argc, argv, "t:m", long_options, &option_index);
+        c = getopt_long(argc, argv, "t:mAe:is:c:o:wI:", long_options, &option_index);
 
         while (c != -1)
         {
@@ -158,16 +206,40 @@ void parse_options(int argc, char *argv[])
                 case 'm':
                     option.mdns = true;
                     break;
+                case 'A':
+                    option.all = true;
+                    break;
+                case 'e':
+                    option.expect = atoi(optarg);
+                    break;
+                case 'i':
+                    option.inventory = true;
+                    break;
+                case 's':
+                    option.scan_network = optarg;
+                    break;
+                case 'c':
+                    option.concurrency = atoi(optarg);
+                    break;
+                case 'o':
+                    option.output = optarg;
+                    break;
+                case 'w':
+                    option.watch = true;
+                    break;
+                case 'I':
+                    option.watch_interval = atoi(optarg);
+                    break;
                 case '?':
                     exit(EXIT_FAILURE);
             }
-            c = getopt_long(argc, argv, "t:m", long_options, &option_index);
+            c = getopt_long(argc, argv, "t:mAe:is:c:o:wI:", long_options, &option_index);
         }
 
         // Set discover timeout if none provided
         if (no_timeout_provided)
         {
-            if (option.mdns)
+            if (option.mdns || option.all)
                 option.timeout = TIMEOUT_DISCOVER_MDNS;
             else
                 option.timeout = TIMEOUT_DISCOVER;
@@ -236,13 +308,17 @@ void parse_options(int argc, char *argv[])
             {"timeout",        required_argument, 0, 't'},
             {"plugin",         required_argument, 0, 'p'},
             {"list",           no_argument,       0, 'l'},
+            {"interval",       required_argument, 0, 'i'},
+            {"duration",       required_argument, 0, 'd'},
+            {"format",         required_argument, 0, 'f'},
+            {"timing",         no_argument,       0, 'T'},
             {0,                0,                 0,  0 }
         };
 
         do
         {
             /* Parse screenshot options */
-            c = getopt_long(argc, argv, "a:t:p:l", long_options, &option_index);
+            c = getopt_long(argc, argv, "a:t:p:li:d:f:T", long_options, &option_index);
 
             switch (c)
             {
@@ -262,6 +338,22 @@ void parse_options(int argc, char *argv[])
                     option.list = true;
                     break;
 
+                case 'i':
+                    option.interval = atoi(optarg);
+                    break;
+
+                case 'd':
+                    option.duration = atoi(optarg);
+                    break;
+
+                case 'f':
+                    option.image_format = optarg;
+                    break;
+
+                case 'T':
+                    option.timing = true;
+                    break;
+
                 case '?':
                     exit(EXIT_FAILURE);
             }
@@ -315,16 +407,28 @@ void parse_options(int argc, char *argv[])
     {
         option.command = RUN;
 
+        // Default run all targets concurrently
+        option.concurrency = 0;
+
         static struct option long_options[] =
         {
             {"timeout",        required_argument, 0, 't'},
+            {"parallel",       no_argument,       0, 'P'},
+            {"profile",        no_argument,       0, 'p'},
+            {"test",           no_argument,       0, 'T'},
+            {"jobs",           required_argument, 0, 'j'},
+            {"report",         required_argument, 0, 'R'},
+            {"targets",        required_argument, 0, 'x'},
+            {"concurrency",    required_argument, 0, 'c'},
+            {"no-cache",       no_argument,       0, 'n'},
+            {"line-hook",      no_argument,       0, 'L'},
             {0,                0,                 0,  0 }
         };
 
         do
         {
             /* Parse run options */
-            c = getopt_long(argc, argv, "t:", long_options, &option_index);
+            c = getopt_long(argc, argv, "t:PpTj:R:x:c:nL", long_options, &option_index);
 
             switch (c)
             {
@@ -332,6 +436,43 @@ void parse_options(int argc, char *argv[])
                     option.timeout = atoi(optarg);
                     break;
 
+                case 'P':
+                    option.parallel = true;
+                    break;
+
+                case 'p':
+                    option.profile = true;
+                    break;
+
+                case 'T':
+                    option.test = true;
+                    break;
+
+                case 'j':
+                    option.jobs = atoi(optarg);
+                    break;
+
+                case 'R':
+                    option.report_filename = optarg;
+                    option.test = true;
+                    break;
+
+                case 'x':
+                    option.targets = optarg;
+                    break;
+
+                case 'c':
+                    option.concurrency = atoi(optarg);
+                    break;
+
+                case 'n':
+                    option.no_cache = true;
+                    break;
+
+                case 'L':
+                    option.line_hook = true;
+                    break;
+
                 case '?':
                     exit(EXIT_FAILURE);
             }
@@ -398,9 +539,47 @@ void parse_options(int argc, char *argv[])
         strncpy(option.screenshot_filename, argv[optind++], 999);
     }
 
+    if ((option.command == RUN) && option.parallel && option.profile)
+    {
+        error_printf("Profiling is not supported for parallel scripts\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((option.command == RUN) && option.test && (option.parallel || option.profile))
+    {
+        error_printf("Test cases can not be run in parallel scripts or profiled\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((option.command == RUN) && (option.targets != NULL) && (option.parallel || option.profile))
+    {
+        error_printf("Targets can not be combined with parallel scripts or profiling\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((option.command == RUN) && (option.jobs < 1))
+    {
+        error_printf("Invalid number of jobs\n");
+        exit(EXIT_FAILURE);
+    }
+
     if ((option.command == RUN) && (optind != argc))
     {
-        strncpy(option.lua_script_filename, argv[optind++], 999);
+        strncpy(option.lua_script_filename, argv[optind], 999);
+
+        // Consume all script filenames when running in parallel
+        option.lua_script_filenames = &argv[optind++];
+        option.lua_script_count = 1;
+        while (option.parallel && (optind < argc))
+        {
+            optind++;
+            option.lua_script_count++;
+        }
+
+        // Remaining arguments are passed to script
+        option.lua_script_args = &argv[optind];
+        option.lua_script_arg_count = argc - optind;
+        optind = argc;
     }
 
     /* Print any unknown arguments */
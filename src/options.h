@@ -44,13 +44,37 @@ struct option_t
     bool hex;
     bool interactive;
     char lua_script_filename[1000];
+    bool parallel;
+    bool profile;
+    bool test;
+    int jobs;
+    char *report_filename;
+    char **lua_script_filenames;
+    int lua_script_count;
+    char **lua_script_args;
+    int lua_script_arg_count;
+    char *targets;
+    bool no_cache;
+    bool line_hook;
     char *plugin_name;
     bool list;
     char screenshot_filename[1000];
     lxi_protocol_t protocol;
     int port;
     bool mdns;
+    bool all;
+    bool inventory;
+    int expect;
     int count;
+    int interval;
+    int duration;
+    char *image_format;
+    bool timing;
+    char *scan_network;
+    int concurrency;
+    char *output;
+    bool watch;
+    int watch_interval;
 };
 
 enum command_t
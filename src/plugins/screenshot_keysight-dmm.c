@@ -50,7 +50,7 @@ int keysight_dmm_screenshot(char *address, char *id, int timeout)
     UNUSED(id);
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = screenshot_connect(address, timeout);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -59,10 +59,10 @@ int keysight_dmm_screenshot(char *address, char *id, int timeout)
 
     // Send SCPI commands to grab image
     command = "HCOP:SDUM:DATA:FORM BMP";
-    lxi_send(device, command, strlen(command), timeout);
+    screenshot_send(device, command, strlen(command), timeout);
     command = "HCOP:SDUM:DATA?";
-    lxi_send(device, command, strlen(command), timeout);
-    length = lxi_receive(device, response, IMAGE_SIZE_MAX, timeout);
+    screenshot_send(device, command, strlen(command), timeout);
+    length = screenshot_receive(device, response, IMAGE_SIZE_MAX, timeout);
     if (length < 0)
     {
         error_printf("Failed to receive message\n");
@@ -79,14 +79,11 @@ int keysight_dmm_screenshot(char *address, char *id, int timeout)
     // Strip ending newline
     length--;
 
-    // Dump remaining image data to file
-    screenshot_file_dump(image, length, "bmp");
-
-    // Free allocated memory for screenshot
-    free(response);
+    // Dump remaining image data to file (hands over response buffer)
+    screenshot_file_dump(response, image, length, "bmp");
 
     // Disconnect
-    lxi_disconnect(device);
+    screenshot_disconnect(device);
 
     return 0;
 
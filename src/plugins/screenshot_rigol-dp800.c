@@ -50,7 +50,7 @@ int rigol_dp800_screenshot(char *address, char *id, int timeout)
     UNUSED(id);
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = screenshot_connect(address, timeout);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -59,8 +59,8 @@ int rigol_dp800_screenshot(char *address, char *id, int timeout)
 
     // Send SCPI command to grab BMP image
     command = ":SYSTem:PRINT? BMP";
-    lxi_send(device, command, strlen(command), timeout);
-    length = lxi_receive(device, response, IMAGE_SIZE_MAX, timeout);
+    screenshot_send(device, command, strlen(command), timeout);
+    length = screenshot_receive(device, response, IMAGE_SIZE_MAX, timeout);
     if (length < 0)
     {
         error_printf("Failed to receive message\n");
@@ -74,14 +74,11 @@ int rigol_dp800_screenshot(char *address, char *id, int timeout)
     image += n+2;
     length -= n+2;
 
-    // Dump remaining BMP image data to file
-    screenshot_file_dump(image, length, "bmp");
-
-    // Free allocated memory for screenshot
-    free(response);
+    // Dump remaining BMP image data to file (hands over response buffer)
+    screenshot_file_dump(response, image, length, "bmp");
     
     // Disconnect
-    lxi_disconnect(device);
+    screenshot_disconnect(device);
 
     return 0;
 
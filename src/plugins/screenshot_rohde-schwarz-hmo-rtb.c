@@ -57,7 +57,7 @@ int rs_hmo_rtb_screenshot(char *address, char *id, int timeout)
     }
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = screenshot_connect(address, timeout);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -66,10 +66,10 @@ int rs_hmo_rtb_screenshot(char *address, char *id, int timeout)
 
     // Send SCPI commands to grab image
     command = "HCOPy:FORMat PNG";
-    lxi_send(device, command, strlen(command), timeout);
+    screenshot_send(device, command, strlen(command), timeout);
     command = "HCOPy:DATA?";
-    lxi_send(device, command, strlen(command), timeout);
-    length = lxi_receive(device, response, IMAGE_SIZE_MAX, timeout);
+    screenshot_send(device, command, strlen(command), timeout);
+    length = screenshot_receive(device, response, IMAGE_SIZE_MAX, timeout);
     if (length < 0)
     {
         error_printf("Failed to receive message\n");
@@ -83,14 +83,11 @@ int rs_hmo_rtb_screenshot(char *address, char *id, int timeout)
     image += n+2;
     length -= n+2;
 
-    // Dump remaining image data to file
-    screenshot_file_dump(image, length, "png");
-
-    // Free allocated memory for screenshot
-    free(response);
+    // Dump remaining image data to file (hands over response buffer)
+    screenshot_file_dump(response, image, length, "png");
     
     // Disconnect
-    lxi_disconnect(device);
+    screenshot_disconnect(device);
 
     return 0;
 
@@ -61,7 +61,7 @@ int tektronix_screenshot_3000(char *address, char *id, int timeout)
     UNUSED(id);
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = screenshot_connect(address, timeout);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -70,55 +70,56 @@ int tektronix_screenshot_3000(char *address, char *id, int timeout)
 
     // Check the device
     command = "*IDN?";
-    lxi_send(device, command, strlen(command), timeout);	
-    length_check(lxi_receive(device, response, IMAGE_SIZE_MAX, timeout));
+    screenshot_send(device, command, strlen(command), timeout);	
+    length_check(screenshot_receive(device, response, IMAGE_SIZE_MAX, timeout));
     if (strstr(response,"TDS 3") != NULL)
     {
         // Send SCPI commands to grab current image parameters and config for grab image
         command = "hardcopy:Format?";
-        lxi_send(device, command, strlen(command), timeout);
-        length_check(lxi_receive(device, param.Format, IMAGE_SIZE_MAX, timeout));
+        screenshot_send(device, command, strlen(command), timeout);
+        length_check(screenshot_receive(device, param.Format, IMAGE_SIZE_MAX, timeout));
         command = "hardcopy:Format bmpc";
-        lxi_send(device, command, strlen(command), timeout);
+        screenshot_send(device, command, strlen(command), timeout);
 
         command = "hardcopy:compression?";
-        lxi_send(device, command, strlen(command), timeout);
-        length_check(lxi_receive(device, param.Compression, IMAGE_SIZE_MAX, timeout));
+        screenshot_send(device, command, strlen(command), timeout);
+        length_check(screenshot_receive(device, param.Compression, IMAGE_SIZE_MAX, timeout));
         command = "hardcopy:compression off";
-        lxi_send(device, command, strlen(command), timeout);
+        screenshot_send(device, command, strlen(command), timeout);
 
         command = "hardcopy:layout?";
-        lxi_send(device, command, strlen(command), timeout);
-        length_check(lxi_receive(device, param.Layout, IMAGE_SIZE_MAX, timeout));
+        screenshot_send(device, command, strlen(command), timeout);
+        length_check(screenshot_receive(device, param.Layout, IMAGE_SIZE_MAX, timeout));
         command = "hardcopy:layout Portrait";
-        lxi_send(device, command, strlen(command), timeout);
+        screenshot_send(device, command, strlen(command), timeout);
 
         command = "hardcopy:Port?";
-        lxi_send(device, command, strlen(command), timeout);
-        length_check(lxi_receive(device, param.Port, IMAGE_SIZE_MAX, timeout));
+        screenshot_send(device, command, strlen(command), timeout);
+        length_check(screenshot_receive(device, param.Port, IMAGE_SIZE_MAX, timeout));
         command = "hardcopy:Port gpib";
-        lxi_send(device, command, strlen(command), timeout);
+        screenshot_send(device, command, strlen(command), timeout);
 
         // Send SCPI commands to grab image
         command = "hardcopy start";
-        lxi_send(device, command, strlen(command), timeout);
-        length = lxi_receive(device, response, IMAGE_SIZE_MAX, timeout);
+        screenshot_send(device, command, strlen(command), timeout);
+        length = screenshot_receive(device, response, IMAGE_SIZE_MAX, timeout);
         length_check(length);
-        // Dump PNG image data to file
-        screenshot_file_dump(response, length, "bmp");
+        // Dump PNG image data to file (hands over response buffer)
+        screenshot_file_dump(response, response, length, "bmp");
+        response = NULL;
 
         // Restore old configuration
         sprintf(command_str,"hardcopy:Format %s", param.Format);
-        lxi_send(device, command_str, strlen(command_str), timeout);
+        screenshot_send(device, command_str, strlen(command_str), timeout);
 
         sprintf(command_str,"hardcopy:compression %s", param.Compression);
-        lxi_send(device, command_str, strlen(command_str), timeout);
+        screenshot_send(device, command_str, strlen(command_str), timeout);
 
         sprintf(command_str,"hardcopy:layout %s", param.Layout);
-        lxi_send(device, command_str, strlen(command_str), timeout);
+        screenshot_send(device, command_str, strlen(command_str), timeout);
 
         sprintf(command_str,"hardcopy:Port %s", param.Port);
-        lxi_send(device, command_str, strlen(command_str), timeout);
+        screenshot_send(device, command_str, strlen(command_str), timeout);
     }
     else
         printf("Device doesn't match\n");
@@ -127,7 +128,7 @@ int tektronix_screenshot_3000(char *address, char *id, int timeout)
     free(response);
     
     // Disconnect
-    lxi_disconnect(device);
+    screenshot_disconnect(device);
 
     return 0;
 
@@ -49,7 +49,7 @@ int tektronix_screenshot(char *address, char *id, int timeout)
     UNUSED(id);
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = screenshot_connect(address, timeout);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -58,26 +58,23 @@ int tektronix_screenshot(char *address, char *id, int timeout)
 
     // Send SCPI commands to grab PNG image
     command = "save:image:fileformat PNG";
-    lxi_send(device, command, strlen(command), timeout);
+    screenshot_send(device, command, strlen(command), timeout);
     command = "hardcopy:inksaver off";
-    lxi_send(device, command, strlen(command), timeout);
+    screenshot_send(device, command, strlen(command), timeout);
     command = "hardcopy start";
-    lxi_send(device, command, strlen(command), timeout);
-    length = lxi_receive(device, response, IMAGE_SIZE_MAX, timeout);
+    screenshot_send(device, command, strlen(command), timeout);
+    length = screenshot_receive(device, response, IMAGE_SIZE_MAX, timeout);
     if (length < 0)
     {
         error_printf("Failed to receive message\n");
         goto error_receive;
     }
 
-    // Dump PNG image data to file
-    screenshot_file_dump(response, length, "png");
-    
-    // Free allocated memory for screenshot
-    free(response);
+    // Dump PNG image data to file (hands over response buffer)
+    screenshot_file_dump(response, response, length, "png");
     
     // Disconnect
-    lxi_disconnect(device);
+    screenshot_disconnect(device);
 
     return 0;
 
@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "error.h"
+#include "misc.h"
+#include "profiler.h"
+#include <lua.h>
+#include <lauxlib.h>
+
+#define PROFILE_DEPTH_MAX 200
+#define PROFILE_LABEL_MAX 160
+#define PROFILE_THREADS_MAX 64
+
+// Functions which block waiting for instruments, timers or other threads
+static const char *wait_functions[] =
+{
+    "scpi", "scpi_raw", "scpi_values", "scpi_block", "scpi_batch", "await",
+    "await_all", "async_run", "connect", "disconnect", "screenshot",
+    "screenshot_save", "sleep", "msleep", "every", "schedule_at", "join",
+    "channel_send", "channel_receive", NULL
+};
+
+// Node of call tree (one per distinct call stack)
+struct profile_node
+{
+    char *label;
+    bool wait;
+    double self;            // Time spent in function itself
+    unsigned long calls;
+    struct profile_node *parent;
+    struct profile_node *child;
+    struct profile_node *sibling;
+};
+
+// Lua thread (main state or coroutine) and where its frames start in call tree
+struct profile_thread
+{
+    lua_State *L;
+    int base;
+};
+
+struct profiler
+{
+    struct profile_node root;
+    struct profile_node *current;
+    int depth;
+    int overflow;           // Calls deeper than maximum depth
+    struct profile_thread threads[PROFILE_THREADS_MAX];  // Chain of resumed threads
+    int thread_count;
+    double last;
+    double total;
+    lua_Hook hook;
+    int mask;
+    int count;
+};
+
+// Per thread as hooks only get Lua state passed
+static __thread struct profiler *profiler_current = NULL;
+
+// Summary of function over all call stacks
+struct profile_entry
+{
+    const char *label;
+    bool wait;
+    double self;
+    unsigned long calls;
+};
+
+static void profile_label(lua_State *L, lua_Debug *ar, char *label, bool *wait)
+{
+    const char *name;
+    int i;
+
+    *wait = false;
+
+    if (lua_getinfo(L, "nS", ar) == 0)
+    {
+        strcpy(label, "?");
+        return;
+    }
+    name = ar->name != NULL ? ar->name : "?";
+
+    if (strcmp(ar->what, "C") == 0)
+    {
+        for (i=0; wait_functions[i] != NULL; i++)
+            if (strcmp(name, wait_functions[i]) == 0)
+                *wait = true;
+        snprintf(label, PROFILE_LABEL_MAX, "%s", name);
+    }
+    else if (strcmp(ar->what, "main") == 0)
+        snprintf(label, PROFILE_LABEL_MAX, "main chunk (%s)", ar->short_src);
+    else
+        snprintf(label, PROFILE_LABEL_MAX, "%s (%s:%d)", name, ar->short_src, ar->linedefined);
+
+    // Semicolon separates frames in folded stacks
+    for (i=0; label[i] != 0; i++)
+        if (label[i] == ';')
+            label[i] = ':';
+}
+
+static void profile_push(struct profiler *profiler, lua_State *L, lua_Debug *ar, bool call)
+{
+    struct profile_node *node;
+    char label[PROFILE_LABEL_MAX];
+    bool wait;
+
+    if ((profiler->overflow > 0) || (profiler->depth >= PROFILE_DEPTH_MAX))
+    {
+        profiler->overflow++;
+        return;
+    }
+
+    profile_label(L, ar, label, &wait);
+
+    // Find or add call stack
+    for (node = profiler->current->child; node != NULL; node = node->sibling)
+        if (strcmp(node->label, label) == 0)
+            break;
+    if (node == NULL)
+    {
+        node = calloc(1, sizeof(struct profile_node));
+        if (node == NULL)
+        {
+            profiler->overflow++;
+            return;
+        }
+        node->label = strdup(label);
+        node->wait = wait;
+        node->parent = profiler->current;
+        node->sibling = profiler->current->child;
+        profiler->current->child = node;
+    }
+
+    if (call)
+        node->calls++;
+    profiler->current = node;
+    profiler->depth++;
+}
+
+static void profile_pop(struct profiler *profiler)
+{
+    if (profiler->overflow > 0)
+        profiler->overflow--;
+    else if (profiler->current != &profiler->root)
+    {
+        profiler->current = profiler->current->parent;
+        profiler->depth--;
+    }
+}
+
+// Number of frames on stack of L
+static int stack_depth(lua_State *L)
+{
+    lua_Debug ar;
+    int low = 1, high = 1, middle;
+
+    if (lua_getstack(L, 0, &ar) == 0)
+        return 0;
+
+    while (lua_getstack(L, high, &ar) != 0)
+    {
+        low = high;
+        high *= 2;
+    }
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        if (lua_getstack(L, middle, &ar) != 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return high;
+}
+
+// Returns position in call tree where frames of thread L start
+static int profile_thread_base(struct profiler *profiler, lua_State *L)
+{
+    int i;
+
+    // Back in thread which resumed coroutines, they yielded or finished
+    for (i=profiler->thread_count - 1; i>=0; i--)
+    {
+        if (profiler->threads[i].L == L)
+        {
+            profiler->thread_count = i + 1;
+            return profiler->threads[i].base;
+        }
+    }
+
+    // Coroutine resumed, its frames continue on top of resume call
+    if (profiler->thread_count == PROFILE_THREADS_MAX)
+        profiler->thread_count--;
+    i = profiler->thread_count++;
+    profiler->threads[i].L = L;
+    profiler->threads[i].base = profiler->depth + profiler->overflow;
+
+    return profiler->threads[i].base;
+}
+
+// Bring call tree position in line with real stack, excluding pending frames
+// on top. Errors caught by pcall() and coroutine switches leave frames
+// without return events, and resumed coroutines have frames without call
+// events.
+static void profile_sync(struct profiler *profiler, lua_State *L, int pending)
+{
+    int depth = profile_thread_base(profiler, L) + stack_depth(L);
+    int shadow = profiler->depth + profiler->overflow;
+    lua_Debug ar;
+
+    while (shadow > depth - pending)
+    {
+        profile_pop(profiler);
+        if (profiler->depth + profiler->overflow == shadow)
+            break;
+        shadow--;
+    }
+
+    for (; shadow < depth - pending; shadow++)
+    {
+        if (lua_getstack(L, depth - 1 - shadow, &ar) == 0)
+            break;
+        profile_push(profiler, L, &ar, false);
+    }
+}
+
+static void profiler_hook(lua_State *L, lua_Debug *ar)
+{
+    struct profiler *profiler = profiler_current;
+
+    if (profiler == NULL)
+        return;
+
+    // Charge time since last event to function on top of stack
+    profiler->current->self += time_now() - profiler->last;
+
+    switch (ar->event)
+    {
+        case LUA_HOOKCALL:
+#ifdef LUA_HOOKTAILCALL
+        case LUA_HOOKTAILCALL:
+#endif
+            // Tail call replaces frame of caller which is popped by sync
+            profile_sync(profiler, L, 1);
+            profile_push(profiler, L, ar, true);
+            break;
+        case LUA_HOOKRET:
+            profile_sync(profiler, L, 0);
+            profile_pop(profiler);
+            break;
+#ifdef LUA_HOOKTAILRET
+        case LUA_HOOKTAILRET:
+            // Frames of tail calls were already replaced
+            break;
+#endif
+        default:
+            if (profiler->hook != NULL)
+                profiler->hook(L, ar);
+            break;
+    }
+
+    // Do not charge hook overhead
+    profiler->last = time_now();
+}
+
+struct profiler *profiler_start(lua_State *L, lua_Hook hook, int mask, int count)
+{
+    struct profiler *profiler = calloc(1, sizeof(struct profiler));
+
+    if (profiler == NULL)
+        return NULL;
+
+    profiler->current = &profiler->root;
+    profiler->hook = hook;
+    profiler->mask = mask;
+    profiler->count = count;
+    profiler->last = time_now();
+    profiler->total = profiler->last;
+    profiler->threads[0].L = L;
+    profiler->threads[0].base = -stack_depth(L);
+    profiler->thread_count = 1;
+    profiler_current = profiler;
+
+    lua_sethook(L, profiler_hook, LUA_MASKCALL | LUA_MASKRET | (hook != NULL ? mask : 0), count);
+
+    return profiler;
+}
+
+void profiler_stop(lua_State *L, struct profiler *profiler)
+{
+    if (profiler_current == profiler)
+        profiler_current = NULL;
+
+    profiler->total = time_now() - profiler->total;
+
+    if (profiler->hook != NULL)
+        lua_sethook(L, profiler->hook, profiler->mask, profiler->count);
+    else
+        lua_sethook(L, NULL, 0, 0);
+}
+
+static void node_summarize(struct profile_node *node, struct profile_entry *entries, int *count)
+{
+    struct profile_node *child;
+    int i;
+
+    if (node->label != NULL)
+    {
+        for (i=0; i<*count; i++)
+            if (strcmp(entries[i].label, node->label) == 0)
+                break;
+        if (i == *count)
+        {
+            entries[i].label = node->label;
+            entries[i].wait = node->wait;
+            (*count)++;
+        }
+        entries[i].self += node->self;
+        entries[i].calls += node->calls;
+    }
+
+    for (child = node->child; child != NULL; child = child->sibling)
+        node_summarize(child, entries, count);
+}
+
+static int node_count(struct profile_node *node)
+{
+    struct profile_node *child;
+    int count = 1;
+
+    for (child = node->child; child != NULL; child = child->sibling)
+        count += node_count(child);
+
+    return count;
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+    const struct profile_entry *entry_a = a, *entry_b = b;
+
+    if (entry_a->self < entry_b->self)
+        return 1;
+    if (entry_a->self > entry_b->self)
+        return -1;
+    return 0;
+}
+
+char *profiler_report(struct profiler *profiler)
+{
+    struct profile_entry *entries;
+    double wait = 0, lua = 0;
+    char *text = NULL;
+    size_t size;
+    FILE *stream;
+    int count = 0, i;
+
+    entries = calloc(node_count(&profiler->root), sizeof(struct profile_entry));
+    if (entries == NULL)
+        return NULL;
+
+    node_summarize(&profiler->root, entries, &count);
+    qsort(entries, count, sizeof(struct profile_entry), entry_compare);
+
+    for (i=0; i<count; i++)
+    {
+        if (entries[i].wait)
+            wait += entries[i].self;
+        else
+            lua += entries[i].self;
+    }
+
+    stream = open_memstream(&text, &size);
+    if (stream == NULL)
+    {
+        free(entries);
+        return NULL;
+    }
+
+    fprintf(stream, "Profile (total %.3f s, Lua %.3f s, I/O wait %.3f s, profiler overhead %.3f s)\n\n",
+            profiler->total, lua, wait, profiler->total - lua - wait);
+    fprintf(stream, "  Self [s]  Self [%%]      Calls  Function\n");
+    for (i=0; i<count; i++)
+    {
+        fprintf(stream, "%10.3f %9.1f %10lu  %s%s\n", entries[i].self,
+                lua + wait > 0 ? 100 * entries[i].self / (lua + wait) : 0,
+                entries[i].calls, entries[i].label, entries[i].wait ? " [I/O wait]" : "");
+    }
+    fclose(stream);
+    free(entries);
+
+    return text;
+}
+
+static void node_save_folded(FILE *file, struct profile_node *node, char *stack, size_t length)
+{
+    struct profile_node *child;
+    size_t label_length;
+
+    if (node->label != NULL)
+    {
+        // Append frame to stack
+        label_length = strlen(node->label);
+        if (length > 0)
+            stack[length++] = ';';
+        memcpy(stack + length, node->label, label_length);
+        length += label_length;
+        stack[length] = 0;
+
+        // Self time in microseconds
+        if ((unsigned long) (node->self * 1000000) > 0)
+            fprintf(file, "%s %lu\n", stack, (unsigned long) (node->self * 1000000));
+    }
+
+    for (child = node->child; child != NULL; child = child->sibling)
+        node_save_folded(file, child, stack, length);
+}
+
+int profiler_save_folded(struct profiler *profiler, const char *filename)
+{
+    char *stack;
+    FILE *file;
+
+    file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        error_printf("Unable to open file %s\n", filename);
+        return 1;
+    }
+
+    stack = malloc((PROFILE_DEPTH_MAX + 1) * PROFILE_LABEL_MAX);
+    if (stack != NULL)
+        node_save_folded(file, &profiler->root, stack, 0);
+    free(stack);
+    fclose(file);
+
+    return stack == NULL;
+}
+
+static void node_free(struct profile_node *node)
+{
+    struct profile_node *child, *next;
+
+    for (child = node->child; child != NULL; child = next)
+    {
+        next = child->sibling;
+        node_free(child);
+        free(child->label);
+        free(child);
+    }
+}
+
+void profiler_free(struct profiler *profiler)
+{
+    if (profiler == NULL)
+        return;
+
+    node_free(&profiler->root);
+    free(profiler);
+}
@@ -34,18 +34,311 @@
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "options.h"
 #include "error.h"
 #include "lxilua.h"
+#include "spawn.h"
+#include "bytecode.h"
+#include "profiler.h"
 #include "misc.h"
 #include <lxi.h>
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
 
-int run(char *filename, int timeout)
+#define TARGET_KEY "lxi.target"
+
+struct run_targets_t
+{
+    char *filename;
+    char **args;
+    int arg_count;
+    char **targets;
+    int count;
+    int next;
+    int failed;
+    pthread_mutex_t mutex;
+};
+
+// Serializes output lines of scripts running against multiple targets
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void run_set_args(lua_State *L, char *filename, char **args, int count)
+{
+    int i;
+
+    // Script arguments are available via global table 'arg' with script
+    // name at index 0 as in the standalone lua interpreter
+    lua_createtable(L, count, 1);
+    lua_pushstring(L, filename);
+    lua_rawseti(L, -2, 0);
+    for (i=0; i<count; i++)
+    {
+        lua_pushstring(L, args[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setglobal(L, "arg");
+}
+
+// Print text with target prefix at start of each line
+static void target_print(const char *target, const char *text, size_t length)
+{
+    const char *end;
+    size_t line_length;
+
+    pthread_mutex_lock(&output_mutex);
+    do
+    {
+        end = memchr(text, '\n', length);
+        line_length = (end != NULL) ? (size_t) (end - text) : length;
+        printf("[%s] %.*s\n", target, (int) line_length, text);
+        line_length += (end != NULL);
+        text += line_length;
+        length -= line_length;
+    } while (length > 0);
+    fflush(stdout);
+    pthread_mutex_unlock(&output_mutex);
+}
+
+// lua: print(...) with output prefixed by target address
+static int target_print_lua(lua_State *L)
+{
+    int argc = lua_gettop(L);
+    const char *target;
+    const char *string;
+    luaL_Buffer buffer;
+    size_t length;
+    int i;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, TARGET_KEY);
+    target = lua_tostring(L, -1);
+
+    luaL_buffinit(L, &buffer);
+    for (i=1; i<=argc; i++)
+    {
+        lua_getglobal(L, "tostring");
+        lua_pushvalue(L, i);
+        lua_call(L, 1, 1);
+        string = lua_tolstring(L, -1, &length);
+        if (string == NULL)
+            return luaL_error(L, "'tostring' must return a string to 'print'");
+        if (i > 1)
+            luaL_addchar(&buffer, '\t');
+        luaL_addvalue(&buffer);
+    }
+    luaL_pushresult(&buffer);
+
+    string = lua_tolstring(L, -1, &length);
+    target_print(target, string, length);
+
+    return 0;
+}
+
+void run_target_setup(lua_State *L, char *target)
+{
+    // Script addresses its instrument via global 'target'
+    lua_pushstring(L, target);
+    lua_setglobal(L, "target");
+    lua_pushstring(L, target);
+    lua_setfield(L, LUA_REGISTRYINDEX, TARGET_KEY);
+    lua_register(L, "print", target_print_lua);
+}
+
+static bool run_target(struct run_targets_t *run_targets, char *target)
 {
     lua_State *L;
+    bool ok;
+
+    L = luaL_newstate();
+    if (L == NULL)
+    {
+        error_printf("[%s] Failed to create Lua state\n", target);
+        return false;
+    }
+    luaL_openlibs(L);
+    lua_register_lxi(L);
+
+    run_target_setup(L, target);
+    run_set_args(L, run_targets->filename, run_targets->args, run_targets->arg_count);
+
+    ok = (bytecode_loadfile(L, run_targets->filename) == 0) && (lua_pcall(L, 0, 0, 0) == 0);
+    if (!ok)
+    {
+        pthread_mutex_lock(&output_mutex);
+        error_printf("[%s] %s\n", target, lua_tostring(L, -1));
+        pthread_mutex_unlock(&output_mutex);
+    }
+
+    lua_close(L);
+
+    return ok;
+}
+
+static void *run_targets_worker(void *data)
+{
+    struct run_targets_t *run_targets = data;
+    int index;
+
+    while (true)
+    {
+        pthread_mutex_lock(&run_targets->mutex);
+        index = run_targets->next++;
+        pthread_mutex_unlock(&run_targets->mutex);
+
+        if (index >= run_targets->count)
+            break;
+
+        if (!run_target(run_targets, run_targets->targets[index]))
+        {
+            pthread_mutex_lock(&run_targets->mutex);
+            run_targets->failed++;
+            pthread_mutex_unlock(&run_targets->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+int targets_parse(char *list, char ***targets)
+{
+    char *text = NULL, *target, *save = NULL;
+    const char *separators = ",";
+    char line[1000];
+    char **array;
+    FILE *file;
+    size_t size = 0;
+    int count = 0;
+
+    *targets = NULL;
+
+    if (list[0] == '@')
+    {
+        file = fopen(list + 1, "r");
+        if (file == NULL)
+        {
+            error_printf("Unable to open file %s\n", list + 1);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            // Skip comments, keeping line break between targets
+            line[strcspn(line, "#\n")] = 0;
+            text = realloc(text, size + strlen(line) + 2);
+            if (text == NULL)
+                break;
+            strcpy(text + size, line);
+            size += strlen(line);
+            text[size++] = '\n';
+            text[size] = 0;
+        }
+        fclose(file);
+        separators = " \t\r\n,";
+    }
+    else
+        text = strdup(list);
+
+    if (text == NULL)
+        return -1;
+
+    for (target = strtok_r(text, separators, &save); target != NULL; target = strtok_r(NULL, separators, &save))
+    {
+        if (strlen(target) == 0)
+            continue;
+        array = realloc(*targets, (count + 1) * sizeof(char *));
+        if (array == NULL)
+            break;
+        *targets = array;
+        (*targets)[count++] = strdup(target);
+    }
+    free(text);
+
+    return count;
+}
+
+void targets_free(char **targets, int count)
+{
+    int i;
+
+    for (i=0; i<count; i++)
+        free(targets[i]);
+    free(targets);
+}
+
+int run_targets(char *filename, char **args, int arg_count, char *targets, int concurrency)
+{
+    struct run_targets_t run_targets;
+    pthread_t *threads;
+    int i;
+
+    if (strlen(filename) == 0)
+    {
+        error_printf("Missing filename\n");
+        return 1;
+    }
+
+    memset(&run_targets, 0, sizeof(struct run_targets_t));
+    run_targets.filename = filename;
+    run_targets.args = args;
+    run_targets.arg_count = arg_count;
+    run_targets.count = targets_parse(targets, &run_targets.targets);
+    if (run_targets.count <= 0)
+    {
+        error_printf("No targets specified\n");
+        free(run_targets.targets);
+        return 1;
+    }
+    pthread_mutex_init(&run_targets.mutex, NULL);
+
+    // Run script once per target with at most concurrency targets at a time
+    if ((concurrency <= 0) || (concurrency > run_targets.count))
+        concurrency = run_targets.count;
+    threads = malloc(concurrency * sizeof(pthread_t));
+    for (i=0; (threads != NULL) && (i<concurrency); i++)
+        if (pthread_create(&threads[i], NULL, run_targets_worker, &run_targets) != 0)
+            break;
+    if ((threads == NULL) || (i == 0))
+        run_targets_worker(&run_targets);
+    while (i-- > 0)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    // Wait for Lua states spawned by scripts
+    run_targets.failed += spawn_wait();
+
+    if (run_targets.failed > 0)
+        error_printf("%d of %d targets failed\n", run_targets.failed, run_targets.count);
+
+    targets_free(run_targets.targets, run_targets.count);
+    pthread_mutex_destroy(&run_targets.mutex);
+
+    return run_targets.failed > 0;
+}
+
+static void run_profile_report(struct profiler *profiler, const char *filename)
+{
+    char *report = profiler_report(profiler);
+    char *folded;
+
+    if (report != NULL)
+        printf("\n%s", report);
+    free(report);
+
+    // Save stacks for flame graph next to script
+    folded = malloc(strlen(filename) + strlen(".folded") + 1);
+    if (folded == NULL)
+        return;
+    sprintf(folded, "%s.folded", filename);
+    if (profiler_save_folded(profiler, folded) == 0)
+        printf("\nSaved folded stacks to %s\n", folded);
+    free(folded);
+}
+
+int run(char *filename, char **args, int arg_count, int timeout, bool profile, bool line_hook)
+{
+    struct profiler *profiler = NULL;
+    lua_State *L;
+    int error;
 
     UNUSED(timeout);
 
@@ -61,14 +354,57 @@ int run(char *filename, int timeout)
     // Add lxi functions
     lua_register_lxi(L);
 
-    if (luaL_dofile(L, filename))
+    run_set_args(L, filename, args, arg_count);
+
+    error = bytecode_loadfile(L, filename);
+    if (!error)
+    {
+        if (line_hook)
+            lua_sethook(L, lua_stop_line_hook, LUA_MASKLINE, 0);
+        if (profile)
+            profiler = profiler_start(L, line_hook ? lua_stop_line_hook : NULL, LUA_MASKLINE, 0);
+
+        error = lua_pcall(L, 0, LUA_MULTRET, 0);
+
+        if (profiler != NULL)
+            profiler_stop(L, profiler);
+    }
+    if (error)
     {
         error_printf("%s\n", lua_tostring(L, -1));
-        lua_close(L);
-        return 0;
+
+        // Spawned states may wait for values from failed script
+        spawn_stop();
+    }
+
+    // Wait for Lua states spawned by script
+    spawn_wait();
+
+    if (profiler != NULL)
+    {
+        run_profile_report(profiler, filename);
+        profiler_free(profiler);
     }
 
     lua_close(L);
 
     return 0;
 }
+
+int run_parallel(char **filenames, int count, int timeout)
+{
+    int i, failed;
+
+    UNUSED(timeout);
+
+    // Run each script in its own Lua state on separate thread
+    for (i=0; i<count; i++)
+    {
+        if (spawn_file(filenames[i]) < 0)
+            break;
+    }
+
+    failed = spawn_wait();
+
+    return (failed > 0) || (i < count);
+}
@@ -43,8 +43,25 @@ extern "C" {
 #include "options.h"
 #include "error.h"
 #include <lxi.h>
+#include <lua.h>
 
-int run(char *filename, int timeout);
+// Set global 'arg' table of script arguments
+void run_set_args(lua_State *L, char *filename, char **args, int count);
+
+// Parse comma separated list of targets or '@<file>' with one target per line.
+// Returns number of targets.
+int targets_parse(char *list, char ***targets);
+void targets_free(char **targets, int count);
+
+// Set global 'target' and prefix output of print() by target
+void run_target_setup(lua_State *L, char *target);
+
+int run(char *filename, char **args, int arg_count, int timeout, bool profile, bool line_hook);
+int run_parallel(char **filenames, int count, int timeout);
+
+// Run script once per target (comma separated list or '@<file>') with global
+// 'target' set to address of target and output prefixed by target
+int run_targets(char *filename, char **args, int arg_count, char *targets, int concurrency);
 
 #ifdef __cplusplus
 }
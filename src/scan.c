@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <lxi.h>
+#include "scan.h"
+#include "error.h"
+#include "misc.h"
+
+#define PORT_RAW 5025
+#define PORT_PORTMAPPER 111
+#define PREFIX_LENGTH_MIN 16
+#define IDN_THREADS_MAX 32
+#define ID_LENGTH_MAX 1024
+#define FILES_RESERVED 64
+
+// ONC RPC portmapper GETPORT query for VXI-11 core channel over TCP
+#define PORTMAPPER_PROGRAM 100000
+#define PORTMAPPER_VERSION 2
+#define PORTMAPPER_GETPORT 3
+#define VXI11_CORE_PROGRAM 395183
+#define VXI11_CORE_VERSION 1
+#define IPPROTO_TCP_ 6
+
+enum probe_state
+{
+    PROBE_FREE,
+    PROBE_CONNECTING,
+    PROBE_RECEIVING,
+};
+
+struct probe
+{
+    enum probe_state state;
+    int fd;
+    int host;
+    int port;
+    struct timespec deadline;
+    unsigned char buffer[64];
+    int length;
+};
+
+struct host
+{
+    uint32_t address;
+    bool raw;
+    int vxi11_port;
+};
+
+static struct host *hosts;
+static int host_count;
+static int idn_next;
+static int idn_timeout;
+static lxi_info_t *scan_info;
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread double idn_latency;
+static __thread int idn_vxi11_port;
+
+static int parse_network(const char *network, uint32_t *first, uint32_t *last)
+{
+    char address[INET_ADDRSTRLEN];
+    struct in_addr in;
+    const char *slash;
+    uint32_t mask;
+    int prefix = 32;
+
+    // Split address and prefix length
+    slash = strchr(network, '/');
+    if (slash != NULL)
+    {
+        if ((slash - network) >= (int) sizeof(address))
+            return -1;
+        memcpy(address, network, slash - network);
+        address[slash - network] = 0;
+        prefix = atoi(slash + 1);
+    }
+    else
+    {
+        if (strlen(network) >= sizeof(address))
+            return -1;
+        strcpy(address, network);
+    }
+
+    if (inet_pton(AF_INET, address, &in) != 1)
+        return -1;
+
+    if ((prefix < PREFIX_LENGTH_MIN) || (prefix > 32))
+    {
+        error_printf("Invalid network prefix length (must be /%d to /32)\n", PREFIX_LENGTH_MIN);
+        return -1;
+    }
+
+    mask = (prefix == 32) ? 0xffffffff : ~(0xffffffff >> prefix);
+    *first = ntohl(in.s_addr) & mask;
+    *last = *first | ~mask;
+
+    // Skip network and broadcast address
+    if (prefix <= 30)
+    {
+        (*first)++;
+        (*last)--;
+    }
+
+    return 0;
+}
+
+// Make sure enough file descriptors are available for concurrent probes
+static int concurrency_limit(int concurrency)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return concurrency;
+
+    if (limit.rlim_cur < (rlim_t) (concurrency + FILES_RESERVED))
+    {
+        limit.rlim_cur = concurrency + FILES_RESERVED;
+        if (limit.rlim_cur > limit.rlim_max)
+            limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (limit.rlim_cur < (rlim_t) (concurrency + FILES_RESERVED))
+        return limit.rlim_cur - FILES_RESERVED;
+
+    return concurrency;
+}
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int timespec_diff_ms(struct timespec *a, struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000L;
+}
+
+static void put_uint32(unsigned char *buffer, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(buffer, &value, 4);
+}
+
+static uint32_t get_uint32(unsigned char *buffer)
+{
+    uint32_t value;
+
+    memcpy(&value, buffer, 4);
+    return ntohl(value);
+}
+
+static int portmapper_getport_send(int fd, uint32_t xid)
+{
+    unsigned char request[60];
+    uint32_t words[] =
+    {
+        0x80000000 | 56,        // Record mark (last fragment, length)
+        xid,                    // Transaction ID
+        0,                      // Call
+        2,                      // RPC version
+        PORTMAPPER_PROGRAM,
+        PORTMAPPER_VERSION,
+        PORTMAPPER_GETPORT,
+        0, 0,                   // Credentials (none)
+        0, 0,                   // Verifier (none)
+        VXI11_CORE_PROGRAM,
+        VXI11_CORE_VERSION,
+        IPPROTO_TCP_,
+        0
+    };
+    unsigned int i;
+
+    for (i=0; i<sizeof(words)/sizeof(words[0]); i++)
+        put_uint32(&request[i*4], words[i]);
+
+    if (send(fd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request))
+        return -1;
+
+    return 0;
+}
+
+// Returns VXI-11 core port, 0 if not registered, or -1 if reply is incomplete
+static int portmapper_getport_parse(unsigned char *buffer, int length)
+{
+    uint32_t record_length, verifier_length;
+    int offset;
+
+    if (length < 4)
+        return -1;
+
+    record_length = get_uint32(buffer) & 0x7fffffff;
+    if (length < (int) (4 + record_length))
+        return -1;
+
+    // Reply header: xid, reply, accepted, verifier
+    if ((record_length < 24) || (get_uint32(&buffer[8]) != 1) || (get_uint32(&buffer[12]) != 0))
+        return 0;
+    verifier_length = (get_uint32(&buffer[20]) + 3) & ~3;
+    offset = 24 + verifier_length;
+
+    // Accept status and port
+    if ((offset + 8 > length) || (get_uint32(&buffer[offset]) != 0))
+        return 0;
+
+    return get_uint32(&buffer[offset + 4]);
+}
+
+static void probe_close(struct probe *probe)
+{
+    close(probe->fd);
+    probe->state = PROBE_FREE;
+}
+
+static int probe_start(struct probe *probe, int host, int port, int timeout)
+{
+    struct sockaddr_in address;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(hosts[host].address);
+
+    probe->fd = fd;
+    probe->host = host;
+    probe->port = port;
+    probe->length = 0;
+    probe->state = PROBE_CONNECTING;
+    clock_gettime(CLOCK_MONOTONIC, &probe->deadline);
+    timespec_add_ms(&probe->deadline, timeout);
+
+    if ((connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) && (errno != EINPROGRESS))
+    {
+        // Host or network unreachable etc.
+        probe_close(probe);
+    }
+
+    return 0;
+}
+
+static void probe_connected(struct probe *probe)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if ((getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) || (error != 0))
+    {
+        // Connection refused or failed
+        probe_close(probe);
+        return;
+    }
+
+    if (probe->port == PORT_RAW)
+    {
+        hosts[probe->host].raw = true;
+        probe_close(probe);
+        return;
+    }
+
+    // Ask portmapper for VXI-11 core channel port
+    if (portmapper_getport_send(probe->fd, probe->host) != 0)
+    {
+        probe_close(probe);
+        return;
+    }
+    probe->state = PROBE_RECEIVING;
+}
+
+static void probe_receive(struct probe *probe)
+{
+    int length, port;
+
+    length = recv(probe->fd, probe->buffer + probe->length, sizeof(probe->buffer) - probe->length, 0);
+    if (length <= 0)
+    {
+        probe_close(probe);
+        return;
+    }
+    probe->length += length;
+
+    port = portmapper_getport_parse(probe->buffer, probe->length);
+    if ((port < 0) && (probe->length < (int) sizeof(probe->buffer)))
+        return; // Wait for remaining reply
+
+    if (port > 0)
+        hosts[probe->host].vxi11_port = port;
+    probe_close(probe);
+}
+
+// Probe all hosts with a window of concurrent non-blocking connects
+static void probe_hosts(int concurrency, int timeout)
+{
+    struct probe *probes = calloc(concurrency, sizeof(struct probe));
+    struct pollfd *fds = calloc(concurrency, sizeof(struct pollfd));
+    int ports[] = { PORT_RAW, PORT_PORTMAPPER };
+    int jobs = host_count * 2, job = 0, active, wait, i;
+    bool out_of_sockets;
+    struct timespec now;
+
+    do
+    {
+        // Fill window with new probes
+        out_of_sockets = false;
+        for (i=0; (i<concurrency) && (job<jobs); i++)
+        {
+            if (probes[i].state != PROBE_FREE)
+                continue;
+            if (probe_start(&probes[i], job / 2, ports[job % 2], timeout) != 0)
+            {
+                // Out of sockets, retry when some are released
+                out_of_sockets = true;
+                break;
+            }
+            job++;
+        }
+
+        // Wait for probe events
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        active = 0;
+        wait = timeout;
+        for (i=0; i<concurrency; i++)
+        {
+            fds[i].fd = -1;
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            if (probes[i].state == PROBE_FREE)
+                continue;
+            fds[i].fd = probes[i].fd;
+            fds[i].events = (probes[i].state == PROBE_CONNECTING) ? POLLOUT : POLLIN;
+            if (timespec_diff_ms(&probes[i].deadline, &now) < wait)
+                wait = timespec_diff_ms(&probes[i].deadline, &now);
+            active++;
+        }
+        if (active == 0)
+        {
+            if (out_of_sockets)
+            {
+                error_printf("Failed to create socket (%s)\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        poll(fds, concurrency, wait > 0 ? wait : 0);
+
+        // Handle probe events and timeouts
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i=0; i<concurrency; i++)
+        {
+            if (probes[i].state == PROBE_FREE)
+                continue;
+
+            if (fds[i].revents != 0)
+            {
+                if (probes[i].state == PROBE_CONNECTING)
+                    probe_connected(&probes[i]);
+                else
+                    probe_receive(&probes[i]);
+            }
+            else if (timespec_diff_ms(&probes[i].deadline, &now) <= 0)
+                probe_close(&probes[i]);
+        }
+    } while ((job < jobs) || (active > 0));
+
+    free(probes);
+    free(fds);
+}
+
+static int get_id(struct host *host, char *address, char *id)
+{
+    struct timespec start, end;
+    int device, length;
+    char *command;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Prefer VXI-11, fall back to raw/TCP
+    if (host->vxi11_port > 0)
+    {
+        device = lxi_connect(address, 0, NULL, idn_timeout, VXI11);
+        command = "*IDN?";
+    }
+    else
+    {
+        device = lxi_connect(address, PORT_RAW, NULL, idn_timeout, RAW);
+        command = "*IDN?\n";
+    }
+    if (device == LXI_ERROR)
+        return -1;
+
+    if (lxi_send(device, command, strlen(command), idn_timeout) < 0)
+        goto error;
+
+    length = lxi_receive(device, id, ID_LENGTH_MAX - 1, idn_timeout);
+    if (length <= 0)
+        goto error;
+    id[length] = 0;
+    strip_trailing_space(id);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    idn_latency = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+    lxi_disconnect(device);
+    return 0;
+
+error:
+    lxi_disconnect(device);
+    return -1;
+}
+
+static void *idn_worker_thread(void *data)
+{
+    char address[INET_ADDRSTRLEN];
+    char id[ID_LENGTH_MAX];
+    struct in_addr in;
+    int i;
+
+    UNUSED(data);
+
+    while (true)
+    {
+        // Take next responding host
+        pthread_mutex_lock(&scan_mutex);
+        while ((idn_next < host_count) && !hosts[idn_next].raw && (hosts[idn_next].vxi11_port == 0))
+            idn_next++;
+        i = idn_next++;
+        pthread_mutex_unlock(&scan_mutex);
+
+        if (i >= host_count)
+            break;
+
+        in.s_addr = htonl(hosts[i].address);
+        inet_ntop(AF_INET, &in, address, sizeof(address));
+
+        if (get_id(&hosts[i], address, id) != 0)
+            continue;
+
+        // Report instrument (raw/TCP only instruments as SCPI raw service)
+        idn_vxi11_port = hosts[i].vxi11_port;
+        pthread_mutex_lock(&scan_mutex);
+        if ((hosts[i].vxi11_port > 0) && (scan_info->device != NULL))
+            scan_info->device(address, id);
+        else if ((hosts[i].vxi11_port == 0) && (scan_info->service != NULL))
+            scan_info->service(address, id, "scpi-raw", PORT_RAW);
+        fflush(stdout);
+        pthread_mutex_unlock(&scan_mutex);
+    }
+
+    return NULL;
+}
+
+double scan_latency(void)
+{
+    return idn_latency;
+}
+
+int scan_vxi11_port(void)
+{
+    return idn_vxi11_port;
+}
+
+int scan(const char *network, int concurrency, int timeout, lxi_info_t *info)
+{
+    pthread_t threads[IDN_THREADS_MAX];
+    int thread_count = 0, responding = 0;
+    uint32_t first, last, address;
+    int i;
+
+    if (parse_network(network, &first, &last) != 0)
+    {
+        error_printf("Invalid network (%s)\n", network);
+        return 1;
+    }
+
+    if (concurrency < 1)
+    {
+        error_printf("Invalid concurrency\n");
+        return 1;
+    }
+
+    concurrency = concurrency_limit(concurrency);
+
+    host_count = last - first + 1;
+    hosts = calloc(host_count, sizeof(struct host));
+    if (hosts == NULL)
+        return 1;
+    for (i=0, address=first; i<host_count; i++, address++)
+        hosts[i].address = address;
+
+    // Find hosts responding on instrument ports
+    probe_hosts(concurrency, timeout);
+
+    for (i=0; i<host_count; i++)
+        if (hosts[i].raw || (hosts[i].vxi11_port > 0))
+            responding++;
+
+    // Identify responding hosts in parallel
+    scan_info = info;
+    idn_timeout = timeout;
+    idn_next = 0;
+    thread_count = responding;
+    if (thread_count > concurrency)
+        thread_count = concurrency;
+    if (thread_count > IDN_THREADS_MAX)
+        thread_count = IDN_THREADS_MAX;
+    for (i=0; i<thread_count; i++)
+    {
+        if (pthread_create(&threads[i], NULL, idn_worker_thread, NULL) != 0)
+            break;
+    }
+    thread_count = i;
+    if ((thread_count == 0) && (responding > 0))
+        idn_worker_thread(NULL);
+    for (i=0; i<thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    free(hosts);
+    hosts = NULL;
+
+    return 0;
+}
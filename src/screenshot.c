@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -39,8 +40,12 @@
 #include <unistd.h>
 #include <time.h>
 #include <regex.h>
+#include <signal.h>
+#include <pthread.h>
 #include "screenshot.h"
 #include "error.h"
+#include "misc.h"
+#include "transcode.h"
 #include <lxi.h>
 
 #define PLUGIN_LIST_SIZE_MAX 50
@@ -68,10 +73,119 @@ static struct screenshot_plugin *plugin_list[PLUGIN_LIST_SIZE_MAX] = { };
 static char *screenshot_filename = NULL;
 static char *screenshot_address = NULL;
 static bool screenshot_no_gui;
-static void *screenshot_image_buffer;
-static int *screenshot_image_size;
-static char *screenshot_image_format;
-static char *screenshot_image_filename;
+static struct screenshot_image *screenshot_image;
+static char screenshot_id[ID_LENGTH_MAX];
+static bool screenshot_keep_link = false;
+static int screenshot_link = LXI_ERROR;
+static int screenshot_frame = -1;
+static char screenshot_frame_prefix[1000];
+static uint64_t screenshot_frame_hash;
+static int screenshot_saved_count = 0;
+static int screenshot_duplicate_count = 0;
+static int screenshot_failed_count = 0;
+static volatile sig_atomic_t screenshot_stop = false;
+static pthread_mutex_t screenshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool screenshot_timing_enabled = false;
+static struct screenshot_timing screenshot_timing;
+static struct timespec screenshot_response_end;
+
+void screenshot_timing_enable(bool enable)
+{
+    screenshot_timing_enabled = enable;
+}
+
+static void screenshot_timing_reset(struct timespec *start)
+{
+    memset(&screenshot_timing, 0, sizeof(screenshot_timing));
+    memset(&screenshot_response_end, 0, sizeof(screenshot_response_end));
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static void screenshot_timing_print(void)
+{
+    struct screenshot_timing *t = &screenshot_timing;
+    double throughput = 0;
+    FILE *out = stdout;
+
+    // Do not mix timing information into image data written to stdout
+    if (strcmp(screenshot_filename, "-") == 0)
+        out = stderr;
+
+    if (t->response > 0)
+        throughput = t->bytes / (t->response * 1000.0); // MB/s
+
+    fprintf(out, "Timing: identify %.1f ms, connect %.1f ms, command %.1f ms, "
+            "response %.1f ms (%d bytes, %.2f MB/s), process %.1f ms, write %.1f ms, total %.1f ms\n",
+            t->identify, t->connect, t->command, t->response, t->bytes, throughput,
+            t->process, t->write, t->total);
+}
+
+int screenshot_connect(char *address, int timeout)
+{
+    struct timespec start;
+    int device;
+
+    // Reuse link if kept open between screenshots
+    if (screenshot_keep_link && (screenshot_link != LXI_ERROR))
+        return screenshot_link;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    screenshot_timing.connect += elapsed_ms(&start, NULL);
+
+    if (screenshot_keep_link)
+        screenshot_link = device;
+
+    return device;
+}
+
+void screenshot_disconnect(int device)
+{
+    // Leave link open for next screenshot
+    if (screenshot_keep_link && (device == screenshot_link))
+        return;
+
+    lxi_disconnect(device);
+}
+
+int screenshot_send(int device, const char *message, int length, int timeout)
+{
+    struct timespec start;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = lxi_send(device, message, length, timeout);
+    screenshot_timing.command += elapsed_ms(&start, NULL);
+
+    return status;
+}
+
+int screenshot_receive(int device, char *message, int length, int timeout)
+{
+    struct timespec start;
+    int status;
+
+    // Note: Includes time instrument spends rendering image as liblxi
+    // returns first when the complete response has been received
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = lxi_receive(device, message, length, timeout);
+    screenshot_timing.response += elapsed_ms(&start, NULL);
+    if (status > 0)
+        screenshot_timing.bytes += status;
+
+    // Mark start of post-processing
+    clock_gettime(CLOCK_MONOTONIC, &screenshot_response_end);
+
+    return status;
+}
+
+static void screenshot_link_close(void)
+{
+    if (screenshot_link != LXI_ERROR)
+        lxi_disconnect(screenshot_link);
+
+    screenshot_link = LXI_ERROR;
+}
 
 static int get_device_id(char *address, char *id, int timeout)
 {
@@ -79,7 +193,7 @@ static int get_device_id(char *address, char *id, int timeout)
     char *command;
 
     // Connect to LXI instrument
-    device = lxi_connect(address, 0, NULL, timeout, VXI11);
+    device = screenshot_connect(address, timeout);
     if (device == LXI_ERROR)
     {
         error_printf("Failed to connect\n");
@@ -101,7 +215,7 @@ static int get_device_id(char *address, char *id, int timeout)
     }
 
     // Disconnect
-    lxi_disconnect(device);
+    screenshot_disconnect(device);
 
     // Remove trailing newline
     if (id[bytes_received-1] == '\n')
@@ -111,7 +225,7 @@ static int get_device_id(char *address, char *id, int timeout)
 
 error_receive:
 error_send:
-    lxi_disconnect(device);
+    screenshot_disconnect(device);
 error_connect:
     return 1;
 }
@@ -147,16 +261,43 @@ static char *date_time(void)
     return date_time_string;
 }
 
-void screenshot_file_dump(void *data, int length, char *format)
+static void screenshot_file_write(void *buffer, void *data, int length, char *format)
 {
     char automatic_filename[1000];
     char *filename;
     char *image_data = data;
+    size_t offset;
+    void *image_buffer;
+    uint64_t hash;
     int i = 0;
     FILE *fd;
 
     // Resolve screenshot output filename
-    if (strlen(screenshot_filename) == 0)
+    if (screenshot_frame >= 0)
+    {
+        // Skip frame if identical to previous frame
+        hash = hash_fnv1a(data, length);
+        if ((screenshot_saved_count > 0) && (hash == screenshot_frame_hash))
+        {
+            screenshot_duplicate_count++;
+            free(buffer);
+            return;
+        }
+        screenshot_frame_hash = hash;
+
+        // Number frames by capture slot
+        if (snprintf(automatic_filename, sizeof(automatic_filename), "%s_%05d.%s",
+                     screenshot_frame_prefix, screenshot_frame, format) >= (int) sizeof(automatic_filename))
+        {
+            error_printf("Screenshot filename too long\n");
+            screenshot_failed_count++;
+            free(buffer);
+            return;
+        }
+        screenshot_saved_count++;
+        filename = automatic_filename;
+    }
+    else if (strlen(screenshot_filename) == 0)
     {
         // Automatically resolve screenshot filename if no filename is provided
         sprintf(automatic_filename, "screenshot_%s_%s.%s", screenshot_address, date_time(), format);
@@ -175,6 +316,13 @@ void screenshot_file_dump(void *data, int length, char *format)
             // Write image data to stdout in case filename is '-'
             for (i=0; i<length; i++)
                 putchar(*(image_data+i));
+            free(buffer);
+            return;
+        }
+        else if (transcode_active())
+        {
+            // Convert and write screenshot in background
+            transcode_submit(buffer, data, length, format, filename);
             return;
         }
         else
@@ -191,17 +339,39 @@ void screenshot_file_dump(void *data, int length, char *format)
 
             printf("Saved screenshot image to %s\n", filename);
         }
+
+        free(buffer);
     }
     else
     {
-        // Write screenshot to buffer
-        memcpy(screenshot_image_buffer, data, length);
-        *screenshot_image_size = length;
-        strcpy(screenshot_image_format, format);
-        strcpy(screenshot_image_filename, filename);
+        // Hand over image buffer to caller, trimmed to fit the image data
+        offset = image_data - (char *) buffer;
+        image_buffer = realloc(buffer, offset + length);
+        if (image_buffer == NULL)
+            image_buffer = buffer;
+
+        screenshot_image->buffer = image_buffer;
+        screenshot_image->data = (char *) image_buffer + offset;
+        screenshot_image->size = length;
+        strncpy(screenshot_image->format, format, sizeof(screenshot_image->format) - 1);
+        strncpy(screenshot_image->filename, filename, sizeof(screenshot_image->filename) - 1);
     }
 }
 
+void screenshot_file_dump(void *buffer, void *data, int length, char *format)
+{
+    struct timespec start;
+
+    // Time spent by plugin on post-processing since last response
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (screenshot_response_end.tv_sec != 0)
+        screenshot_timing.process += elapsed_ms(&screenshot_response_end, NULL);
+
+    screenshot_file_write(buffer, data, length, format);
+
+    screenshot_timing.write += elapsed_ms(&start, NULL);
+}
+
 void screenshot_plugin_register(struct screenshot_plugin *plugin)
 {
     int i = 0;
@@ -251,6 +421,13 @@ void screenshot_list_plugins(void)
 
 void screenshot_register_plugins(void)
 {
+    static bool registered = false;
+
+    // Only register once
+    if (registered)
+        return;
+    registered = true;
+
     // Register screenshot plugins
     screenshot_plugin_register(&keysight_dmm);
     screenshot_plugin_register(&keysight_ivx);
@@ -271,11 +448,8 @@ void screenshot_register_plugins(void)
     screenshot_plugin_register(&tektronix_3000);
 }
 
-int screenshot(char *address, char *plugin_name, char *filename,
-               int timeout, bool no_gui, void *image_buffer,
-               int *image_size, char *image_format, char *image_filename)
+static int find_plugin(char *address, char *plugin_name, int timeout)
 {
-    static char id[ID_LENGTH_MAX];
     bool no_match = true;
     bool token_found = true;
     char *token = NULL;
@@ -283,31 +457,22 @@ int screenshot(char *address, char *plugin_name, char *filename,
     int match_count = 0;
     int match_count_max = 0;
     char *regex_buffer;
+    struct timespec start;
+    double connect_time;
+    int status;
     int i = 0;
 
-    // Check parameters
-    if (strlen(address) == 0)
-    {
-        error_printf("Missing address\n");
-        return 1;
-    }
-
-    // Save variables
-    screenshot_address = address;
-    screenshot_filename = filename;
-    screenshot_no_gui = no_gui;
-    screenshot_image_buffer = image_buffer;
-    screenshot_image_size = image_size;
-    screenshot_image_format = image_format;
-    screenshot_image_filename = image_filename;
-
     if (strlen(plugin_name) == 0)
     {
-        // Get instrument ID
-        if (get_device_id(address, id, timeout) != 0)
+        // Get instrument ID (connect time is accounted separately)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        connect_time = screenshot_timing.connect;
+        status = get_device_id(address, screenshot_id, timeout);
+        screenshot_timing.identify += elapsed_ms(&start, NULL) - (screenshot_timing.connect - connect_time);
+        if (status != 0)
         {
             error_printf("Unable to retrieve instrument ID\n");
-            return 1;
+            return -1;
         }
 
         // Find relevant screenshot plugin (match instrument ID to plugin)
@@ -332,7 +497,7 @@ int screenshot(char *address, char *plugin_name, char *filename,
                 if (token != NULL)
                 {
                     // Match regular expression against ID
-                    if (regex_match(id, token))
+                    if (regex_match(screenshot_id, token))
                         match_count++; // Successful match
                 }
                 else
@@ -356,7 +521,7 @@ int screenshot(char *address, char *plugin_name, char *filename,
         if (plugin_winner == -1)
         {
             error_printf("Could not autodetect which screenshot plugin to use\n");
-            return 1;
+            return -1;
         }
 
         if (isatty(fileno(stdout)) && screenshot_no_gui)
@@ -382,9 +547,227 @@ int screenshot(char *address, char *plugin_name, char *filename,
     if (no_match)
     {
         error_printf("Unknown plugin name\n");
+        return -1;
+    }
+
+    return i;
+}
+
+static int screenshot_capture(char *address, char *plugin_name, char *filename,
+                              int timeout, bool no_gui, struct screenshot_image *image)
+{
+    struct timespec start;
+    int status;
+    int i;
+
+    if (image != NULL)
+        memset(image, 0, sizeof(struct screenshot_image));
+
+    // Check parameters
+    if (strlen(address) == 0)
+    {
+        error_printf("Missing address\n");
         return 1;
     }
 
+    // Save variables
+    screenshot_address = address;
+    screenshot_filename = filename;
+    screenshot_no_gui = no_gui;
+    screenshot_image = image;
+
+    screenshot_timing_reset(&start);
+
+    i = find_plugin(address, plugin_name, timeout);
+    if (i < 0)
+        return 1;
+
     // Call capture screenshot function
-    return plugin_list[i]->screenshot(address, id, timeout);
+    status = plugin_list[i]->screenshot(address, screenshot_id, timeout);
+
+    screenshot_timing.total = elapsed_ms(&start, NULL);
+    if (image != NULL)
+    {
+        image->plugin = plugin_list[i]->name;
+        image->timing = screenshot_timing;
+    }
+    if (screenshot_timing_enabled && (status == 0))
+        screenshot_timing_print();
+
+    return status;
+}
+
+int screenshot(char *address, char *plugin_name, char *filename,
+               int timeout, bool no_gui, struct screenshot_image *image)
+{
+    int status;
+
+    // Serialize captures (GUI and Lua scripts may grab concurrently)
+    pthread_mutex_lock(&screenshot_mutex);
+    status = screenshot_capture(address, plugin_name, filename, timeout, no_gui, image);
+    pthread_mutex_unlock(&screenshot_mutex);
+
+    return status;
+}
+
+int screenshot_device(int device, char *address, char *plugin_name,
+                      int timeout, struct screenshot_image *image)
+{
+    int status;
+
+    pthread_mutex_lock(&screenshot_mutex);
+
+    // Capture via already connected VXI11 link instead of reconnecting
+    screenshot_keep_link = true;
+    screenshot_link = device;
+
+    status = screenshot_capture(address, plugin_name, "", timeout, false, image);
+
+    // Leave link open, it is owned by caller
+    screenshot_keep_link = false;
+    screenshot_link = LXI_ERROR;
+
+    pthread_mutex_unlock(&screenshot_mutex);
+
+    return status;
+}
+
+static void timelapse_signal_handler(int signum)
+{
+    UNUSED(signum);
+
+    // Stop capturing after current frame
+    screenshot_stop = true;
+}
+
+int screenshot_timelapse(char *address, char *plugin_name, char *filename,
+                         int timeout, int interval, int duration)
+{
+    struct timespec start, deadline, now, frame_start;
+    char *extension;
+    double elapsed;
+    int frame_count = 0;
+    int i;
+
+    // Check parameters
+    if (strlen(address) == 0)
+    {
+        error_printf("Missing address\n");
+        return 1;
+    }
+
+    if (interval <= 0)
+    {
+        error_printf("Invalid interval\n");
+        return 1;
+    }
+
+    if (strcmp(filename, "-") == 0)
+    {
+        error_printf("Can not write multiple screenshots to stdout\n");
+        return 1;
+    }
+
+    // Save variables
+    screenshot_address = address;
+    screenshot_filename = filename;
+    screenshot_no_gui = true;
+    screenshot_image = NULL;
+
+    // Resolve filename prefix of frames (strip any extension)
+    if (strlen(filename) == 0)
+        snprintf(screenshot_frame_prefix, sizeof(screenshot_frame_prefix), "screenshot_%s_%s", address, date_time());
+    else
+    {
+        strncpy(screenshot_frame_prefix, filename, sizeof(screenshot_frame_prefix) - 1);
+        extension = strrchr(screenshot_frame_prefix, '.');
+        if ((extension != NULL) && (strchr(extension, '/') == NULL))
+            *extension = 0;
+    }
+
+    // Keep link to instrument open between frames
+    screenshot_keep_link = true;
+
+    // Identification time is included in timing of first frame
+    screenshot_timing_reset(&frame_start);
+
+    i = find_plugin(address, plugin_name, timeout);
+    if (i < 0)
+    {
+        screenshot_link_close();
+        screenshot_keep_link = false;
+        return 1;
+    }
+
+    // Stop gracefully on ctrl-c
+    signal(SIGINT, timelapse_signal_handler);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+
+    while (!screenshot_stop)
+    {
+        if (frame_count > 0)
+            screenshot_timing_reset(&frame_start);
+
+        // Capture frame
+        screenshot_frame = frame_count++;
+        if (plugin_list[i]->screenshot(address, screenshot_id, timeout) != 0)
+        {
+            // Reconnect at next frame
+            screenshot_link_close();
+            screenshot_failed_count++;
+        }
+        else if (screenshot_timing_enabled)
+        {
+            screenshot_timing.total = elapsed_ms(&frame_start, NULL);
+            screenshot_timing_print();
+        }
+        fflush(stdout);
+
+        // Schedule next frame relative to start so capture time does not add up
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        // Skip frames which are already overdue
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while ((deadline.tv_sec < now.tv_sec) ||
+               ((deadline.tv_sec == now.tv_sec) && (deadline.tv_nsec < now.tv_nsec)))
+        {
+            deadline.tv_sec += interval / 1000;
+            deadline.tv_nsec += (interval % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            frame_count++;
+        }
+
+        // Stop when duration has passed (0 = run until interrupted)
+        elapsed = (double)(deadline.tv_sec - start.tv_sec) +
+                  (double)(deadline.tv_nsec - start.tv_nsec) * 1.0e-9;
+        if ((duration > 0) && (elapsed >= duration))
+            break;
+
+        while (!screenshot_stop && (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) != 0));
+    }
+
+    signal(SIGINT, SIG_DFL);
+
+    screenshot_link_close();
+    screenshot_keep_link = false;
+    screenshot_frame = -1;
+
+    printf("Captured %d frames (%d saved, %d duplicates skipped, %d failed)\n",
+           screenshot_saved_count + screenshot_duplicate_count + screenshot_failed_count,
+           screenshot_saved_count, screenshot_duplicate_count, screenshot_failed_count);
+
+    // Fail if not a single frame was saved
+    return screenshot_saved_count == 0;
 }
@@ -37,14 +37,53 @@ extern "C" {
 #include <stdbool.h>
 #include "misc.h"
 
+struct screenshot_timing
+{
+   double identify;     // Time spent identifying instrument (ms)
+   double connect;      // Time spent connecting to instrument (ms)
+   double command;      // Time spent sending commands (ms)
+   double response;     // Time spent waiting for and receiving responses (ms)
+   double process;      // Time spent post-processing image data (ms)
+   double write;        // Time spent writing or handing over image (ms)
+   double total;        // Total capture time (ms)
+   int bytes;           // Number of bytes received
+};
+
+struct screenshot_image
+{
+   void *buffer;        // Buffer holding image data (owned, release with free())
+   char *data;          // Start of image data within buffer
+   int size;            // Size of image data
+   char format[10];
+   char filename[1000];
+   const char *plugin;  // Name of plugin used to capture image
+   struct screenshot_timing timing;
+};
+
 void screenshot_register_plugins(void);
 void screenshot_list_plugins(void);
 int screenshot(char *address, char *plugin_name, char *filename,
-               int timeout, bool no_gui, void *image_buffer,
-               int *image_size, char *image_format, char *image_filename);
+               int timeout, bool no_gui, struct screenshot_image *image);
+int screenshot_device(int device, char *address, char *plugin_name,
+                      int timeout, struct screenshot_image *image);
+int screenshot_timelapse(char *address, char *plugin_name, char *filename,
+                         int timeout, int interval, int duration);
+
+// Screenshot helper function used by plugins to dump image file. Takes
+// ownership of the allocated buffer which holds the image data.
+void screenshot_file_dump(void *buffer, void *data, int length, char *format);
+
+// Screenshot helper functions used by plugins to connect to instrument
+int screenshot_connect(char *address, int timeout);
+void screenshot_disconnect(int device);
+
+// Screenshot helper functions used by plugins to communicate with instrument
+// (wraps lxi_send()/lxi_receive() to collect timing information)
+int screenshot_send(int device, const char *message, int length, int timeout);
+int screenshot_receive(int device, char *message, int length, int timeout);
 
-// Screenshot helper function used by plugins to dump image file
-void screenshot_file_dump(void *data, int length, char *format);
+// Print per-phase timing of each screenshot captured
+void screenshot_timing_enable(bool enable);
 
 struct screenshot_plugin
 {
@@ -0,0 +1,824 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "error.h"
+#include "misc.h"
+#include "array.h"
+#include "lxilua.h"
+#include "spawn.h"
+#include "bytecode.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+
+#define THREADS_MAX 256
+#define CHANNELS_MAX 256
+#define CHANNEL_CAPACITY 1024
+
+// Value passed between Lua states
+enum message_type
+{
+    MESSAGE_NIL,
+    MESSAGE_BOOLEAN,
+    MESSAGE_INTEGER,
+    MESSAGE_NUMBER,
+    MESSAGE_STRING,
+    MESSAGE_ARRAY,
+    MESSAGE_DEVICE,
+};
+
+struct message
+{
+    enum message_type type;
+    bool boolean;
+    long long integer;
+    double number;
+    enum array_type array_type;
+    size_t length;          // String length in bytes or array length
+    void *data;
+    struct session_t *session;
+    struct message *next;
+};
+
+struct spawned_t
+{
+    bool allocated;
+    bool joining;
+    pthread_t thread;
+    lua_State *L;
+    int argc;
+    bool script;            // Script of run_parallel(), stops others on error
+    char *error;
+    struct message *results;
+    int result_count;
+};
+
+struct channel_t
+{
+    bool allocated;
+    bool initialized;
+    bool closed;
+    int capacity;
+    int count;
+    struct message *head;
+    struct message *tail;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+static struct spawned_t spawned[THREADS_MAX];
+static pthread_mutex_t spawn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct channel_t channels[CHANNELS_MAX];
+static pthread_mutex_t channel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by spawn_stop() until spawn_wait() is done, makes channel functions
+// raise error as states waiting for channel never run their stop hook
+static bool channels_stopped = false;
+
+static bool is_array(lua_State *L, int index)
+{
+    bool equal;
+
+    if ((lua_type(L, index) != LUA_TUSERDATA) || !lua_getmetatable(L, index))
+        return false;
+    luaL_getmetatable(L, ARRAY_METATABLE);
+    equal = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return equal;
+}
+
+static void message_free(struct message *message)
+{
+    struct message *next;
+
+    while (message != NULL)
+    {
+        next = message->next;
+        if (message->session != NULL)
+            session_unref(message->session);
+        free(message->data);
+        free(message);
+        message = next;
+    }
+}
+
+// Copy Lua value at index into new message (NULL if type is not supported)
+static struct message *message_new(lua_State *L, int index)
+{
+    struct message *message;
+    struct array *array;
+    const char *string;
+    size_t size;
+
+    message = calloc(1, sizeof(struct message));
+    if (message == NULL)
+        return NULL;
+
+    switch (lua_type(L, index))
+    {
+        case LUA_TNIL:
+        case LUA_TNONE:
+            message->type = MESSAGE_NIL;
+            break;
+
+        case LUA_TBOOLEAN:
+            message->type = MESSAGE_BOOLEAN;
+            message->boolean = lua_toboolean(L, index);
+            break;
+
+        case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, index))
+            {
+                message->type = MESSAGE_INTEGER;
+                message->integer = lua_tointeger(L, index);
+                break;
+            }
+#endif
+            message->type = MESSAGE_NUMBER;
+            message->number = lua_tonumber(L, index);
+            break;
+
+        case LUA_TSTRING:
+            string = lua_tolstring(L, index, &size);
+            message->type = MESSAGE_STRING;
+            message->length = size;
+            message->data = malloc(size > 0 ? size : 1);
+            if (message->data == NULL)
+                goto error;
+            memcpy(message->data, string, size);
+            break;
+
+        case LUA_TUSERDATA:
+            message->session = session_ref(L, index);
+            if (message->session != NULL)
+            {
+                message->type = MESSAGE_DEVICE;
+                break;
+            }
+            if (!is_array(L, index))
+                goto error;
+            array = lua_touserdata(L, index);
+            size = array->length * array_element_size(array->type);
+            message->type = MESSAGE_ARRAY;
+            message->array_type = array->type;
+            message->length = array->length;
+            message->data = malloc(size > 0 ? size : 1);
+            if (message->data == NULL)
+                goto error;
+            memcpy(message->data, array->data, size);
+            break;
+
+        default:
+            goto error;
+    }
+
+    return message;
+
+error:
+    free(message->data);
+    free(message);
+    return NULL;
+}
+
+// Same as message_new() but raise Lua error for unsupported values
+static struct message *message_check(lua_State *L, int index)
+{
+    struct message *message = message_new(L, index);
+
+    if (message == NULL)
+        luaL_argerror(L, index, "expected nil, boolean, number, string, array or device");
+
+    return message;
+}
+
+static void message_push(lua_State *L, struct message *message)
+{
+    struct array *array;
+
+    switch (message->type)
+    {
+        case MESSAGE_NIL:
+            lua_pushnil(L);
+            break;
+        case MESSAGE_BOOLEAN:
+            lua_pushboolean(L, message->boolean);
+            break;
+        case MESSAGE_INTEGER:
+            lua_pushinteger(L, message->integer);
+            break;
+        case MESSAGE_NUMBER:
+            lua_pushnumber(L, message->number);
+            break;
+        case MESSAGE_STRING:
+            lua_pushlstring(L, message->data, message->length);
+            break;
+        case MESSAGE_ARRAY:
+            array = array_push(L, message->array_type, message->length);
+            memcpy(array->data, message->data, message->length * array_element_size(message->array_type));
+            break;
+        case MESSAGE_DEVICE:
+            session_push(L, message->session);
+            break;
+    }
+}
+
+struct dump_buffer
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static int dump_writer(lua_State *L, const void *p, size_t size, void *data)
+{
+    struct dump_buffer *buffer = data;
+    char *grown;
+
+    UNUSED(L);
+
+    if (buffer->size + size > buffer->capacity)
+    {
+        buffer->capacity = (buffer->size + size) * 2;
+        grown = realloc(buffer->data, buffer->capacity);
+        if (grown == NULL)
+            return 1;
+        buffer->data = grown;
+    }
+    memcpy(buffer->data + buffer->size, p, size);
+    buffer->size += size;
+
+    return 0;
+}
+
+static lua_State *state_new(void)
+{
+    lua_State *L = luaL_newstate();
+
+    if (L == NULL)
+        return NULL;
+
+    luaL_openlibs(L);
+    lua_register_lxi(L);
+
+    return L;
+}
+
+// Load function at index of L into new state as main function of thread
+static int state_load_function(lua_State *L, int index, lua_State *L_new)
+{
+    struct dump_buffer buffer = { NULL, 0, 0 };
+    const char *name;
+    int status, i;
+
+    // Serialize function (upvalues are not transferred)
+    lua_pushvalue(L, index);
+#if LUA_VERSION_NUM >= 503
+    status = lua_dump(L, dump_writer, &buffer, 0);
+#else
+    status = lua_dump(L, dump_writer, &buffer);
+#endif
+    lua_pop(L, 1);
+
+    if (status == 0)
+        status = luaL_loadbuffer(L_new, buffer.data, buffer.size, "=spawn");
+    else
+        lua_pushstring(L_new, "spawn: failed to serialize function");
+    free(buffer.data);
+    if (status != 0)
+        return status;
+
+#if LUA_VERSION_NUM >= 502
+    // Give function access to globals of new state
+    for (i=1; (name = lua_getupvalue(L_new, -1, i)) != NULL; i++)
+    {
+        lua_pop(L_new, 1);
+        if (strcmp(name, "_ENV") == 0)
+        {
+            lua_pushglobaltable(L_new);
+            lua_setupvalue(L_new, -2, i);
+        }
+    }
+#else
+    UNUSED(name);
+    UNUSED(i);
+#endif
+
+    return 0;
+}
+
+static void *spawn_thread(void *data)
+{
+    struct spawned_t *thread = data;
+    lua_State *L = thread->L;
+    struct message **link = &thread->results;
+    int top, i;
+
+    top = lua_gettop(L) - thread->argc - 1;
+
+    if (lua_pcall(L, thread->argc, LUA_MULTRET, 0) != 0)
+    {
+        thread->error = strdup(lua_tostring(L, -1) ? lua_tostring(L, -1) : "unknown error");
+        error_printf("%s\n", thread->error);
+    }
+    else
+    {
+        // Keep return values which can be passed on to joining state,
+        // values which can not are returned as nil to keep their position
+        for (i=top+1; i<=lua_gettop(L); i++)
+        {
+            *link = message_new(L, i);
+            if (*link == NULL)
+                *link = calloc(1, sizeof(struct message));
+            if (*link == NULL)
+                break;
+            link = &(*link)->next;
+            thread->result_count++;
+        }
+    }
+
+    pthread_mutex_lock(&spawn_mutex);
+    thread->L = NULL;
+    pthread_mutex_unlock(&spawn_mutex);
+    lua_close(L);
+
+    // Scripts run in parallel may wait for values from failed script
+    if (thread->script && (thread->error != NULL))
+        spawn_stop();
+
+    return NULL;
+}
+
+// Start thread running function on top of stack of L with argc arguments
+static int spawn_start(lua_State *L, int argc, bool script)
+{
+    int handle;
+
+    pthread_mutex_lock(&spawn_mutex);
+    for (handle=0; handle<THREADS_MAX; handle++)
+        if (!spawned[handle].allocated)
+            break;
+    if (handle == THREADS_MAX)
+    {
+        pthread_mutex_unlock(&spawn_mutex);
+        error_printf("Too many threads\n");
+        return -1;
+    }
+    memset(&spawned[handle], 0, sizeof(struct spawned_t));
+    spawned[handle].allocated = true;
+    spawned[handle].L = L;
+    spawned[handle].argc = argc;
+    spawned[handle].script = script;
+    pthread_mutex_unlock(&spawn_mutex);
+
+    if (pthread_create(&spawned[handle].thread, NULL, spawn_thread, &spawned[handle]) != 0)
+    {
+        error_printf("Failed to create thread\n");
+        pthread_mutex_lock(&spawn_mutex);
+        spawned[handle].L = NULL;
+        spawned[handle].allocated = false;
+        pthread_mutex_unlock(&spawn_mutex);
+        return -1;
+    }
+
+    return handle;
+}
+
+// Wait for thread to finish and release its slot. Returns false if thread
+// failed. Results are left for caller to free.
+static bool spawn_join(int handle)
+{
+    pthread_join(spawned[handle].thread, NULL);
+
+    return spawned[handle].error == NULL;
+}
+
+static void spawn_release(int handle)
+{
+    free(spawned[handle].error);
+    message_free(spawned[handle].results);
+
+    pthread_mutex_lock(&spawn_mutex);
+    spawned[handle].allocated = false;
+    pthread_mutex_unlock(&spawn_mutex);
+}
+
+int spawn_file(const char *filename)
+{
+    lua_State *L = state_new();
+    int handle;
+
+    if (L == NULL)
+    {
+        error_printf("Failed to create Lua state\n");
+        return -1;
+    }
+
+    if (bytecode_loadfile(L, filename) != 0)
+    {
+        error_printf("%s\n", lua_tostring(L, -1));
+        lua_close(L);
+        return -1;
+    }
+
+    handle = spawn_start(L, 0, true);
+    if (handle < 0)
+        lua_close(L);
+
+    return handle;
+}
+
+void spawn_stop(void)
+{
+    int handle;
+
+    // Make running states raise error at next instruction
+    pthread_mutex_lock(&spawn_mutex);
+    for (handle=0; handle<THREADS_MAX; handle++)
+        if (spawned[handle].allocated && (spawned[handle].L != NULL))
+            lua_stop(spawned[handle].L);
+    pthread_mutex_unlock(&spawn_mutex);
+
+    // Close channels and wake up states waiting for them
+    pthread_mutex_lock(&channel_mutex);
+    channels_stopped = true;
+    for (handle=0; handle<CHANNELS_MAX; handle++)
+    {
+        if (!channels[handle].allocated)
+            continue;
+        channels[handle].closed = true;
+        pthread_cond_broadcast(&channels[handle].not_empty);
+        pthread_cond_broadcast(&channels[handle].not_full);
+    }
+    pthread_mutex_unlock(&channel_mutex);
+}
+
+int spawn_wait(void)
+{
+    int handle, failed = 0;
+    bool joining;
+
+    for (handle=0; handle<THREADS_MAX; handle++)
+    {
+        pthread_mutex_lock(&spawn_mutex);
+        joining = spawned[handle].allocated && !spawned[handle].joining;
+        spawned[handle].joining |= joining;
+        pthread_mutex_unlock(&spawn_mutex);
+
+        if (!joining)
+            continue;
+
+        if (!spawn_join(handle))
+            failed++;
+        spawn_release(handle);
+    }
+
+    spawn_stop_reset();
+
+    return failed;
+}
+
+void spawn_stop_reset(void)
+{
+    pthread_mutex_lock(&channel_mutex);
+    channels_stopped = false;
+    pthread_mutex_unlock(&channel_mutex);
+}
+
+// lua: thread = spawn(filename|function, ...)
+static int spawn(lua_State *L)
+{
+    lua_State *L_new;
+    struct message *message;
+    int argc = lua_gettop(L) - 1;
+    int status, handle, i;
+
+    if (lua_type(L, 1) != LUA_TFUNCTION)
+        luaL_checkstring(L, 1);
+
+    L_new = state_new();
+    if (L_new == NULL)
+        return luaL_error(L, "spawn: failed to create Lua state");
+
+    if (lua_type(L, 1) == LUA_TFUNCTION)
+        status = state_load_function(L, 1, L_new);
+    else
+        status = bytecode_loadfile(L_new, lua_tostring(L, 1));
+    if (status != 0)
+    {
+        lua_pushstring(L, lua_tostring(L_new, -1));
+        lua_close(L_new);
+        return lua_error(L);
+    }
+
+    // Copy arguments
+    for (i=2; i<=argc+1; i++)
+    {
+        message = message_new(L, i);
+        if (message == NULL)
+        {
+            lua_close(L_new);
+            return luaL_argerror(L, i, "expected nil, boolean, number, string, array or device");
+        }
+        message_push(L_new, message);
+        message_free(message);
+    }
+
+    handle = spawn_start(L_new, argc, false);
+    if (handle < 0)
+    {
+        lua_close(L_new);
+        return luaL_error(L, "spawn: failed to start thread");
+    }
+
+    // Return thread handle
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+// lua: ok, ... = join(thread)
+static int join(lua_State *L)
+{
+    int handle = luaL_checkinteger(L, 1);
+    struct message *message;
+    bool joining;
+    int count;
+
+    pthread_mutex_lock(&spawn_mutex);
+    joining = (handle >= 0) && (handle < THREADS_MAX) &&
+        spawned[handle].allocated && !spawned[handle].joining;
+    if (joining)
+        spawned[handle].joining = true;
+    pthread_mutex_unlock(&spawn_mutex);
+
+    luaL_argcheck(L, joining, 1, "invalid thread");
+
+    if (!spawn_join(handle))
+    {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, spawned[handle].error);
+        spawn_release(handle);
+        return 2;
+    }
+
+    // Return true followed by return values of thread
+    count = spawned[handle].result_count;
+    luaL_checkstack(L, count + 1, "join: too many results");
+    lua_pushboolean(L, true);
+    for (message = spawned[handle].results; message != NULL; message = message->next)
+        message_push(L, message);
+    spawn_release(handle);
+
+    return count + 1;
+}
+
+static struct channel_t *channel_check(lua_State *L, int index)
+{
+    int handle = luaL_checkinteger(L, index);
+
+    luaL_argcheck(L, (handle >= 0) && (handle < CHANNELS_MAX) && channels[handle].allocated,
+                  index, "invalid channel");
+
+    return &channels[handle];
+}
+
+// Convert relative timeout in milliseconds to absolute time for timed wait
+static void deadline(struct timespec *time, int timeout)
+{
+    clock_gettime(CLOCK_REALTIME, time);
+    time->tv_sec += timeout / 1000;
+    time->tv_nsec += (timeout % 1000) * 1000000L;
+    if (time->tv_nsec >= 1000000000L)
+    {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000L;
+    }
+}
+
+// lua: channel = channel_new(capacity)
+static int channel_new(lua_State *L)
+{
+    int capacity = luaL_optinteger(L, 1, CHANNEL_CAPACITY);
+    int handle;
+
+    pthread_mutex_lock(&channel_mutex);
+
+    // Find free channel
+    for (handle=0; handle<CHANNELS_MAX; handle++)
+        if (!channels[handle].allocated)
+            break;
+    if (handle == CHANNELS_MAX)
+    {
+        pthread_mutex_unlock(&channel_mutex);
+        return luaL_error(L, "channel_new: too many channels");
+    }
+
+    if (!channels[handle].initialized)
+    {
+        pthread_cond_init(&channels[handle].not_empty, NULL);
+        pthread_cond_init(&channels[handle].not_full, NULL);
+        channels[handle].initialized = true;
+    }
+    channels[handle].allocated = true;
+    channels[handle].closed = false;
+    channels[handle].capacity = capacity > 0 ? capacity : CHANNEL_CAPACITY;
+    channels[handle].count = 0;
+    channels[handle].head = NULL;
+    channels[handle].tail = NULL;
+
+    pthread_mutex_unlock(&channel_mutex);
+
+    // Return channel handle
+    lua_pushinteger(L, handle);
+    return 1;
+}
+
+// lua: ok, error = channel_send(channel, value, timeout)
+static int channel_send(lua_State *L)
+{
+    struct channel_t *channel = channel_check(L, 1);
+    struct message *message = message_check(L, 2);
+    int timeout = luaL_optinteger(L, 3, 0);
+    const char *error = NULL;
+    struct timespec time;
+    bool stopped;
+
+    deadline(&time, timeout);
+
+    pthread_mutex_lock(&channel_mutex);
+
+    // Block while channel is full
+    while (!channels_stopped && !channel->closed && (channel->count >= channel->capacity))
+    {
+        if (timeout <= 0)
+            pthread_cond_wait(&channel->not_full, &channel_mutex);
+        else if (pthread_cond_timedwait(&channel->not_full, &channel_mutex, &time) == ETIMEDOUT)
+            break;
+    }
+
+    stopped = channels_stopped;
+    if (stopped || channel->closed)
+        error = "closed";
+    else if (channel->count >= channel->capacity)
+        error = "timeout";
+    else
+    {
+        if (channel->tail != NULL)
+            channel->tail->next = message;
+        else
+            channel->head = message;
+        channel->tail = message;
+        channel->count++;
+        message = NULL;
+        pthread_cond_signal(&channel->not_empty);
+    }
+
+    pthread_mutex_unlock(&channel_mutex);
+
+    message_free(message);
+
+    if (stopped)
+        return luaL_error(L, "channel_send: stopped");
+
+    if (error != NULL)
+    {
+        lua_pushboolean(L, false);
+        lua_pushstring(L, error);
+        return 2;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// lua: value, error = channel_receive(channel, timeout)
+static int channel_receive(lua_State *L)
+{
+    struct channel_t *channel = channel_check(L, 1);
+    int timeout = luaL_optinteger(L, 2, 0);
+    struct message *message = NULL;
+    struct timespec time;
+    bool stopped;
+
+    deadline(&time, timeout);
+
+    pthread_mutex_lock(&channel_mutex);
+
+    // Block while channel is empty
+    while (!channels_stopped && !channel->closed && (channel->head == NULL))
+    {
+        if (timeout <= 0)
+            pthread_cond_wait(&channel->not_empty, &channel_mutex);
+        else if (pthread_cond_timedwait(&channel->not_empty, &channel_mutex, &time) == ETIMEDOUT)
+            break;
+    }
+
+    stopped = channels_stopped;
+    if (!stopped)
+        message = channel->head;
+    if (message != NULL)
+    {
+        channel->head = message->next;
+        if (channel->head == NULL)
+            channel->tail = NULL;
+        channel->count--;
+        message->next = NULL;
+        pthread_cond_signal(&channel->not_full);
+    }
+
+    pthread_mutex_unlock(&channel_mutex);
+
+    if (stopped)
+        return luaL_error(L, "channel_receive: stopped");
+
+    if (message == NULL)
+    {
+        // Queued values are delivered before reporting closed channel
+        lua_pushnil(L);
+        lua_pushstring(L, channel->closed ? "closed" : "timeout");
+        return 2;
+    }
+
+    message_push(L, message);
+    message_free(message);
+    return 1;
+}
+
+// lua: channel_close(channel)
+static int channel_close(lua_State *L)
+{
+    struct channel_t *channel = channel_check(L, 1);
+
+    pthread_mutex_lock(&channel_mutex);
+    channel->closed = true;
+    pthread_cond_broadcast(&channel->not_empty);
+    pthread_cond_broadcast(&channel->not_full);
+    pthread_mutex_unlock(&channel_mutex);
+
+    return 0;
+}
+
+// lua: channel_free(channel)
+static int channel_free(lua_State *L)
+{
+    struct channel_t *channel = channel_check(L, 1);
+
+    pthread_mutex_lock(&channel_mutex);
+    message_free(channel->head);
+    channel->head = NULL;
+    channel->tail = NULL;
+    channel->count = 0;
+    channel->allocated = false;
+    pthread_mutex_unlock(&channel_mutex);
+
+    return 0;
+}
+
+int lua_register_spawn(lua_State *L)
+{
+    lua_register(L, "spawn", spawn);
+    lua_register(L, "join", join);
+    lua_register(L, "channel_new", channel_new);
+    lua_register(L, "channel_send", channel_send);
+    lua_register(L, "channel_receive", channel_receive);
+    lua_register(L, "channel_close", channel_close);
+    lua_register(L, "channel_free", channel_free);
+
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "array.h"
+#include "stream.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+
+#define STREAM_BLOCK_SIZE 0x100000  // Bytes per block handed to writer thread
+#define STREAM_BLOCKS_MAX 64        // Blocks queued before writes wait for disk
+#define STREAM_MAGIC "LXIARR1\n"
+#define NPY_HEADER_SIZE 128         // Fixed so shape can be patched on close
+
+enum stream_format
+{
+    STREAM_NPY,
+    STREAM_BINARY,
+};
+
+struct stream_block
+{
+    size_t size;
+    struct stream_block *next;
+    char data[STREAM_BLOCK_SIZE];
+};
+
+struct stream_t
+{
+    FILE *file;
+    char *filename;
+    enum stream_format format;
+    enum array_type type;
+    size_t element_size;
+    uint32_t columns;
+    uint64_t elements;
+    struct stream_block *block;     // Block being filled
+    struct stream_block *head;      // Blocks queued for writer thread
+    struct stream_block *tail;
+    int queued;
+    bool closing;
+    int error;                      // errno of failed write
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_work;
+    pthread_cond_t cond_space;
+};
+
+// Userdata referring to stream
+struct stream_handle
+{
+    struct stream_t *stream;
+};
+
+static bool host_is_big_endian(void)
+{
+    const uint16_t value = 1;
+
+    return *(const uint8_t *) &value == 0;
+}
+
+static void *stream_writer(void *data)
+{
+    struct stream_t *stream = data;
+    struct stream_block *block;
+    int error = 0;
+
+    while (true)
+    {
+        pthread_mutex_lock(&stream->mutex);
+        while ((stream->head == NULL) && !stream->closing)
+            pthread_cond_wait(&stream->cond_work, &stream->mutex);
+        block = stream->head;
+        if (block == NULL)
+        {
+            pthread_mutex_unlock(&stream->mutex);
+            break;
+        }
+        stream->head = block->next;
+        if (stream->head == NULL)
+            stream->tail = NULL;
+        pthread_mutex_unlock(&stream->mutex);
+
+        // Once a write fails remaining blocks are dropped
+        if ((error == 0) && (fwrite(block->data, 1, block->size, stream->file) != block->size))
+            error = errno ? errno : EIO;
+        free(block);
+
+        pthread_mutex_lock(&stream->mutex);
+        stream->queued--;
+        if (error != 0)
+            stream->error = error;
+        pthread_cond_signal(&stream->cond_space);
+        pthread_mutex_unlock(&stream->mutex);
+    }
+
+    return NULL;
+}
+
+// Hand filled block to writer thread. Waits only if writer is far behind.
+static void stream_flush(struct stream_t *stream)
+{
+    struct stream_block *block = stream->block;
+
+    if ((block == NULL) || (block->size == 0))
+        return;
+    stream->block = NULL;
+
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->queued >= STREAM_BLOCKS_MAX)
+        pthread_cond_wait(&stream->cond_space, &stream->mutex);
+    block->next = NULL;
+    if (stream->tail != NULL)
+        stream->tail->next = block;
+    else
+        stream->head = block;
+    stream->tail = block;
+    stream->queued++;
+    pthread_cond_signal(&stream->cond_work);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+// Make room for at least one element. Returns false if out of memory.
+static bool stream_reserve(struct stream_t *stream)
+{
+    if ((stream->block != NULL) && (stream->block->size + stream->element_size > STREAM_BLOCK_SIZE))
+        stream_flush(stream);
+
+    if (stream->block == NULL)
+    {
+        stream->block = malloc(sizeof(struct stream_block));
+        if (stream->block == NULL)
+            return false;
+        stream->block->size = 0;
+    }
+
+    return true;
+}
+
+static bool stream_append(struct stream_t *stream, double value)
+{
+    if (!stream_reserve(stream))
+        return false;
+
+    array_element_set(stream->type, stream->block->data + stream->block->size, 0, value);
+    stream->block->size += stream->element_size;
+    stream->elements++;
+
+    return true;
+}
+
+// Append elements of array with same element type
+static bool stream_append_raw(struct stream_t *stream, const char *data, size_t length)
+{
+    size_t count;
+
+    while (length > 0)
+    {
+        if (!stream_reserve(stream))
+            return false;
+        count = (STREAM_BLOCK_SIZE - stream->block->size) / stream->element_size;
+        if (count > length)
+            count = length;
+        memcpy(stream->block->data + stream->block->size, data, count * stream->element_size);
+        stream->block->size += count * stream->element_size;
+        stream->elements += count;
+        data += count * stream->element_size;
+        length -= count;
+    }
+
+    return true;
+}
+
+// Write file header. Number of rows is written again when stream is closed.
+static int stream_write_header(struct stream_t *stream)
+{
+    static const char *npy_types[] = { "f8", "f4", "i2" };
+    uint64_t rows = stream->elements / stream->columns;
+    char header[NPY_HEADER_SIZE];
+    int length;
+    uint8_t type;
+
+    if (stream->format == STREAM_NPY)
+    {
+        // NPY version 1.0, header padded with spaces and ended by newline
+        memset(header, ' ', sizeof(header));
+        memcpy(header, "\x93NUMPY\x01\x00", 8);
+        header[8] = (NPY_HEADER_SIZE - 10) & 0xff;
+        header[9] = (NPY_HEADER_SIZE - 10) >> 8;
+        if (stream->columns == 1)
+            length = snprintf(header + 10, sizeof(header) - 10,
+                              "{'descr': '%c%s', 'fortran_order': False, 'shape': (%llu,), }",
+                              host_is_big_endian() ? '>' : '<', npy_types[stream->type],
+                              (unsigned long long) rows);
+        else
+            length = snprintf(header + 10, sizeof(header) - 10,
+                              "{'descr': '%c%s', 'fortran_order': False, 'shape': (%llu, %u), }",
+                              host_is_big_endian() ? '>' : '<', npy_types[stream->type],
+                              (unsigned long long) rows, (unsigned int) stream->columns);
+        header[10 + length] = ' ';
+        header[NPY_HEADER_SIZE - 1] = '\n';
+        length = NPY_HEADER_SIZE;
+    }
+    else
+    {
+        memcpy(header, STREAM_MAGIC, 8);
+        type = stream->type;
+        header[8] = type;
+        header[9] = host_is_big_endian();
+        header[10] = 0;
+        header[11] = 0;
+        memcpy(header + 12, &stream->columns, sizeof(uint32_t));
+        memcpy(header + 16, &rows, sizeof(uint64_t));
+        length = 24;
+    }
+
+    if (fwrite(header, 1, length, stream->file) != (size_t) length)
+        return errno ? errno : EIO;
+
+    return 0;
+}
+
+// Flush remaining data, stop writer thread and patch header. Returns errno
+// of first failure or 0.
+static int stream_finish(struct stream_t *stream)
+{
+    int error;
+
+    stream_flush(stream);
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->closing = true;
+    pthread_cond_signal(&stream->cond_work);
+    pthread_mutex_unlock(&stream->mutex);
+    pthread_join(stream->thread, NULL);
+
+    error = stream->error;
+    if ((error == 0) && (fseek(stream->file, 0, SEEK_SET) != 0))
+        error = errno;
+    if (error == 0)
+        error = stream_write_header(stream);
+    if ((fclose(stream->file) != 0) && (error == 0))
+        error = errno;
+
+    free(stream->block);
+    free(stream->filename);
+    pthread_mutex_destroy(&stream->mutex);
+    pthread_cond_destroy(&stream->cond_work);
+    pthread_cond_destroy(&stream->cond_space);
+    free(stream);
+
+    return error;
+}
+
+static struct stream_handle *stream_check(lua_State *L, int index)
+{
+    struct stream_handle *handle = luaL_checkudata(L, index, STREAM_METATABLE);
+
+    if (handle->stream == NULL)
+        luaL_error(L, "stream is closed");
+
+    return handle;
+}
+
+// lua: stream = stream_open(filename, type, columns, format)
+static int stream_open(lua_State *L)
+{
+    static const char *formats[] = { "npy", "binary", NULL };
+    const char *filename = luaL_checkstring(L, 1);
+    enum array_type type = array_check_type(L, 2);
+    lua_Integer columns = luaL_optinteger(L, 3, 1);
+    const char *extension = strrchr(filename, '.');
+    struct stream_handle *handle;
+    struct stream_t *stream;
+    int format, error;
+
+    luaL_argcheck(L, (columns >= 1) && (columns <= UINT32_MAX), 3, "invalid number of columns");
+
+    // Format defaults to NPY for .npy files
+    format = ((extension != NULL) && (strcmp(extension, ".npy") == 0)) ? STREAM_NPY : STREAM_BINARY;
+    if (!lua_isnoneornil(L, 4))
+        format = luaL_checkoption(L, 4, NULL, formats);
+
+    handle = lua_newuserdata(L, sizeof(struct stream_handle));
+    handle->stream = NULL;
+    luaL_getmetatable(L, STREAM_METATABLE);
+    lua_setmetatable(L, -2);
+
+    stream = calloc(1, sizeof(struct stream_t));
+    if (stream == NULL)
+        return luaL_error(L, "stream: out of memory");
+    stream->format = format;
+    stream->type = type;
+    stream->element_size = array_element_size(type);
+    stream->columns = columns;
+    stream->filename = strdup(filename);
+
+    stream->file = fopen(filename, "wb");
+    if (stream->file == NULL)
+        goto error;
+    error = stream_write_header(stream);
+    if (error != 0)
+    {
+        fclose(stream->file);
+        errno = error;
+        goto error;
+    }
+
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond_work, NULL);
+    pthread_cond_init(&stream->cond_space, NULL);
+    error = pthread_create(&stream->thread, NULL, stream_writer, stream);
+    if (error != 0)
+    {
+        fclose(stream->file);
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->cond_work);
+        pthread_cond_destroy(&stream->cond_space);
+        errno = error;
+        goto error;
+    }
+
+    handle->stream = stream;
+
+    return 1;
+
+error:
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    free(stream->filename);
+    free(stream);
+    return 2;
+}
+
+// lua: status, message = stream_write(stream, array|table|value, ...)
+static int stream_write(lua_State *L)
+{
+    struct stream_t *stream = stream_check(L, 1)->stream;
+    int argc = lua_gettop(L);
+    struct array *array;
+    size_t length, i;
+    bool ok = true;
+    int error;
+
+    pthread_mutex_lock(&stream->mutex);
+    error = stream->error;
+    pthread_mutex_unlock(&stream->mutex);
+    if (error != 0)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", stream->filename, strerror(error));
+        return 2;
+    }
+
+    if (lua_isuserdata(L, 2))
+    {
+        array = array_check(L, 2);
+        luaL_argcheck(L, array->length % stream->columns == 0, 2, "length is not a multiple of columns");
+        if (array->type == stream->type)
+            ok = stream_append_raw(stream, array->data, array->length);
+        else
+        {
+            for (i=0; ok && (i<array->length); i++)
+                ok = stream_append(stream, array_element_get(array->type, array->data, i));
+        }
+    }
+    else if (lua_istable(L, 2))
+    {
+        length = lua_rawlen(L, 2);
+        luaL_argcheck(L, length % stream->columns == 0, 2, "length is not a multiple of columns");
+        for (i=1; i<=length; i++)
+        {
+            lua_rawgeti(L, 2, i);
+            if (!lua_isnumber(L, -1))
+                return luaL_argerror(L, 2, "table contains non-numeric value");
+            lua_pop(L, 1);
+        }
+        for (i=1; ok && (i<=length); i++)
+        {
+            lua_rawgeti(L, 2, i);
+            ok = stream_append(stream, lua_tonumber(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    else
+    {
+        luaL_argcheck(L, (argc - 1) % stream->columns == 0, 2, "number of values is not a multiple of columns");
+        for (i=2; i<=(size_t) argc; i++)
+            luaL_checknumber(L, i);
+        for (i=2; ok && (i<=(size_t) argc); i++)
+            ok = stream_append(stream, lua_tonumber(L, i));
+    }
+
+    if (!ok)
+        return luaL_error(L, "stream: out of memory");
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// lua: status, message = stream_close(stream)
+static int stream_close(lua_State *L)
+{
+    struct stream_handle *handle = stream_check(L, 1);
+    char *filename = strdup(handle->stream->filename);
+    int error;
+
+    error = stream_finish(handle->stream);
+    handle->stream = NULL;
+
+    if (error != 0)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", filename, strerror(error));
+        free(filename);
+        return 2;
+    }
+
+    free(filename);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int stream_gc(lua_State *L)
+{
+    struct stream_handle *handle = luaL_checkudata(L, 1, STREAM_METATABLE);
+
+    // Streams which are never closed are completed when collected
+    if (handle->stream != NULL)
+        stream_finish(handle->stream);
+    handle->stream = NULL;
+
+    return 0;
+}
+
+int lua_register_stream(lua_State *L)
+{
+    luaL_newmetatable(L, STREAM_METATABLE);
+    lua_pushcfunction(L, stream_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    lua_register(L, "stream_open", stream_open);
+    lua_register(L, "stream_write", stream_write);
+    lua_register(L, "stream_close", stream_close);
+
+    return 0;
+}
@@ -0,0 +1,870 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "error.h"
+#include "misc.h"
+#include "lxilua.h"
+#include "spawn.h"
+#include "bytecode.h"
+#include "run.h"
+#include "testcase.h"
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+
+#define TEST_STATE_KEY "lxi.test"
+
+enum test_status
+{
+    TEST_NOT_RUN,
+    TEST_RUNNING,
+    TEST_PASS,
+    TEST_FAIL,
+    TEST_ERROR,
+    TEST_SKIP,
+};
+
+static const char *test_status_name[] =
+{
+    "not run", "running", "pass", "fail", "error", "skip"
+};
+
+struct test_case
+{
+    char *name;
+    int line_begin;         // Line of test case comment
+    int line_end;           // Line after last line of test case
+    enum test_status status;
+    double start;
+    double duration;
+    char *message;
+};
+
+struct test_suite
+{
+    char *filename;
+    char **args;
+    int arg_count;
+    char *source;           // Script with lines zero terminated
+    char **lines;
+    int line_count;
+    int epilogue_begin;     // Line of '-- tc end' (or line count)
+    char **targets;         // Targets to run test cases against (or NULL)
+    int target_count;       // Number of targets (1 if no targets)
+    int case_count;         // Number of test cases per target
+    struct test_case *cases;    // Test cases of first target, then next, ...
+    int count;
+    bool per_case;          // Run each test case in its own Lua state
+    int units;              // Number of Lua states to run
+    int next;               // Next Lua state to run
+    int *stop;              // Test case index after which test cases are
+                            // skipped as fail_stop() was called (per target)
+    double start;
+    pthread_mutex_t mutex;
+};
+
+// Test context of Lua state
+struct test_state
+{
+    struct test_suite *suite;
+    int target;
+    int current;            // Index of running test case or -1
+    bool stopped;
+    bool epilogue;          // Code after '-- tc end' reached
+};
+
+// Skip test cases of target after index which have not started
+static void test_stop(struct test_suite *suite, int target, int index)
+{
+    pthread_mutex_lock(&suite->mutex);
+    if (index < suite->stop[target])
+        suite->stop[target] = index;
+    pthread_mutex_unlock(&suite->mutex);
+}
+
+static struct test_state *test_state_get(lua_State *L)
+{
+    struct test_state *state;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, TEST_STATE_KEY);
+    state = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return state;
+}
+
+// Parse '-- tc "<description>"' (returns description) or '-- tc end' comment
+static char *test_marker(const char *line, bool *end)
+{
+    const char *name, *quote;
+    char *description;
+
+    *end = false;
+
+    while (isspace((unsigned char) *line))
+        line++;
+    if (strncmp(line, "--", 2) != 0)
+        return NULL;
+    line += 2;
+    while (isspace((unsigned char) *line))
+        line++;
+    if ((strncmp(line, "tc", 2) != 0) || !isspace((unsigned char) line[2]))
+        return NULL;
+    line += 2;
+    while (isspace((unsigned char) *line))
+        line++;
+
+    if (strncmp(line, "end", 3) == 0)
+    {
+        *end = true;
+        return NULL;
+    }
+
+    if (*line != '"')
+        return NULL;
+    name = line + 1;
+    quote = strchr(name, '"');
+    if (quote == NULL)
+        return NULL;
+
+    description = malloc(quote - name + 1);
+    if (description == NULL)
+        return NULL;
+    memcpy(description, name, quote - name);
+    description[quote - name] = 0;
+
+    return description;
+}
+
+static int test_suite_load(struct test_suite *suite, char *filename)
+{
+    struct test_case *cases;
+    FILE *file;
+    long size;
+    char *line, *name;
+    bool end;
+    int i;
+
+    memset(suite, 0, sizeof(struct test_suite));
+    suite->filename = filename;
+    pthread_mutex_init(&suite->mutex, NULL);
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        error_printf("Unable to open file %s\n", filename);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    suite->source = malloc(size + 1);
+    if ((suite->source == NULL) || (fread(suite->source, 1, size, file) != (size_t) size))
+    {
+        error_printf("Unable to read file %s\n", filename);
+        fclose(file);
+        return 1;
+    }
+    suite->source[size] = 0;
+    fclose(file);
+
+    // Split into lines
+    suite->lines = malloc((size + 1) * sizeof(char *));
+    if (suite->lines == NULL)
+        return 1;
+    for (line = suite->source; line != NULL; )
+    {
+        suite->lines[suite->line_count++] = line;
+        line = strchr(line, '\n');
+        if (line != NULL)
+            *line++ = 0;
+    }
+
+    // Find test cases
+    suite->epilogue_begin = suite->line_count;
+    for (i=0; i<suite->line_count; i++)
+    {
+        name = test_marker(suite->lines[i], &end);
+        if (end)
+        {
+            suite->epilogue_begin = i;
+            break;
+        }
+        if (name == NULL)
+            continue;
+
+        cases = realloc(suite->cases, (suite->case_count + 1) * sizeof(struct test_case));
+        if (cases == NULL)
+        {
+            free(name);
+            return 1;
+        }
+        suite->cases = cases;
+        memset(&suite->cases[suite->case_count], 0, sizeof(struct test_case));
+        suite->cases[suite->case_count].name = name;
+        suite->cases[suite->case_count].line_begin = i;
+        if (suite->case_count > 0)
+            suite->cases[suite->case_count - 1].line_end = i;
+        suite->case_count++;
+    }
+    suite->count = suite->case_count;
+    if (suite->case_count > 0)
+        suite->cases[suite->case_count - 1].line_end = suite->epilogue_begin;
+
+    if (suite->case_count == 0)
+    {
+        error_printf("No test cases found (mark test cases with -- tc \"<description>\")\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+// Repeat test cases for each target, named by target
+static int test_suite_targets(struct test_suite *suite, char **targets, int target_count)
+{
+    struct test_case *cases, *test_case;
+    char *name;
+    int target, i;
+
+    suite->targets = targets;
+    suite->target_count = target_count;
+
+    cases = realloc(suite->cases, target_count * suite->case_count * sizeof(struct test_case));
+    if (cases == NULL)
+        return 1;
+    suite->cases = cases;
+
+    for (target=target_count - 1; target>=0; target--)
+    {
+        for (i=0; i<suite->case_count; i++)
+        {
+            test_case = &suite->cases[target * suite->case_count + i];
+            *test_case = suite->cases[i];
+            name = malloc(strlen(targets[target]) + strlen(suite->cases[i].name) + 4);
+            if (name == NULL)
+                return 1;
+            sprintf(name, "[%s] %s", targets[target], suite->cases[i].name);
+            if (target == 0)
+                free(test_case->name);
+            test_case->name = name;
+        }
+    }
+    suite->count = target_count * suite->case_count;
+
+    return 0;
+}
+
+static void test_suite_free(struct test_suite *suite)
+{
+    int i;
+
+    for (i=0; i<suite->count; i++)
+    {
+        free(suite->cases[i].name);
+        free(suite->cases[i].message);
+    }
+    free(suite->cases);
+    free(suite->lines);
+    free(suite->source);
+    free(suite->stop);
+    pthread_mutex_destroy(&suite->mutex);
+}
+
+// Build chunk to run. Test cases are turned into functions which are run
+// under pcall() by _tc_case() and lines not part of chunk are blanked so that
+// line numbers of error messages match the script. Code before the first test
+// case is always included. A test case index of -1 includes all test cases.
+static char *test_source(struct test_suite *suite, int index, bool epilogue)
+{
+    size_t size = 16;
+    char *source, *p;
+    int i, line, first, last;
+    bool open = false;
+
+    for (i=0; i<suite->line_count; i++)
+        size += strlen(suite->lines[i]) + 48;
+    source = malloc(size + 1);
+    if (source == NULL)
+        return NULL;
+
+    // Lines of test cases to include
+    first = suite->cases[0].line_begin;
+    last = suite->epilogue_begin;
+    if (index >= 0)
+    {
+        first = suite->cases[index].line_begin;
+        last = suite->cases[index].line_end;
+    }
+    else if (epilogue)
+        first = last;
+
+    p = source;
+    for (line=0, i=0; line<suite->line_count; line++)
+    {
+        if ((i < suite->case_count) && (suite->cases[i].line_begin < line))
+            i++;
+
+        // End function of test case at next test case or '-- tc end'
+        if (open && ((line == last) || ((i < suite->case_count) && (suite->cases[i].line_begin == line))))
+        {
+            p += sprintf(p, "end) ");
+            open = false;
+        }
+
+        if (line < suite->cases[0].line_begin)
+            p += sprintf(p, "%s", suite->lines[line]);
+        else if ((line >= first) && (line < last))
+        {
+            if ((i < suite->case_count) && (suite->cases[i].line_begin == line))
+            {
+                p += sprintf(p, "_tc_case(%d, function()", i);
+                open = true;
+            }
+            else
+                p += sprintf(p, "%s", suite->lines[line]);
+        }
+        else if (line == suite->epilogue_begin)
+        {
+            if ((index < 0) && !epilogue)
+                p += sprintf(p, "_tc_end()");
+        }
+        else if ((line > suite->epilogue_begin) && (index < 0))
+            p += sprintf(p, "%s", suite->lines[line]);
+        *p++ = '\n';
+    }
+    if (open)
+        p += sprintf(p, "end)\n");
+    *p = 0;
+
+    return source;
+}
+
+static void test_case_print(struct test_case *test_case)
+{
+    char status[16];
+    int i;
+
+    for (i=0; test_status_name[test_case->status][i] != 0; i++)
+        status[i] = toupper((unsigned char) test_status_name[test_case->status][i]);
+    status[i] = 0;
+
+    // Single call so lines do not mix with output of other targets
+    printf("[%s] %s (%.3f s)%s%s\n", status, test_case->name, test_case->duration,
+           test_case->message != NULL ? ": " : "", test_case->message != NULL ? test_case->message : "");
+    fflush(stdout);
+}
+
+// Finish running test case of state
+static void test_case_finish(struct test_state *state, enum test_status status, const char *message)
+{
+    struct test_suite *suite = state->suite;
+    struct test_case *test_case;
+
+    if (state->current < 0)
+        return;
+
+    pthread_mutex_lock(&suite->mutex);
+    test_case = &suite->cases[state->current];
+    test_case->duration = time_now() - test_case->start;
+
+    // Failure reported via fail() sticks
+    if (test_case->status != TEST_FAIL)
+    {
+        test_case->status = status;
+        if (message != NULL)
+            test_case->message = strdup(message);
+    }
+    test_case_print(test_case);
+    pthread_mutex_unlock(&suite->mutex);
+
+    state->current = -1;
+}
+
+// lua: _tc_case(index, function)
+static int tc_case(lua_State *L)
+{
+    struct test_state *state = test_state_get(L);
+    int case_index = luaL_checkinteger(L, 1);
+    struct test_suite *suite;
+    int status, index;
+    bool stop;
+
+    luaL_argcheck(L, (state != NULL) && (case_index >= 0) && (case_index < state->suite->case_count), 1, "invalid test case");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    suite = state->suite;
+    index = state->target * suite->case_count + case_index;
+
+    // Test cases after fail_stop() are skipped
+    pthread_mutex_lock(&suite->mutex);
+    stop = case_index > suite->stop[state->target];
+    if (!stop)
+    {
+        suite->cases[index].status = TEST_RUNNING;
+        suite->cases[index].start = time_now();
+    }
+    pthread_mutex_unlock(&suite->mutex);
+    if (stop)
+        return 0;
+
+    // Error ends test case but not script
+    state->current = index;
+    lua_pushvalue(L, 2);
+    status = lua_pcall(L, 0, 0, 0);
+    if (status == 0)
+        test_case_finish(state, TEST_PASS, NULL);
+    else
+        test_case_finish(state, state->stopped ? TEST_FAIL : TEST_ERROR, lua_tostring(L, -1));
+
+    if (state->stopped)
+    {
+        test_stop(suite, state->target, case_index);
+        state->stopped = false;
+    }
+
+    return 0;
+}
+
+// lua: _tc_end()
+static int tc_end(lua_State *L)
+{
+    struct test_state *state = test_state_get(L);
+
+    if (state != NULL)
+        state->epilogue = true;
+
+    return 0;
+}
+
+static void test_fail(lua_State *L, struct test_state *state)
+{
+    struct test_case *test_case;
+
+    if ((state == NULL) || (state->current < 0))
+        return;
+
+    // Message is location of call plus optional message
+    if (lua_isstring(L, 1))
+        lua_pushvalue(L, 1);
+    else
+        lua_pushliteral(L, "Failed");
+    luaL_where(L, 1);
+    lua_insert(L, -2);
+    lua_concat(L, 2);
+
+    pthread_mutex_lock(&state->suite->mutex);
+    test_case = &state->suite->cases[state->current];
+    if (test_case->status != TEST_FAIL)
+    {
+        test_case->status = TEST_FAIL;
+        free(test_case->message);
+        test_case->message = strdup(lua_tostring(L, -1));
+    }
+    pthread_mutex_unlock(&state->suite->mutex);
+}
+
+// lua: fail(message)
+static int fail(lua_State *L)
+{
+    test_fail(L, test_state_get(L));
+    return 0;
+}
+
+// lua: fail_stop(message)
+static int fail_stop(lua_State *L)
+{
+    struct test_state *state = test_state_get(L);
+
+    test_fail(L, state);
+    if (state != NULL)
+        state->stopped = true;
+
+    return luaL_error(L, "Stopped by fail_stop()");
+}
+
+static void xml_print_string(FILE *file, const char *string)
+{
+    for (; *string != 0; string++)
+    {
+        switch (*string)
+        {
+            case '&': fputs("&amp;", file); break;
+            case '<': fputs("&lt;", file); break;
+            case '>': fputs("&gt;", file); break;
+            case '"': fputs("&quot;", file); break;
+            default: fputc(*string, file); break;
+        }
+    }
+}
+
+// Save results of count test cases from first as JSON (filename ending with
+// .json) or JUnit XML
+static int test_report_save(struct test_suite *suite, const char *filename, int first, int count)
+{
+    int failures = 0, errors = 0, skipped = 0, i;
+    struct test_case *test_case;
+    const char *extension;
+    FILE *file;
+
+    file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        error_printf("Unable to open file %s\n", filename);
+        return 1;
+    }
+
+    pthread_mutex_lock(&suite->mutex);
+
+    for (i=first; i<first + count; i++)
+    {
+        failures += suite->cases[i].status == TEST_FAIL;
+        errors += suite->cases[i].status == TEST_ERROR;
+        skipped += (suite->cases[i].status == TEST_SKIP) || (suite->cases[i].status == TEST_NOT_RUN);
+    }
+
+    extension = strrchr(filename, '.');
+    if ((extension != NULL) && (strcmp(extension, ".json") == 0))
+    {
+        fprintf(file, "{\n  \"suite\": ");
+        json_print_string(file, suite->filename);
+        fprintf(file, ",\n  \"time\": %.3f,\n  \"tests\": %d,\n  \"failures\": %d,\n  \"errors\": %d,\n  \"skipped\": %d,\n  \"cases\": [",
+                time_now() - suite->start, count, failures, errors, skipped);
+        for (i=first; i<first + count; i++)
+        {
+            test_case = &suite->cases[i];
+            fprintf(file, "%s\n    {\n      \"name\": ", i > first ? "," : "");
+            json_print_string(file, test_case->name);
+            fprintf(file, ",\n      \"status\": \"%s\",\n      \"time\": %.3f,\n      \"message\": ",
+                    test_status_name[test_case->status], test_case->duration);
+            if (test_case->message != NULL)
+                json_print_string(file, test_case->message);
+            else
+                fprintf(file, "null");
+            fprintf(file, "\n    }");
+        }
+        fprintf(file, "\n  ]\n}\n");
+    }
+    else
+    {
+        fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuite name=\"");
+        xml_print_string(file, suite->filename);
+        fprintf(file, "\" tests=\"%d\" failures=\"%d\" errors=\"%d\" skipped=\"%d\" time=\"%.3f\">\n",
+                count, failures, errors, skipped, time_now() - suite->start);
+        for (i=first; i<first + count; i++)
+        {
+            test_case = &suite->cases[i];
+            fprintf(file, "  <testcase name=\"");
+            xml_print_string(file, test_case->name);
+            fprintf(file, "\" classname=\"");
+            xml_print_string(file, suite->filename);
+            fprintf(file, "\" time=\"%.3f\"", test_case->duration);
+            if ((test_case->status == TEST_FAIL) || (test_case->status == TEST_ERROR))
+            {
+                fprintf(file, ">\n    <%s message=\"", test_case->status == TEST_FAIL ? "failure" : "error");
+                xml_print_string(file, test_case->message != NULL ? test_case->message : "");
+                fprintf(file, "\"/>\n  </testcase>\n");
+            }
+            else if ((test_case->status == TEST_SKIP) || (test_case->status == TEST_NOT_RUN))
+                fprintf(file, ">\n    <skipped/>\n  </testcase>\n");
+            else
+                fprintf(file, "/>\n");
+        }
+        fprintf(file, "</testsuite>\n");
+    }
+
+    pthread_mutex_unlock(&suite->mutex);
+    fclose(file);
+
+    return 0;
+}
+
+// lua: tc_save(filename)
+static int tc_save(lua_State *L)
+{
+    struct test_state *state = test_state_get(L);
+    const char *filename = luaL_checkstring(L, 1);
+
+    luaL_argcheck(L, state != NULL, 1, "no test cases");
+
+    // Test cases of target of state
+    lua_pushboolean(L, test_report_save(state->suite, filename, state->target * state->suite->case_count,
+                                        state->suite->case_count) == 0);
+    return 1;
+}
+
+static lua_State *test_state_new(struct test_suite *suite, int target, struct test_state **state)
+{
+    lua_State *L = luaL_newstate();
+
+    if (L == NULL)
+        return NULL;
+
+    luaL_openlibs(L);
+    lua_register_lxi(L);
+
+    lua_register(L, "_tc_case", tc_case);
+    lua_register(L, "_tc_end", tc_end);
+    lua_register(L, "fail", fail);
+    lua_register(L, "fail_stop", fail_stop);
+    lua_register(L, "tc_save", tc_save);
+
+    if (suite->targets != NULL)
+        run_target_setup(L, suite->targets[target]);
+    run_set_args(L, suite->filename, suite->args, suite->arg_count);
+
+    // Test context lives as long as Lua state
+    *state = lua_newuserdata(L, sizeof(struct test_state));
+    (*state)->suite = suite;
+    (*state)->target = target;
+    (*state)->current = -1;
+    (*state)->stopped = false;
+    (*state)->epilogue = false;
+    lua_setfield(L, LUA_REGISTRYINDEX, TEST_STATE_KEY);
+
+    return L;
+}
+
+// Run chunk for target in new Lua state. Returns false if stopped by error or
+// fail_stop().
+static bool test_run(struct test_suite *suite, int target, int index, bool epilogue)
+{
+    struct test_state *state;
+    const char *message;
+    char *source;
+    lua_State *L;
+    bool ok, epilogue_missed;
+
+    source = test_source(suite, index, epilogue);
+    L = test_state_new(suite, target, &state);
+    if ((source == NULL) || (L == NULL))
+    {
+        error_printf("Out of memory\n");
+        free(source);
+        if (L != NULL)
+            lua_close(L);
+        return false;
+    }
+
+    lua_pushfstring(L, "@%s", suite->filename);
+    ok = (bytecode_load(L, source, strlen(source), lua_tostring(L, -1)) == 0) &&
+         (lua_pcall(L, 0, 0, 0) == 0);
+    free(source);
+
+    if (!ok)
+    {
+        // Error outside of test case
+        message = lua_tostring(L, -1);
+        if (suite->targets != NULL)
+            error_printf("[%s] %s\n", suite->targets[target], message);
+        else
+            error_printf("%s\n", message);
+        if (index >= 0)
+        {
+            state->current = target * suite->case_count + index;
+            suite->cases[state->current].start = time_now();
+            test_case_finish(state, TEST_ERROR, message);
+        }
+    }
+
+    // fail_stop() outside of test case skips all test cases not started
+    if (state->stopped)
+        test_stop(suite, target, index - 1);
+
+    epilogue_missed = (index < 0) && !epilogue && !state->epilogue;
+    lua_close(L);
+
+    // Code after '-- tc end' always runs
+    if (epilogue_missed && (suite->epilogue_begin < suite->line_count))
+        test_run(suite, target, -1, true);
+
+    return ok;
+}
+
+static void *test_worker(void *data)
+{
+    struct test_suite *suite = data;
+    int unit, target, index;
+    bool stop;
+
+    while (true)
+    {
+        pthread_mutex_lock(&suite->mutex);
+        unit = suite->next++;
+        pthread_mutex_unlock(&suite->mutex);
+
+        if (unit >= suite->units)
+            break;
+
+        if (!suite->per_case)
+        {
+            // All test cases of target in sequence
+            test_run(suite, unit, -1, false);
+            continue;
+        }
+
+        target = unit / suite->case_count;
+        index = unit % suite->case_count;
+        pthread_mutex_lock(&suite->mutex);
+        stop = index > suite->stop[target];
+        pthread_mutex_unlock(&suite->mutex);
+        if (!stop)
+            test_run(suite, target, index, false);
+    }
+
+    return NULL;
+}
+
+int run_test(char *filename, char **args, int arg_count, int jobs, char *report_filename,
+             char *targets, int concurrency)
+{
+    struct test_suite suite;
+    pthread_t *threads;
+    char **target_list;
+    int passed = 0, failed = 0, skipped = 0, target_count, workers, i;
+
+    if (strlen(filename) == 0)
+    {
+        error_printf("Missing filename\n");
+        return 1;
+    }
+
+    if (test_suite_load(&suite, filename) != 0)
+    {
+        test_suite_free(&suite);
+        return 1;
+    }
+
+    suite.target_count = 1;
+    if (targets != NULL)
+    {
+        target_count = targets_parse(targets, &target_list);
+        if (target_count <= 0)
+        {
+            error_printf("No targets specified\n");
+            free(target_list);
+            test_suite_free(&suite);
+            return 1;
+        }
+        if (test_suite_targets(&suite, target_list, target_count) != 0)
+        {
+            error_printf("Out of memory\n");
+            targets_free(target_list, target_count);
+            test_suite_free(&suite);
+            return 1;
+        }
+    }
+
+    suite.stop = malloc(suite.target_count * sizeof(int));
+    if (suite.stop == NULL)
+    {
+        error_printf("Out of memory\n");
+        targets_free(suite.targets, suite.targets != NULL ? suite.target_count : 0);
+        test_suite_free(&suite);
+        return 1;
+    }
+    for (i=0; i<suite.target_count; i++)
+        suite.stop[i] = suite.case_count;
+
+    suite.args = args;
+    suite.arg_count = arg_count;
+    suite.start = time_now();
+
+    // By default all test cases of a target run in sequence in the same Lua
+    // state. With jobs > 1 each test case runs in its own Lua state, jobs at
+    // a time per target. Code before first test case is then run by each
+    // state and code after '-- tc end' is run once all test cases are done.
+    if ((concurrency <= 0) || (concurrency > suite.target_count))
+        concurrency = suite.target_count;
+    suite.per_case = jobs > 1;
+    suite.units = suite.per_case ? suite.count : suite.target_count;
+    workers = suite.per_case ? jobs * concurrency : concurrency;
+    if (workers > suite.units)
+        workers = suite.units;
+
+    threads = (workers > 1) ? malloc(workers * sizeof(pthread_t)) : NULL;
+    for (i=0; (threads != NULL) && (i<workers); i++)
+        if (pthread_create(&threads[i], NULL, test_worker, &suite) != 0)
+            break;
+    if ((threads == NULL) || (i == 0))
+        test_worker(&suite);
+    while (i-- > 0)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (suite.per_case && (suite.epilogue_begin < suite.line_count))
+        for (i=0; i<suite.target_count; i++)
+            test_run(&suite, i, -1, true);
+
+    // Spawned states may wait for values from test cases which failed with
+    // an error
+    for (i=0; i<suite.count; i++)
+    {
+        if (suite.cases[i].status == TEST_ERROR)
+        {
+            spawn_stop();
+            break;
+        }
+    }
+
+    // Wait for Lua states spawned by test cases
+    spawn_wait();
+
+    // Test cases never reached are skipped
+    for (i=0; i<suite.count; i++)
+    {
+        if (suite.cases[i].status == TEST_NOT_RUN)
+        {
+            suite.cases[i].status = TEST_SKIP;
+            test_case_print(&suite.cases[i]);
+        }
+        passed += suite.cases[i].status == TEST_PASS;
+        skipped += suite.cases[i].status == TEST_SKIP;
+        failed += (suite.cases[i].status == TEST_FAIL) || (suite.cases[i].status == TEST_ERROR);
+    }
+
+    printf("\n%d test cases: %d passed, %d failed, %d skipped (%.3f s)\n",
+           suite.count, passed, failed, skipped, time_now() - suite.start);
+
+    if ((report_filename != NULL) && (test_report_save(&suite, report_filename, 0, suite.count) != 0))
+        failed++;
+
+    if (suite.targets != NULL)
+        targets_free(suite.targets, suite.target_count);
+    test_suite_free(&suite);
+
+    return (failed > 0) || (skipped > 0);
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2022  Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "transcode.h"
+#include "error.h"
+#include "misc.h"
+
+#if HAVE_GDK_PIXBUF
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+struct transcode_job
+{
+    void *buffer;
+    void *data;
+    int length;
+    char *format;
+    char *filename;
+};
+
+static GAsyncQueue *transcode_queue = NULL;
+static GThread *transcode_thread = NULL;
+static char *transcode_format = NULL;
+static long transcode_bytes_in = 0;
+static long transcode_bytes_out = 0;
+static double transcode_time = 0;
+static int transcode_count = 0;
+
+// Marks end of queue
+static struct transcode_job transcode_job_stop;
+
+static void write_file(const char *filename, void *data, int length)
+{
+    FILE *fd;
+
+    fd = fopen(filename, "w+");
+    if (fd == NULL)
+    {
+        error_printf("Could not write screenshot file (%s)\n", filename);
+        return;
+    }
+    fwrite(data, 1, length, fd);
+    fclose(fd);
+}
+
+static void transcode_job_run(struct transcode_job *job)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf;
+    GError *error = NULL;
+    struct timespec start, stop;
+    gchar *buffer_out = NULL;
+    gsize length_out = 0;
+    char *filename, *extension;
+    double elapsed_time;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Decode captured image
+    loader = gdk_pixbuf_loader_new_with_type(job->format, NULL);
+    if (loader != NULL)
+    {
+        gdk_pixbuf_loader_write(loader, job->data, job->length, NULL);
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+    pixbuf = (loader != NULL) ? gdk_pixbuf_loader_get_pixbuf(loader) : NULL;
+
+    // Encode image in new format
+    if ((pixbuf == NULL) ||
+        (gdk_pixbuf_save_to_buffer(pixbuf, &buffer_out, &length_out, transcode_format, &error, NULL) == false))
+    {
+        error_printf("Failed to convert screenshot image, keeping %s format\n", job->format);
+        if (error != NULL)
+            g_error_free(error);
+        write_file(job->filename, job->data, job->length);
+        printf("Saved screenshot image to %s\n", job->filename);
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed_time = (double)(stop.tv_sec - start.tv_sec) * 1000 +
+                   (double)(stop.tv_nsec - start.tv_nsec) * 1.0e-6;
+
+    // Replace filename extension with new format
+    filename = g_strdup(job->filename);
+    extension = strrchr(filename, '.');
+    if ((extension != NULL) && (strchr(extension, '/') == NULL))
+        *extension = 0;
+    extension = g_strdup_printf("%s.%s", filename, transcode_format);
+    g_free(filename);
+    filename = extension;
+
+    write_file(filename, buffer_out, length_out);
+    printf("Saved screenshot image to %s (%s %d -> %s %d bytes, saved %ld bytes, encoded in %.1f ms)\n",
+           filename, job->format, job->length, transcode_format, (int) length_out,
+           (long) job->length - (long) length_out, elapsed_time);
+    fflush(stdout);
+
+    transcode_bytes_in += job->length;
+    transcode_bytes_out += length_out;
+    transcode_time += elapsed_time;
+    transcode_count++;
+
+    g_free(filename);
+    g_free(buffer_out);
+
+out:
+    if (loader != NULL)
+        g_object_unref(loader);
+}
+
+static gpointer transcode_worker_thread(gpointer data)
+{
+    struct transcode_job *job;
+
+    UNUSED(data);
+
+    // Transcode images in order of submission until stopped
+    while ((job = g_async_queue_pop(transcode_queue)) != &transcode_job_stop)
+    {
+        transcode_job_run(job);
+
+        free(job->buffer);
+        g_free(job->format);
+        g_free(job->filename);
+        g_free(job);
+    }
+
+    return NULL;
+}
+
+int transcode_start(const char *format)
+{
+    GSList *formats, *item;
+    bool writable = false;
+
+    // Check that image format can be written
+    formats = gdk_pixbuf_get_formats();
+    for (item = formats; item != NULL; item = item->next)
+    {
+        GdkPixbufFormat *pixbuf_format = item->data;
+        gchar *name = gdk_pixbuf_format_get_name(pixbuf_format);
+        if ((strcmp(name, format) == 0) && gdk_pixbuf_format_is_writable(pixbuf_format))
+            writable = true;
+        g_free(name);
+    }
+    g_slist_free(formats);
+
+    if (!writable)
+    {
+        error_printf("Unsupported image format '%s'\n", format);
+        return 1;
+    }
+
+    transcode_format = g_strdup(format);
+    transcode_queue = g_async_queue_new();
+    transcode_thread = g_thread_new("transcode_worker", transcode_worker_thread, NULL);
+
+    return 0;
+}
+
+bool transcode_active(void)
+{
+    return (transcode_thread != NULL);
+}
+
+void transcode_submit(void *buffer, void *data, int length, const char *format, const char *filename)
+{
+    struct transcode_job *job;
+
+    // Write image as is if already in requested format
+    if (strcmp(format, transcode_format) == 0)
+    {
+        write_file(filename, data, length);
+        printf("Saved screenshot image to %s\n", filename);
+        free(buffer);
+        return;
+    }
+
+    // Queue image for transcoding (takes ownership of buffer)
+    job = g_new0(struct transcode_job, 1);
+    job->buffer = buffer;
+    job->data = data;
+    job->length = length;
+    job->format = g_strdup(format);
+    job->filename = g_strdup(filename);
+    g_async_queue_push(transcode_queue, job);
+}
+
+void transcode_finish(void)
+{
+    if (transcode_thread == NULL)
+        return;
+
+    // Wait for queued images to be transcoded
+    g_async_queue_push(transcode_queue, &transcode_job_stop);
+    g_thread_join(transcode_thread);
+    transcode_thread = NULL;
+
+    if (transcode_count > 1)
+        printf("Converted %d images (%ld -> %ld bytes, saved %ld bytes, encoded in %.1f ms)\n",
+               transcode_count, transcode_bytes_in, transcode_bytes_out,
+               transcode_bytes_in - transcode_bytes_out, transcode_time);
+
+    g_async_queue_unref(transcode_queue);
+    g_free(transcode_format);
+}
+
+#else
+
+int transcode_start(const char *format)
+{
+    UNUSED(format);
+
+    error_printf("Image conversion not supported (built without gdk-pixbuf)\n");
+    return 1;
+}
+
+bool transcode_active(void)
+{
+    return false;
+}
+
+void transcode_submit(void *buffer, void *data, int length, const char *format, const char *filename)
+{
+    UNUSED(buffer);
+    UNUSED(data);
+    UNUSED(length);
+    UNUSED(format);
+    UNUSED(filename);
+}
+
+void transcode_finish(void)
+{
+}
+
+#endif